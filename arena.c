@@ -0,0 +1,146 @@
+#include "arena.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define DEFAULT_CHUNK_SIZE 4096
+// Chunks stop doubling at this size
+#define MAX_CHUNK_SIZE (1 << 20)
+#define ALIGN sizeof(max_align_t)
+
+// --- Static helper methods ---
+
+static size_t alignUp(size_t n, size_t align);
+static kdl_arenaChunk_t *addChunk(kdl_arena_t *a, size_t minSize);
+static void *allocAligned(kdl_arena_t *a, size_t size, size_t align);
+static void spliceChunks(kdl_arenaChunk_t **into, kdl_arenaChunk_t *list);
+
+size_t alignUp(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+// Makes a chunk of at least `minSize` bytes the head, from the spares if
+// one is big enough
+kdl_arenaChunk_t *addChunk(kdl_arena_t *a, size_t minSize) {
+    kdl_arenaChunk_t **i = &a->spare;
+    for (; *i && (*i)->size < minSize; i = &(*i)->prev);
+
+    kdl_arenaChunk_t *c = *i;
+    if (c) {
+        *i = c->prev;
+    } else {
+        size_t size = a->nextSize > minSize ? a->nextSize : minSize;
+        c = (kdl_arenaChunk_t *) a->s.malloc(sizeof(kdl_arenaChunk_t) + size);
+        c->size = size;
+        if (a->nextSize < MAX_CHUNK_SIZE) {
+            a->nextSize *= 2;
+        }
+    }
+    c->used = 0;
+    c->prev = a->head;
+    a->head = c;
+    return c;
+}
+
+void *allocAligned(kdl_arena_t *a, size_t size, size_t align) {
+    kdl_arenaChunk_t *c = a->head;
+    size_t start = alignUp(c->used, align);
+    if (start + size > c->size) {
+        c = addChunk(a, size);
+        start = 0;
+    }
+    c->used = start + size;
+    return (char *) c->data + start;
+}
+
+// Puts `list` in front of `*into`
+void spliceChunks(kdl_arenaChunk_t **into, kdl_arenaChunk_t *list) {
+    if (list == NULL) {
+        return;
+    }
+    kdl_arenaChunk_t *tail = list;
+    for (; tail->prev; tail = tail->prev);
+    tail->prev = *into;
+    *into = list;
+}
+
+// --- Exported methods ---
+
+// --- Allocation ---
+
+void *kdl_arena_alloc(kdl_arena_t *a, size_t size) {
+    a->last = allocAligned(a, size, ALIGN);
+    return a->last;
+}
+
+void *kdl_arena_grow(kdl_arena_t *a, void *p, size_t oldSize, size_t newSize) {
+    kdl_arenaChunk_t *c = a->head;
+    if (p != NULL && p == a->last) {
+        size_t start = (size_t) ((char *) p - (char *) c->data);
+        if (start + newSize <= c->size) {
+            c->used = start + newSize;
+            return p;
+        }
+    }
+    void *result = kdl_arena_alloc(a, newSize);
+    if (p != NULL) {
+        memcpy(result, p, oldSize < newSize ? oldSize : newSize);
+    }
+    return result;
+}
+
+char *kdl_arena_strndup(kdl_arena_t *a, const char *str, size_t len) {
+    char *result = (char *) allocAligned(a, sizeof(char) * (len + 1), 1);
+    memcpy(result, str, sizeof(char) * len);
+    result[len] = '\0';
+    return result;
+}
+
+kdl_arenaMark_t kdl_arena_mark(const kdl_arena_t *a) {
+    kdl_arenaMark_t m;
+    m.chunk = a->head;
+    m.used = a->head->used;
+    return m;
+}
+
+void kdl_arena_rewind(kdl_arena_t *a, kdl_arenaMark_t mark) {
+    while (a->head != mark.chunk) {
+        assert(a->head != NULL); // Error: mark is not from this arena
+        kdl_arenaChunk_t *c = a->head;
+        a->head = c->prev;
+        c->prev = a->spare;
+        a->spare = c;
+    }
+    assert(mark.used <= a->head->used);
+    a->head->used = mark.used;
+    a->last = NULL;
+}
+
+void kdl_arena_absorb(kdl_arena_t *a, kdl_arena_t *other) {
+    // Behind the head, which is still the one allocated from
+    spliceChunks(&a->head->prev, other->head);
+    spliceChunks(&a->spare, other->spare);
+    memset(other, 0, sizeof(kdl_arena_t));
+}
+
+// --- Memory and initailization ---
+
+void kdl_arena_free(kdl_arena_t *a) {
+    kdl_arenaChunk_t *lists[2] = {a->head, a->spare};
+    for (size_t l = 0; l < 2; l++) {
+        while (lists[l]) {
+            kdl_arenaChunk_t *prev = lists[l]->prev;
+            a->s.free(lists[l]);
+            lists[l] = prev;
+        }
+    }
+    memset(a, 0, sizeof(kdl_arena_t));
+}
+
+void kdl_arena_init(kdl_state_t s, kdl_arena_t *a, size_t chunkSize) {
+    memset(a, 0, sizeof(kdl_arena_t));
+    a->s = s;
+    a->nextSize = chunkSize ? chunkSize : DEFAULT_CHUNK_SIZE;
+    addChunk(a, 0);
+}
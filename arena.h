@@ -0,0 +1,64 @@
+#ifndef KDL_ARENA_H_INCLUDED
+#define KDL_ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+#include "def.h"
+
+// Bump allocator. Allocations are never freed one by one: either the
+// whole arena goes at once, or everything after a mark does (which suits
+// scratch memory used in a strictly nested way).
+
+// --- Structures ---
+
+typedef struct kdl_arenaChunk_p {
+    struct kdl_arenaChunk_p *prev;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} kdl_arenaChunk_t;
+
+typedef struct {
+    kdl_state_t s;
+    // The chunk being allocated from, the others are behind it
+    kdl_arenaChunk_t *head;
+    // Chunks given back by kdl_arena_rewind(), reused before allocating
+    kdl_arenaChunk_t *spare;
+    // Size of the next chunk. Doubles every time, up to a limit.
+    size_t nextSize;
+    // The last allocation, which can be grown in place
+    void *last;
+} kdl_arena_t;
+
+// Everything allocated after the mark was taken
+typedef struct {
+    kdl_arenaChunk_t *chunk;
+    size_t used;
+} kdl_arenaMark_t;
+
+// --- Allocation ---
+
+// Aligned for any type. Never returns NULL (for a non zero size).
+void *kdl_arena_alloc(kdl_arena_t *a, size_t size);
+// Resizes the last allocation in place if possible, otherwise copies it
+// to a new one. `p` may be NULL, or must come from kdl_arena_alloc().
+void *kdl_arena_grow(kdl_arena_t *a, void *p, size_t oldSize, size_t newSize);
+// Null terminated copy of `len` chars. Not aligned, so packs tightly.
+char *kdl_arena_strndup(kdl_arena_t *a, const char *str, size_t len);
+
+kdl_arenaMark_t kdl_arena_mark(const kdl_arena_t *a);
+// Frees everything allocated since `mark`. Chunks are kept for reuse.
+void kdl_arena_rewind(kdl_arena_t *a, kdl_arenaMark_t mark);
+
+// Takes over everything allocated from `other`, which is left empty. The
+// two must share a kdl_state_t. Rewinding `a` to a mark taken before this
+// is not allowed.
+void kdl_arena_absorb(kdl_arena_t *a, kdl_arena_t *other);
+
+// --- Memory and initailization ---
+
+void kdl_arena_free(kdl_arena_t *a);
+// `chunkSize` is the size of the first chunk, 0 for a default
+void kdl_arena_init(kdl_state_t s, kdl_arena_t *a, size_t chunkSize);
+
+#endif
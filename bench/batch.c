@@ -0,0 +1,72 @@
+// Compares kdl_machine_setInt() one name at a time against the batched
+// kdl_machine_setInts(), for "sensor frames" of random variables out of
+// machines of increasing size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "machine.h"
+
+#define FRAME_SIZE 256
+#define NAME_SIZE 32
+#define SETS_PER_RUN 4000000
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void runSize(size_t nVars) {
+    kdl_machine_t machine;
+    kdl_mkMachine(&machine);
+
+    char *names = (char *) malloc(NAME_SIZE * nVars);
+    for (size_t i = 0; i < nVars; i++) {
+        snprintf(names + NAME_SIZE * i, NAME_SIZE, "ship%zu sensor %zu", i / 8, i % 8);
+        kdl_machine_setInt(&machine, names + NAME_SIZE * i, 0);
+    }
+
+    size_t nFrames = SETS_PER_RUN / FRAME_SIZE;
+    const char **frames = (const char **) malloc(sizeof(char *) * FRAME_SIZE * nFrames);
+    kdl_int_t values[FRAME_SIZE];
+    srand(42);
+    for (size_t i = 0; i < FRAME_SIZE * nFrames; i++) {
+        frames[i] = names + NAME_SIZE * ((size_t) rand() % nVars);
+    }
+    for (size_t i = 0; i < FRAME_SIZE; i++) {
+        values[i] = (kdl_int_t) i;
+    }
+
+    double start = now();
+    for (size_t f = 0; f < nFrames; f++) {
+        const char **frame = frames + f * FRAME_SIZE;
+        for (size_t i = 0; i < FRAME_SIZE; i++) {
+            kdl_machine_setInt(&machine, frame[i], values[i]);
+        }
+    }
+    double single = (now() - start) / (FRAME_SIZE * nFrames);
+
+    start = now();
+    for (size_t f = 0; f < nFrames; f++) {
+        kdl_machine_setInts(&machine, frames + f * FRAME_SIZE, values, FRAME_SIZE);
+    }
+    double batched = (now() - start) / (FRAME_SIZE * nFrames);
+
+    printf("%-10zu %12.1f %12.1f %9.2fx\n", nVars, single, batched, single / batched);
+
+    free(frames);
+    free(names);
+    kdl_machine_free(&machine);
+}
+
+int main() {
+    printf("%-10s %12s %12s %10s\n", "variables", "setInt ns", "setInts ns", "speedup");
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+        runSize(sizes[i]);
+    }
+    return 0;
+}
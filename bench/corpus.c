@@ -0,0 +1,221 @@
+#include "corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+static const char *NAMES[] = {
+    "akatsuki", "fleet_commander", "armor", "health", "enemies", "closeToAkatsuki",
+    "weather_station_north", "raining", "prepared", "speed", "x", "reactor_core_temperature",
+};
+#define N_NAMES (sizeof(NAMES) / sizeof(NAMES[0]))
+
+static const char *VERBS[] = {
+    "do", "print", "dock", "travel", "writeInt", "writeFloat", "order", "radar",
+};
+#define N_VERBS (sizeof(VERBS) / sizeof(VERBS[0]))
+
+static const char *OPERATORS[] = {
+    "+", "-", "*", "/", "=", "<", ">", "<=", ">=", ",", ";",
+};
+#define N_OPERATORS (sizeof(OPERATORS) / sizeof(OPERATORS[0]))
+
+typedef struct {
+    const corpusOptions_t *o;
+    uint64_t seed;
+    char *data;
+    size_t length;
+    size_t size;
+} generator_t;
+
+// --- Static helper methods ---
+
+static size_t pick(generator_t *g, size_t n);
+static void put(generator_t *g, const char *format, ...);
+static void putName(generator_t *g);
+static void putTerm(generator_t *g, bool numbersOnly);
+static void putExpr(generator_t *g, size_t operators);
+static void putParam(generator_t *g);
+static void putMark(generator_t *g, size_t depth);
+static void putRule(generator_t *g, size_t depth);
+
+size_t pick(generator_t *g, size_t n) {
+    g->seed = g->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (size_t) (g->seed >> 33) % n;
+}
+
+void put(generator_t *g, const char *format, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(g->data + g->length, g->size - g->length, format, args);
+        va_end(args);
+        if ((size_t) n < g->size - g->length) {
+            g->length += (size_t) n;
+            return;
+        }
+        g->size *= 2;
+        g->data = (char *) realloc(g->data, g->size);
+    }
+}
+
+// Some names come with a number, so that contexts repeat, but not always
+void putName(generator_t *g) {
+    const char *name = NAMES[pick(g, N_NAMES)];
+    if (pick(g, 4) == 0) {
+        put(g, "%s%zu", name, pick(g, 64));
+    } else {
+        put(g, "%s", name);
+    }
+}
+
+void putTerm(generator_t *g, bool numbersOnly) {
+    switch (pick(g, numbersOnly ? 3 : 8)) {
+    case 0:
+        put(g, "%zu", pick(g, 1000));
+        break;
+    case 1:
+        put(g, "%zu.%zu", pick(g, 100), pick(g, 100));
+        break;
+    case 2:
+        put(g, "%zu%%", pick(g, 100));
+        break;
+    case 3:
+        put(g, "{>");
+        putName(g);
+        put(g, "}");
+        break;
+    case 4:
+        put(g, "{");
+        putName(g);
+        put(g, " ");
+        putName(g);
+        put(g, "}");
+        break;
+    case 5:
+        put(g, "!");
+        putName(g);
+        break;
+    default:
+        putName(g);
+    }
+}
+
+// Flat: nested parentheses are not allowed in expressions
+void putExpr(generator_t *g, size_t operators) {
+    putTerm(g, false);
+    for (size_t i = 0; i < operators; i++) {
+        const char *op = OPERATORS[pick(g, N_OPERATORS)];
+        put(g, " %s ", op);
+        putTerm(g, op[0] == '/');
+    }
+}
+
+// Parameters can't start with an operator, so no "!"
+void putParam(generator_t *g) {
+    switch (pick(g, 6)) {
+    case 0:
+        put(g, "[");
+        putName(g);
+        put(g, " ");
+        putName(g);
+        put(g, "]");
+        break;
+    case 1:
+        put(g, "(");
+        putExpr(g, (g->o->exprSize + 1) / 2);
+        put(g, ")");
+        break;
+    case 2:
+        put(g, "{>");
+        putName(g);
+        put(g, "}");
+        break;
+    case 3:
+        putName(g);
+        break;
+    default:
+        putTerm(g, true);
+    }
+}
+
+void putMark(generator_t *g, size_t depth) {
+    size_t words = 1 + pick(g, 3);
+    if (depth > 0 && pick(g, 3) == 0) {
+        for (size_t j = 1 + pick(g, 3); j > 0; j--) {
+            put(g, "^");
+        }
+        words = pick(g, 2);
+    }
+    for (size_t i = 0; i < words; i++) {
+        if (i > 0) {
+            put(g, " ");
+        }
+        putName(g);
+    }
+    put(g, ": ");
+}
+
+void putRule(generator_t *g, size_t depth) {
+    put(g, "(");
+    if (pick(g, 100) < g->o->marks) {
+        putMark(g, depth);
+    }
+    // Some rules always run
+    if (g->o->exprSize > 0 && pick(g, 8) != 0) {
+        putExpr(g, g->o->exprSize);
+        put(g, " ");
+    }
+    put(g, "?");
+
+    bool children = depth < g->o->depth && pick(g, 2) == 0;
+    // Rules with children need no verb
+    if (!children || pick(g, 4) != 0) {
+        put(g, " %s", VERBS[pick(g, N_VERBS)]);
+        for (size_t i = 0; i < g->o->params; i++) {
+            put(g, " ");
+            putParam(g);
+        }
+    }
+    if (children) {
+        put(g, " ::");
+        for (size_t i = 1 + pick(g, 2); i > 0; i--) {
+            put(g, "\n%*s", (int) (depth + 1) * 4, "");
+            putRule(g, depth + 1);
+        }
+    }
+    put(g, ")");
+}
+
+// --- Exported methods ---
+
+void defaultCorpusOptions(corpusOptions_t *o) {
+    o->rules = 0;
+    o->size = 1 << 20;
+    o->depth = 2;
+    o->marks = 50;
+    o->exprSize = 4;
+    o->params = 2;
+    o->seed = 1;
+}
+
+char *mkCorpus(const corpusOptions_t *o, size_t *length) {
+    generator_t g;
+    g.o = o;
+    g.seed = o->seed;
+    g.size = 4096;
+    g.length = 0;
+    g.data = (char *) malloc(g.size);
+    g.data[0] = '\0';
+
+    for (size_t r = 0; (o->rules == 0 || r < o->rules) && (o->size == 0 || g.length < o->size); r++) {
+        if (pick(&g, 10) == 0) {
+            put(&g, "# Rule %zu\n", r);
+        }
+        putRule(&g, 0);
+        put(&g, "\n");
+    }
+    *length = g.length;
+    return g.data;
+}
@@ -0,0 +1,32 @@
+#ifndef KDL_BENCH_CORPUS_H_INCLUDED
+#define KDL_BENCH_CORPUS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic programs for the benchmarks. Everything is picked with a
+// seeded generator, so the same options always give the same program, and
+// every program it gives parses.
+
+typedef struct {
+    // Stop at this many top level rules, or once the program is this many
+    // bytes, whichever comes first. 0 for no limit on either (not both).
+    size_t rules;
+    size_t size;
+    // How deep child programs ("? :: (...)") can go. 0 for none.
+    size_t depth;
+    // Percent of rules that start with a context mark ("a b:"). Marks in
+    // child rules may jump out of their parent's context ("^^c:").
+    size_t marks;
+    // Operators in a condition. Expression parameters get half as many.
+    size_t exprSize;
+    // Parameters given to each verb
+    size_t params;
+    uint64_t seed;
+} corpusOptions_t;
+
+void defaultCorpusOptions(corpusOptions_t *o);
+// Null terminated, malloc()'d. `length` does not count the terminator.
+char *mkCorpus(const corpusOptions_t *o, size_t *length);
+
+#endif
@@ -0,0 +1,67 @@
+// Writes a synthetic program (see corpus.h) to stdout:
+//   gencorpus [-r rules] [-s bytes] [-d depth] [-m marks%] [-e operators]
+//             [-p params] [-S seed]
+// The size may end in K or M. Without -r or -s it writes 1M.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+size_t parseSize(const char *s) {
+    char *end;
+    size_t n = (size_t) strtoull(s, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    corpusOptions_t o;
+    defaultCorpusOptions(&o);
+    bool sized = false;
+    int c;
+    while ((c = getopt(argc, argv, "r:s:d:m:e:p:S:")) != -1) {
+        switch (c) {
+        case 'r':
+            o.rules = parseSize(optarg);
+            if (!sized) {
+                o.size = 0;
+            }
+            break;
+        case 's':
+            o.size = parseSize(optarg);
+            sized = true;
+            break;
+        case 'd':
+            o.depth = parseSize(optarg);
+            break;
+        case 'm':
+            o.marks = parseSize(optarg);
+            break;
+        case 'e':
+            o.exprSize = parseSize(optarg);
+            break;
+        case 'p':
+            o.params = parseSize(optarg);
+            break;
+        case 'S':
+            o.seed = (uint64_t) strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rules] [-s bytes] [-d depth] [-m marks%%] [-e operators] [-p params] [-S seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t length;
+    char *corpus = mkCorpus(&o, &length);
+    fwrite(corpus, 1, length, stdout);
+    free(corpus);
+    return 0;
+}
@@ -0,0 +1,219 @@
+// Microbenchmarks for kdl_hashmap_t: insert, hit and miss lookups, remove
+// and iteration, for every combination of key count and key length.
+//
+// Prints one CSV line per operation and configuration (or one JSON object
+// per line with --json), so that runs on different commits can be diffed:
+//   op,keys,keyLen,nsPerOp,allocsPerOp,peakRssKb
+// Every configuration runs in its own process, so peakRssKb is the peak
+// of that configuration alone.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "hashmap.h"
+
+// Small maps are rebuilt until at least this many keys went through them
+#define MIN_OPS 2000000
+
+static const char ALPHABET[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+#define ALPHABET_SIZE (sizeof(ALPHABET) - 1)
+
+enum { OP_INSERT, OP_HIT, OP_MISS, OP_REMOVE, OP_ITERATE, OP_COUNT };
+static const char *OP_NAMES[OP_COUNT] = {"insert", "hit", "miss", "remove", "iterate"};
+
+// Totals while running, per operation once done
+typedef struct {
+    double ns;
+    double allocs;
+} opStats_t;
+
+static size_t allocs = 0;
+
+void *countMalloc(size_t n) {
+    allocs++;
+    return malloc(n);
+}
+
+void *countRealloc(void *p, size_t n) {
+    allocs++;
+    return realloc(p, n);
+}
+
+void countFree(void *p) {
+    free(p);
+}
+
+// The values are the keys themselves, nothing to free
+void noFree(kdl_state_t s, void *data) {
+    (void) s;
+    (void) data;
+}
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// `keyLen` characters, distinct for every `index`: its base 62 digits at
+// the end, so that long keys share a prefix like real names do. The
+// padding is not in ALPHABET, or it could pass for digits of another key.
+void mkKey(char *out, size_t keyLen, size_t index) {
+    size_t i = 0;
+    do {
+        assert(i < keyLen); // Error: key too short for the index
+        out[keyLen - 1 - i++] = ALPHABET[index % ALPHABET_SIZE];
+        index /= ALPHABET_SIZE;
+    } while (index > 0);
+    memset(out, '-', keyLen - i);
+    out[keyLen] = '\0';
+}
+
+void start(double *t, size_t *a) {
+    *a = allocs;
+    *t = now();
+}
+
+void stop(opStats_t *stats, double t, size_t a) {
+    stats->ns += now() - t;
+    stats->allocs += allocs - a;
+}
+
+void runConfig(size_t nKeys, size_t keyLen, opStats_t *stats) {
+    kdl_state_t s;
+    s.malloc = countMalloc;
+    s.realloc = countRealloc;
+    s.free = countFree;
+
+    // Hits first, then as many misses
+    size_t stride = keyLen + 1;
+    char *keys = (char *) malloc(stride * nKeys * 2);
+    for (size_t i = 0; i < nKeys * 2; i++) {
+        mkKey(keys + stride * i, keyLen, i);
+    }
+    char *misses = keys + stride * nKeys;
+
+    size_t rounds = MIN_OPS / nKeys;
+    if (rounds == 0) {
+        rounds = 1;
+    }
+
+    volatile size_t sink = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        kdl_hashmap_t m;
+        kdl_hashmap_init(s, &m, 4, noFree, NULL);
+        double t;
+        size_t a;
+
+        start(&t, &a);
+        for (size_t i = 0; i < nKeys; i++) {
+            kdl_hashmap_insert(&m, keys + stride * i, (void *) (keys + stride * i));
+        }
+        stop(&stats[OP_INSERT], t, a);
+
+        kdl_hashmap_result_t res;
+        start(&t, &a);
+        for (size_t i = 0; i < nKeys; i++) {
+            sink += kdl_hashmap_search(&m, keys + stride * i, &res);
+        }
+        stop(&stats[OP_HIT], t, a);
+
+        start(&t, &a);
+        for (size_t i = 0; i < nKeys; i++) {
+            sink += kdl_hashmap_search(&m, misses + stride * i, &res);
+        }
+        stop(&stats[OP_MISS], t, a);
+
+        start(&t, &a);
+        kdl_hashmap_result_t it = kdl_hashmap_first(&m);
+        for (; it.code == KDL_HASHMAP_EOK; kdl_hashmap_next(&m, &it)) {
+            sink += it.keyLength;
+        }
+        stop(&stats[OP_ITERATE], t, a);
+
+        // A removal needs a search to find the element
+        start(&t, &a);
+        for (size_t i = 0; i < nKeys; i++) {
+            kdl_hashmap_search(&m, keys + stride * i, &res);
+            kdl_hashmap_remove(&m, res);
+        }
+        stop(&stats[OP_REMOVE], t, a);
+
+        kdl_hashmap_free(&m);
+    }
+    (void) sink;
+
+    for (size_t i = 0; i < OP_COUNT; i++) {
+        stats[i].ns /= (double) (rounds * nKeys);
+        stats[i].allocs /= (double) (rounds * nKeys);
+    }
+    free(keys);
+}
+
+void printConfig(size_t nKeys, size_t keyLen, const opStats_t *stats, long peakRssKb, bool json) {
+    for (size_t i = 0; i < OP_COUNT; i++) {
+        if (json) {
+            printf("{\"op\":\"%s\",\"keys\":%zu,\"keyLen\":%zu,\"nsPerOp\":%.2f,\"allocsPerOp\":%.4f,\"peakRssKb\":%ld}\n",
+                   OP_NAMES[i], nKeys, keyLen, stats[i].ns, stats[i].allocs, peakRssKb);
+        } else {
+            printf("%s,%zu,%zu,%.2f,%.4f,%ld\n", OP_NAMES[i], nKeys, keyLen, stats[i].ns, stats[i].allocs, peakRssKb);
+        }
+    }
+    fflush(stdout);
+}
+
+// Runs in a child process, and sends the results back through a pipe
+bool forkConfig(size_t nKeys, size_t keyLen, bool json) {
+    fflush(stdout);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        opStats_t stats[OP_COUNT];
+        memset(stats, 0, sizeof(stats));
+        runConfig(nKeys, keyLen, stats);
+        ssize_t written = write(fds[1], stats, sizeof(stats));
+        _exit(written == (ssize_t) sizeof(stats) ? 0 : 1);
+    }
+    close(fds[1]);
+    opStats_t stats[OP_COUNT];
+    ssize_t got = read(fds[0], stats, sizeof(stats));
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || got != (ssize_t) sizeof(stats) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return false;
+    }
+    printConfig(nKeys, keyLen, stats, usage.ru_maxrss, json);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool json = argc > 1 && strcmp(argv[1], "--json") == 0;
+    if (!json) {
+        printf("op,keys,keyLen,nsPerOp,allocsPerOp,peakRssKb\n");
+    }
+    size_t keyLens[] = {4, 8, 16, 32, 64};
+    for (size_t nKeys = 16; nKeys <= (1 << 20); nKeys *= 4) {
+        for (size_t i = 0; i < sizeof(keyLens) / sizeof(size_t); i++) {
+            if (!forkConfig(nKeys, keyLens[i], json)) {
+                fprintf(stderr, "failed: %zu keys of length %zu\n", nKeys, keyLens[i]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+// kdl_parse() throughput over generated programs (see corpus.h) from 1KB
+// to 100MB, or over a file given as the first argument. A second argument
+// caps the generated sizes, in bytes (K and M work).
+//
+// For every size, prints the best of a few runs:
+//   tokens/s and rules/s (rules at every depth)
+//   allocs: calls to malloc() and realloc() in one parse
+//   alloc MB: bytes they asked for
+//   peak MB: the most that was allocated at once, program included
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "parser.h"
+#include "source.h"
+#include "corpus.h"
+
+static const size_t SIZES[] = {
+    1 << 10, 10 << 10, 100 << 10, 1 << 20, 10 << 20, 100 << 20,
+};
+#define N_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+// Small inputs are parsed again until this much time has gone by
+#define MIN_TIME 0.5
+#define MAX_RUNS 1000
+
+// Every allocation starts with its size
+#define HEADER sizeof(max_align_t)
+
+size_t allocs = 0;
+size_t allocated = 0;
+size_t live = 0;
+size_t peak = 0;
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void *countMalloc(size_t n) {
+    char *p = (char *) malloc(n + HEADER);
+    *((size_t *) p) = n;
+    allocs++;
+    allocated += n;
+    live += n;
+    if (live > peak) {
+        peak = live;
+    }
+    return p + HEADER;
+}
+
+void *countRealloc(void *ptr, size_t n) {
+    if (ptr == NULL) {
+        return countMalloc(n);
+    }
+    char *p = (char *) ptr - HEADER;
+    size_t old = *((size_t *) p);
+    p = (char *) realloc(p, n + HEADER);
+    *((size_t *) p) = n;
+    allocs++;
+    allocated += n;
+    live = live - old + n;
+    if (live > peak) {
+        peak = live;
+    }
+    return p + HEADER;
+}
+
+void countFree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    char *p = (char *) ptr - HEADER;
+    live -= *((size_t *) p);
+    free(p);
+}
+
+size_t countRules(const kdl_program_t *p) {
+    size_t n = p->length;
+    for (size_t i = 0; i < p->length; i++) {
+        n += countRules(&p->rules[i].execute.child);
+    }
+    return n;
+}
+
+size_t countTokens(const char *input, size_t length) {
+    const char *offset = input;
+    const char *end = input + length;
+    size_t tokens = 0;
+    bool eof = false;
+    while (true) {
+        kdl_token_t token;
+        size_t skip = 0;
+        if (kdl_nextToken(offset, end, &token, &skip, &eof).code != KDL_ERR_OK || eof) {
+            return tokens;
+        }
+        tokens++;
+        offset = token.value + token.valueLen + skip;
+    }
+}
+
+size_t parseSize(const char *s) {
+    char *end;
+    size_t n = (size_t) strtoull(s, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+    }
+    return n;
+}
+
+// False if it does not parse
+bool run(const char *name, const char *input, size_t length) {
+    kdl_state_t s;
+    s.malloc = countMalloc;
+    s.realloc = countRealloc;
+    s.free = countFree;
+
+    size_t tokens = countTokens(input, length);
+    size_t rules = 0;
+    size_t runAllocs = 0;
+    size_t runAllocated = 0;
+    size_t runPeak = 0;
+    double best = 0;
+    double total = 0;
+    for (size_t r = 0; r < MAX_RUNS && (r < 2 || total < MIN_TIME * 1e9); r++) {
+        allocs = allocated = live = peak = 0;
+        kdl_program_t program;
+        double t = now();
+        kdl_error_t e = kdl_parseN(s, input, length, &program);
+        t = now() - t;
+        if (e.code != KDL_ERR_OK) {
+            fprintf(stderr, "%s: %s at offset %zu\n", name, e.message, (size_t) (e.data - input));
+            return false;
+        }
+        runAllocs = allocs;
+        runAllocated = allocated;
+        runPeak = peak;
+        rules = countRules(&program);
+        kdl_freeProgram(s, &program);
+        total += t;
+        if (r == 0 || t < best) {
+            best = t;
+        }
+    }
+
+    double seconds = best / 1e9;
+    printf("%-10s %10zu %12.0f %12.0f %10zu %10.1f %9.1f %9.3f\n", name, rules,
+           tokens / seconds, rules / seconds, runAllocs,
+           runAllocated / 1048576.0, runPeak / 1048576.0, seconds * 1e3);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    printf("%-10s %10s %12s %12s %10s %10s %9s %9s\n",
+           "input", "rules", "tokens/s", "rules/s", "allocs", "alloc MB", "peak MB", "ms");
+
+    if (argc > 1 && argv[1][0] != '\0') {
+        kdl_state_t s;
+        s.malloc = malloc;
+        s.realloc = realloc;
+        s.free = free;
+        kdl_source_t source;
+        kdl_error_t e = kdl_source_openFile(s, argv[1], &source);
+        if (e.code != KDL_ERR_OK) {
+            fprintf(stderr, "%s: %s\n", e.message, argv[1]);
+            return 1;
+        }
+        bool ok = run(argv[1], source.data, source.length);
+        kdl_source_close(&source);
+        return ok ? 0 : 1;
+    }
+
+    size_t max = argc > 2 ? parseSize(argv[2]) : SIZES[N_SIZES - 1];
+    corpusOptions_t o;
+    defaultCorpusOptions(&o);
+    for (size_t i = 0; i < N_SIZES && SIZES[i] <= max; i++) {
+        size_t size = SIZES[i];
+        o.size = size;
+        size_t length;
+        char *corpus = mkCorpus(&o, &length);
+        char name[32];
+        if (size >= 1 << 20) {
+            snprintf(name, sizeof(name), "%zuMB", size >> 20);
+        } else {
+            snprintf(name, sizeof(name), "%zuKB", size >> 10);
+        }
+        bool ok = run(name, corpus, length);
+        free(corpus);
+        if (!ok) {
+            return 1;
+        }
+    }
+    return 0;
+}
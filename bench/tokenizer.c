@@ -0,0 +1,137 @@
+// Tokenizer throughput in MB/s, over a file given as the first argument or
+// over generated rules with long names, comments and indentation.
+//
+// Prints one CSV line per run:
+//   scan,bytes,tokens,checksum,mbPerSec
+// `scan` is the kind of character scanning compiled in (see scan.h). The
+// checksum covers every token's type, offset and length, so builds with
+// different scanning must print the same one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "parser.h"
+#include "source.h"
+
+// Generated input size
+#define CORPUS_SIZE (64 << 20)
+// Every run goes over the input this many times
+#define PASSES 5
+#define RUNS 3
+
+#if defined(KDL_NO_SIMD)
+#define SCAN_NAME "scalar"
+#elif defined(__AVX2__)
+#define SCAN_NAME "avx2"
+#elif defined(__SSE2__)
+#define SCAN_NAME "sse2"
+#else
+#define SCAN_NAME "scalar"
+#endif
+
+static const char *NAMES[] = {
+    "akatsuki", "fleet_commander_0", "armor", "health", "enemies", "closeToAkatsuki",
+    "weather_station_north", "raining", "prepared", "speed", "x", "reactor_core_temperature",
+};
+#define N_NAMES (sizeof(NAMES) / sizeof(NAMES[0]))
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+const char *name(size_t *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return NAMES[(*seed >> 33) % N_NAMES];
+}
+
+char *mkCorpus(size_t *length) {
+    char *out = (char *) malloc(CORPUS_SIZE + 1024);
+    size_t len = 0;
+    size_t seed = 1;
+    for (size_t r = 0; len < CORPUS_SIZE; r++) {
+        const char *a = name(&seed);
+        const char *b = name(&seed);
+        const char *c = name(&seed);
+        len += (size_t) sprintf(out + len,
+            "# Rule %zu, generated for %s\n"
+            "(%s %s: {>%s %s} < 0.%zu , %s >= %zu%% ? ::\n"
+            "        (%s_%zu ? do [travel home port %zu] ::\n"
+            "            (atHome ; !%s ? print [%s] ({%s} + %zu) {global %s})))\n\n",
+            r, a, a, b, b, c, r % 97, c, r % 100, a, r, r, b, c, a, r, b);
+    }
+    *length = len;
+    return out;
+}
+
+int main(int argc, char **argv) {
+#if defined(__AVX2__) && !defined(KDL_NO_SIMD)
+    if (!__builtin_cpu_supports("avx2")) {
+        fprintf(stderr, "skipped: this CPU has no AVX2\n");
+        return 0;
+    }
+#endif
+    kdl_state_t s;
+    s.malloc = malloc;
+    s.realloc = realloc;
+    s.free = free;
+
+    kdl_source_t source;
+    char *corpus = NULL;
+    const char *input;
+    size_t length;
+    if (argc > 1) {
+        kdl_error_t e = kdl_source_openFile(s, argv[1], &source);
+        if (e.code != KDL_ERR_OK) {
+            fprintf(stderr, "%s: %s\n", e.message, argv[1]);
+            return 1;
+        }
+        input = source.data;
+        length = source.length;
+    } else {
+        corpus = mkCorpus(&length);
+        input = corpus;
+    }
+
+    for (size_t r = 0; r < RUNS; r++) {
+        size_t tokens = 0;
+        uint64_t checksum = 0;
+        double t = now();
+        for (size_t p = 0; p < PASSES; p++) {
+            const char *offset = input;
+            const char *end = input + length;
+            bool eof = false;
+            while (true) {
+                kdl_token_t token;
+                size_t skip = 0;
+                kdl_error_t e = kdl_nextToken(offset, end, &token, &skip, &eof);
+                if (e.code != KDL_ERR_OK) {
+                    fprintf(stderr, "%s at offset %zu\n", e.message, (size_t) (e.data - input));
+                    return 1;
+                }
+                if (eof) {
+                    break;
+                }
+                tokens++;
+                checksum = checksum * 31 + (uint64_t) token.type;
+                checksum = checksum * 31 + (uint64_t) (token.value - input);
+                checksum = checksum * 31 + (uint64_t) token.valueLen;
+                offset = token.value + token.valueLen + skip;
+            }
+        }
+        double seconds = (now() - t) / 1e9;
+        printf("%s,%zu,%zu,%016llx,%.1f\n", SCAN_NAME, length, tokens / PASSES,
+               (unsigned long long) checksum, (double) length * PASSES / seconds / 1e6);
+    }
+
+    if (corpus) {
+        free(corpus);
+    } else {
+        kdl_source_close(&source);
+    }
+    return 0;
+}
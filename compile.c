@@ -0,0 +1,568 @@
+#include "compile.h"
+#include "hashmap.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAGIC "kdl"
+#define BYTE_ORDER_MARK 0x01020304u
+#define WRITER_BUFFER_SIZE 4096
+#define RELOC_BUFFER_SIZE 512
+#define ALIGN sizeof(max_align_t)
+// Binaries are linked to load at one of BASE_SLOTS addresses from here on
+#define BASE_ADDRESS ((uint64_t) 0x200000000000)
+#define BASE_SLOTS 4096
+#define BASE_SLOT_SIZE ((uint64_t) 1 << 32)
+
+// The binary being written
+typedef struct {
+    kdl_state_t s;
+    char *data;
+    size_t length;
+    size_t size;
+    uint64_t *relocs;
+    size_t nRelocs;
+    size_t relocsSize;
+    // Offsets of the strings written so far. Contexts repeat a lot, so
+    // each is only written once.
+    kdl_hashmap_t strings;
+    // The first lazy child that failed to parse
+    kdl_error_t error;
+    // Slots given so far, in the order rules and variable ops are written
+    size_t nRules;
+    size_t nVars;
+} writer_t;
+
+// A mapped binary being checked
+typedef struct {
+    const char *map;
+    size_t length;
+    // Rules the walk may still visit. There can't be more rules than fit
+    // in the file, unless programs share rules or loop.
+    size_t rulesLeft;
+    // The slots the next rule and variable op must have
+    size_t nRules;
+    size_t nVars;
+} checker_t;
+
+// --- Static helper methods ---
+
+static kdl_error_t mkBinaryError(int code, const char *message, const char *data);
+static void mkLayout(uint8_t *out);
+static size_t alignUp(size_t n, size_t align);
+static void noFree(kdl_state_t s, void *data);
+static size_t reserve(writer_t *w, size_t size, size_t align);
+static size_t writeBytes(writer_t *w, const void *src, size_t size, size_t align);
+static void setPointer(writer_t *w, size_t at, size_t target);
+static void writePointer(writer_t *w, size_t at, const void *src, size_t size, size_t align);
+static void writeString(writer_t *w, size_t at, const char *str);
+static void setField(writer_t *w, size_t at, const void *value, size_t size);
+static size_t reserveArray(writer_t *w, size_t at, const void *src, size_t size, size_t n);
+static void writeOp(writer_t *w, size_t at, const kdl_op_t *op);
+static void writeCompute(writer_t *w, size_t at, const kdl_compute_t *c);
+static void writeAction(writer_t *w, size_t at, const kdl_action_t *a);
+static void writeProgram(writer_t *w, size_t at, const kdl_program_t *p);
+static uint64_t pickBase(const char *data, size_t length);
+static kdl_error_t checkHeader(const char *map, size_t length);
+static kdl_error_t relocate(char *map, size_t length);
+static bool checkSpan(const checker_t *c, const void *ptr, size_t size, size_t align, size_t n);
+static bool checkString(const checker_t *c, const char *str);
+static bool checkOp(checker_t *c, const kdl_op_t *op);
+static bool checkCompute(checker_t *c, const kdl_compute_t *compute);
+static bool checkAction(checker_t *c, const kdl_action_t *a);
+static bool checkProgram(checker_t *c, const kdl_program_t *p);
+static kdl_error_t checkBody(const char *map, size_t length);
+
+kdl_error_t mkBinaryError(int code, const char *message, const char *data) {
+    kdl_error_t e;
+    e.code = code;
+    e.message = message;
+    e.data = data;
+    e.dataLen = 0;
+    e.hasDataLen = false;
+    return e;
+}
+
+void mkLayout(uint8_t *out) {
+    out[0] = sizeof(void *);
+    out[1] = sizeof(kdl_int_t);
+    out[2] = sizeof(kdl_float_t);
+    out[3] = sizeof(kdl_op_t);
+    out[4] = sizeof(kdl_rule_t);
+    out[5] = sizeof(kdl_program_t);
+}
+
+size_t alignUp(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+// The strings map holds offsets, not memory
+void noFree(kdl_state_t s, void *data) {
+    (void) s;
+    (void) data;
+}
+
+// Room for `size` zeroed bytes, returns their offset
+size_t reserve(writer_t *w, size_t size, size_t align) {
+    size_t start = alignUp(w->length, align);
+    if (start + size > w->size) {
+        while (start + size > w->size) {
+            w->size *= 2;
+        }
+        w->data = (char *) w->s.realloc(w->data, w->size);
+    }
+    memset(w->data + w->length, 0, start + size - w->length);
+    w->length = start + size;
+    return start;
+}
+
+size_t writeBytes(writer_t *w, const void *src, size_t size, size_t align) {
+    size_t at = reserve(w, size, align);
+    memcpy(w->data + at, src, size);
+    return at;
+}
+
+// Makes the pointer at `at` point to `target` once loaded
+void setPointer(writer_t *w, size_t at, size_t target) {
+    uintptr_t value = (uintptr_t) target;
+    memcpy(w->data + at, &value, sizeof(uintptr_t));
+    if (w->nRelocs == w->relocsSize) {
+        w->relocsSize *= 2;
+        w->relocs = (uint64_t *) w->s.realloc(w->relocs, sizeof(uint64_t) * w->relocsSize);
+    }
+    w->relocs[w->nRelocs++] = (uint64_t) at;
+}
+
+// Copies `src` and points the pointer at `at` to the copy. NULL stays NULL.
+void writePointer(writer_t *w, size_t at, const void *src, size_t size, size_t align) {
+    if (src == NULL) {
+        memset(w->data + at, 0, sizeof(void *));
+        return;
+    }
+    setPointer(w, at, writeBytes(w, src, size, align));
+}
+
+void writeString(writer_t *w, size_t at, const char *str) {
+    if (str == NULL) {
+        writePointer(w, at, NULL, 0, 1);
+        return;
+    }
+    kdl_hashmap_result_t res;
+    if (kdl_hashmap_search(&w->strings, str, &res) == KDL_HASHMAP_EOK) {
+        void *offset;
+        kdl_hashmap_get(&w->strings, res, &offset);
+        setPointer(w, at, (size_t) (uintptr_t) offset);
+        return;
+    }
+    size_t offset = writeBytes(w, str, strlen(str) + 1, 1);
+    kdl_hashmap_insert(&w->strings, str, (void *) (uintptr_t) offset);
+    setPointer(w, at, offset);
+}
+
+// Everything below fills in the zeroed structure at `at` one field at a
+// time, so that the padding stays zero and the same program always gives
+// the same file
+
+void setField(writer_t *w, size_t at, const void *value, size_t size) {
+    memcpy(w->data + at, value, size);
+}
+
+// Room for an array of `n` zeroed structures
+size_t reserveArray(writer_t *w, size_t at, const void *src, size_t size, size_t n) {
+    if (src == NULL) {
+        return 0;
+    }
+    size_t first = reserve(w, size * n, ALIGN);
+    setPointer(w, at, first);
+    return first;
+}
+
+void writeOp(writer_t *w, size_t at, const kdl_op_t *op) {
+    setField(w, at + offsetof(kdl_op_t, op), &op->op, sizeof(op->op));
+    if (op->op == KDL_OP_PVAR) {
+        size_t slot = w->nVars++;
+        setField(w, at + offsetof(kdl_op_t, slot), &slot, sizeof(slot));
+    }
+    writeString(w, at + offsetof(kdl_op_t, context), op->context);
+    size_t value = at + offsetof(kdl_op_t, value);
+    if (op->value == NULL) {
+        return;
+    }
+    switch (op->op) {
+    case KDL_OP_PINT:
+        writePointer(w, value, op->value, sizeof(kdl_int_t), sizeof(kdl_int_t));
+        break;
+    case KDL_OP_PFLOAT:
+    case KDL_OP_PPERC: {
+        // Stored as a value rather than copied, as long double has padding
+        // of its own
+        size_t f = reserve(w, sizeof(kdl_float_t), ALIGN);
+        *(kdl_float_t *) (w->data + f) = *(const kdl_float_t *) op->value;
+        setPointer(w, value, f);
+        break;
+    }
+    default:
+        // Names, and the spelling of operators
+        writeString(w, value, (const char *) op->value);
+    }
+}
+
+void writeCompute(writer_t *w, size_t at, const kdl_compute_t *c) {
+    setField(w, at + offsetof(kdl_compute_t, length), &c->length, sizeof(c->length));
+    size_t first = reserveArray(w, at + offsetof(kdl_compute_t, opers), c->opers, sizeof(kdl_op_t), c->length);
+    for (size_t i = 0; c->opers && i < c->length; i++) {
+        writeOp(w, first + sizeof(kdl_op_t) * i, &c->opers[i]);
+    }
+}
+
+void writeAction(writer_t *w, size_t at, const kdl_action_t *a) {
+    writeString(w, at + offsetof(kdl_action_t, context), a->context);
+    writeString(w, at + offsetof(kdl_action_t, verb), a->verb);
+    setField(w, at + offsetof(kdl_action_t, nParams), &a->nParams, sizeof(a->nParams));
+    size_t first = reserveArray(w, at + offsetof(kdl_action_t, params), a->params, sizeof(kdl_compute_t), a->nParams);
+    for (size_t i = 0; a->params && i < a->nParams; i++) {
+        writeCompute(w, first + sizeof(kdl_compute_t) * i, &a->params[i]);
+    }
+}
+
+// The arena and laziness stay behind. Slots are given again, from 0.
+void writeProgram(writer_t *w, size_t at, const kdl_program_t *p) {
+    // Lazy children are written parsed
+    if (p->lazy != NULL) {
+        kdl_error_t e = kdl_parseLazyChild(w->s, p->lazy);
+        if (e.code != KDL_ERR_OK && w->error.code == KDL_ERR_OK) {
+            w->error = e;
+        }
+        p = &p->lazy->program;
+    }
+    setField(w, at + offsetof(kdl_program_t, length), &p->length, sizeof(p->length));
+    size_t first = reserveArray(w, at + offsetof(kdl_program_t, rules), p->rules, sizeof(kdl_rule_t), p->length);
+    for (size_t i = 0; p->rules && i < p->length; i++) {
+        size_t r = first + sizeof(kdl_rule_t) * i;
+        const kdl_rule_t *rule = &p->rules[i];
+        size_t slot = w->nRules++;
+        setField(w, r + offsetof(kdl_rule_t, slot), &slot, sizeof(slot));
+        writeCompute(w, r + offsetof(kdl_rule_t, compute), &rule->compute);
+        size_t execute = r + offsetof(kdl_rule_t, execute);
+        writeProgram(w, execute + offsetof(kdl_execute_t, child), &rule->execute.child);
+        writeAction(w, execute + offsetof(kdl_execute_t, order), &rule->execute.order);
+    }
+}
+
+// Somewhere mappings are unlikely to be, and different for different
+// programs so that a process can map several at their own address
+uint64_t pickBase(const char *data, size_t length) {
+    uint64_t slot = kdl_hashmap_defaultHash(data, length, 0) % BASE_SLOTS;
+    return BASE_ADDRESS + slot * BASE_SLOT_SIZE;
+}
+
+kdl_error_t checkHeader(const char *map, size_t length) {
+    const kdl_binaryHeader_t *h = (const kdl_binaryHeader_t *) map;
+    uint8_t layout[sizeof(h->layout)];
+    mkLayout(layout);
+    if (length < sizeof(kdl_binaryHeader_t) || memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0) {
+        return mkBinaryError(KDL_ERR_VAL, "Not a compiled program", NULL);
+    }
+    if (h->version != KDL_BINARY_VERSION) {
+        return mkBinaryError(KDL_ERR_VAL, "Compiled program is of another version", NULL);
+    }
+    if (h->byteOrder != BYTE_ORDER_MARK || memcmp(h->layout, layout, sizeof(layout)) != 0) {
+        return mkBinaryError(KDL_ERR_VAL, "Compiled program is for another platform", NULL);
+    }
+    if (h->length != length ||
+        h->base % ALIGN != 0 ||
+        h->root % ALIGN != 0 || h->root > length - sizeof(kdl_program_t) ||
+        h->relocs % sizeof(uint64_t) != 0 || h->relocs > length ||
+        h->nRelocs > (length - h->relocs) / sizeof(uint64_t)) {
+        return mkBinaryError(KDL_ERR_VAL, "Compiled program is truncated", NULL);
+    }
+    return mkBinaryError(KDL_ERR_OK, "No error", NULL);
+}
+
+// Moves the pointers from `base` over to where the file is mapped
+kdl_error_t relocate(char *map, size_t length) {
+    const kdl_binaryHeader_t *h = (const kdl_binaryHeader_t *) map;
+    const uint64_t *relocs = (const uint64_t *) (map + h->relocs);
+    for (size_t i = 0; i < h->nRelocs; i++) {
+        uint64_t at = relocs[i];
+        if (at % sizeof(uintptr_t) != 0 || at > length - sizeof(uintptr_t)) {
+            return mkBinaryError(KDL_ERR_VAL, "Compiled program is corrupt", NULL);
+        }
+        uintptr_t *pointer = (uintptr_t *) (map + at);
+        if (*pointer - h->base >= length) {
+            return mkBinaryError(KDL_ERR_VAL, "Compiled program is corrupt", NULL);
+        }
+        *pointer = *pointer - h->base + (uintptr_t) map;
+    }
+    return mkBinaryError(KDL_ERR_OK, "No error", NULL);
+}
+
+// Every check below takes the pointers as they are once mapped (and
+// relocated), and fails on anything the compiler would not have written
+
+// `n` elements of `size` bytes at `ptr`, all inside the file. NULL only
+// if there are none.
+bool checkSpan(const checker_t *c, const void *ptr, size_t size, size_t align, size_t n) {
+    if (ptr == NULL) {
+        return n == 0;
+    }
+    if ((uintptr_t) ptr < (uintptr_t) c->map) {
+        return false;
+    }
+    size_t at = (size_t) ((uintptr_t) ptr - (uintptr_t) c->map);
+    return at <= c->length && at % align == 0 && n <= (c->length - at) / size;
+}
+
+// NULL is fine, otherwise it has to end inside the file
+bool checkString(const checker_t *c, const char *str) {
+    if (str == NULL) {
+        return true;
+    }
+    if (!checkSpan(c, str, 1, 1, 1)) {
+        return false;
+    }
+    size_t at = (size_t) (str - c->map);
+    return memchr(str, '\0', c->length - at) != NULL;
+}
+
+// Slots go up by one in the order things were written, so every one is
+// used once
+bool checkOp(checker_t *c, const kdl_op_t *op) {
+    if (op->op < KDL_OP_NOOP || op->op > KDL_OP_PPERC ||
+        op->slot != (op->op == KDL_OP_PVAR ? c->nVars++ : 0) || !checkString(c, op->context)) {
+        return false;
+    }
+    switch (op->op) {
+    case KDL_OP_PINT:
+        return op->value != NULL && checkSpan(c, op->value, sizeof(kdl_int_t), _Alignof(kdl_int_t), 1);
+    case KDL_OP_PFLOAT:
+    case KDL_OP_PPERC:
+        return op->value != NULL && checkSpan(c, op->value, sizeof(kdl_float_t), _Alignof(kdl_float_t), 1);
+    case KDL_OP_PSTR:
+    case KDL_OP_PVAR:
+        return op->value != NULL && checkString(c, (const char *) op->value);
+    default:
+        return checkString(c, (const char *) op->value);
+    }
+}
+
+// Also checks that the ops never pop more than they pushed, and leave
+// exactly one value behind (if there are any)
+bool checkCompute(checker_t *c, const kdl_compute_t *compute) {
+    if (!checkSpan(c, compute->opers, sizeof(kdl_op_t), _Alignof(kdl_op_t), compute->length)) {
+        return false;
+    }
+    size_t depth = 0;
+    for (size_t i = 0; i < compute->length; i++) {
+        const kdl_op_t *op = &compute->opers[i];
+        if (!checkOp(c, op)) {
+            return false;
+        }
+        switch (op->op) {
+        case KDL_OP_NOOP:
+            break;
+        case KDL_OP_PINT:
+        case KDL_OP_PFLOAT:
+        case KDL_OP_PSTR:
+        case KDL_OP_PVAR:
+        case KDL_OP_PPERC:
+            depth++;
+            break;
+        case KDL_OP_NOT:
+            if (depth < 1) {
+                return false;
+            }
+            break;
+        default:
+            if (depth < 2) {
+                return false;
+            }
+            depth--;
+        }
+    }
+    return compute->length == 0 || depth == 1;
+}
+
+bool checkAction(checker_t *c, const kdl_action_t *a) {
+    if (!checkString(c, a->context) || !checkString(c, a->verb) ||
+        !checkSpan(c, a->params, sizeof(kdl_compute_t), _Alignof(kdl_compute_t), a->nParams)) {
+        return false;
+    }
+    for (size_t i = 0; i < a->nParams; i++) {
+        // Parameters always have a value
+        if (a->params[i].length == 0 || !checkCompute(c, &a->params[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool checkProgram(checker_t *c, const kdl_program_t *p) {
+    if (p->arena != NULL || p->lazy != NULL || p->length > c->rulesLeft ||
+        !checkSpan(c, p->rules, sizeof(kdl_rule_t), _Alignof(kdl_rule_t), p->length)) {
+        return false;
+    }
+    c->rulesLeft -= p->length;
+    for (size_t i = 0; i < p->length; i++) {
+        const kdl_rule_t *r = &p->rules[i];
+        if (r->slot != c->nRules++) {
+            return false;
+        }
+        if (!checkCompute(c, &r->compute) || !checkProgram(c, &r->execute.child) ||
+            !checkAction(c, &r->execute.order)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Walks the whole program, so that nothing the machine follows can lead
+// out of the file
+kdl_error_t checkBody(const char *map, size_t length) {
+    const kdl_binaryHeader_t *h = (const kdl_binaryHeader_t *) map;
+    checker_t c;
+    c.map = map;
+    c.length = length;
+    c.rulesLeft = length / sizeof(kdl_rule_t);
+    c.nRules = 0;
+    c.nVars = 0;
+    if (!checkProgram(&c, (const kdl_program_t *) (map + h->root))) {
+        return mkBinaryError(KDL_ERR_VAL, "Compiled program is corrupt", NULL);
+    }
+    return mkBinaryError(KDL_ERR_OK, "No error", NULL);
+}
+
+// --- Exported methods ---
+
+// --- Compiling ---
+
+kdl_error_t kdl_compile(kdl_state_t s, const kdl_program_t *program, char **out, size_t *length) {
+    writer_t w;
+    w.s = s;
+    w.size = WRITER_BUFFER_SIZE;
+    w.length = 0;
+    w.data = (char *) s.malloc(w.size);
+    w.relocsSize = RELOC_BUFFER_SIZE;
+    w.nRelocs = 0;
+    w.relocs = (uint64_t *) s.malloc(sizeof(uint64_t) * w.relocsSize);
+    kdl_hashmap_init(s, &w.strings, 4, noFree, NULL);
+    w.error = mkBinaryError(KDL_ERR_OK, "No error", NULL);
+    w.nRules = 0;
+    w.nVars = 0;
+
+    size_t header = reserve(&w, sizeof(kdl_binaryHeader_t), ALIGN);
+    size_t root = reserve(&w, sizeof(kdl_program_t), ALIGN);
+    writeProgram(&w, root, program);
+    size_t relocs = writeBytes(&w, w.relocs, sizeof(uint64_t) * w.nRelocs, sizeof(uint64_t));
+
+    // Pointers are offsets until now
+    uint64_t base = pickBase(w.data, w.length);
+    for (size_t i = 0; i < w.nRelocs; i++) {
+        uintptr_t *pointer = (uintptr_t *) (w.data + w.relocs[i]);
+        *pointer += (uintptr_t) base;
+    }
+
+    kdl_binaryHeader_t h;
+    memset(&h, 0, sizeof(kdl_binaryHeader_t));
+    memcpy(h.magic, MAGIC, sizeof(h.magic));
+    h.version = KDL_BINARY_VERSION;
+    h.byteOrder = BYTE_ORDER_MARK;
+    mkLayout(h.layout);
+    h.length = w.length;
+    h.base = base;
+    h.root = root;
+    h.relocs = relocs;
+    h.nRelocs = w.nRelocs;
+    memcpy(w.data + header, &h, sizeof(kdl_binaryHeader_t));
+
+    s.free(w.relocs);
+    kdl_hashmap_free(&w.strings);
+    if (w.error.code != KDL_ERR_OK) {
+        s.free(w.data);
+        return w.error;
+    }
+    *out = w.data;
+    *length = w.length;
+    return w.error;
+}
+
+kdl_error_t kdl_compileFile(kdl_state_t s, const kdl_program_t *program, const char *path) {
+    char *data;
+    size_t length;
+    kdl_error_t e = kdl_compile(s, program, &data, &length);
+    if (e.code != KDL_ERR_OK) {
+        return e;
+    }
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        s.free(data);
+        return mkBinaryError(KDL_ERR_NTF, "Could not create compiled program file", path);
+    }
+    bool ok = fwrite(data, 1, length, f) == length;
+    ok = fclose(f) == 0 && ok;
+    s.free(data);
+    if (!ok) {
+        return mkBinaryError(KDL_ERR_VAL, "Could not write compiled program", path);
+    }
+    return e;
+}
+
+// --- Memory and initailization ---
+
+kdl_error_t kdl_binary_open(const char *path, kdl_binary_t *out) {
+    memset(out, 0, sizeof(kdl_binary_t));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return mkBinaryError(KDL_ERR_NTF, "Could not open compiled program file", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(kdl_binaryHeader_t)) {
+        close(fd);
+        return mkBinaryError(KDL_ERR_VAL, "Not a compiled program", path);
+    }
+    size_t length = (size_t) st.st_size;
+    kdl_binaryHeader_t h;
+    if (pread(fd, &h, sizeof(kdl_binaryHeader_t), 0) != (ssize_t) sizeof(kdl_binaryHeader_t)) {
+        close(fd);
+        return mkBinaryError(KDL_ERR_VAL, "Not a compiled program", path);
+    }
+    // Private, so that relocating only touches our copy of the pages. Where
+    // it was linked for, if possible, so that it needs no relocating at all.
+    void *map = mmap((void *) (uintptr_t) h.base, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return mkBinaryError(KDL_ERR_VAL, "Could not map compiled program", path);
+    }
+    kdl_error_t e = checkHeader((const char *) map, length);
+    if (e.code == KDL_ERR_OK && (uintptr_t) map != h.base) {
+        e = relocate((char *) map, length);
+    }
+    if (e.code == KDL_ERR_OK) {
+        e = checkBody((const char *) map, length);
+    }
+    // Nothing writes to it past here, machines keep their state elsewhere
+    if (e.code == KDL_ERR_OK && mprotect(map, length, PROT_READ) != 0) {
+        e = mkBinaryError(KDL_ERR_VAL, "Could not map compiled program", path);
+    }
+    if (e.code != KDL_ERR_OK) {
+        munmap(map, length);
+        e.data = path;
+        return e;
+    }
+    h = *(const kdl_binaryHeader_t *) map;
+    out->map = map;
+    out->length = length;
+    out->program = *(const kdl_program_t *) ((const char *) map + h.root);
+    return e;
+}
+
+void kdl_binary_close(kdl_binary_t *b) {
+    if (b->map) {
+        munmap(b->map, b->length);
+    }
+    memset(b, 0, sizeof(kdl_binary_t));
+}
@@ -0,0 +1,71 @@
+#ifndef KDL_COMPILE_H_INCLUDED
+#define KDL_COMPILE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "def.h"
+#include "parser.h"
+
+// Parsed programs saved as is, so that they can be mapped and run without
+// parsing again (see bytecode.md).
+// Structures are stored as they are in memory, pointers included, for
+// the file to be mapped at an address picked when compiling. Loading maps
+// it there (privately). If the address is taken, every pointer listed in
+// the relocation table is moved to where the file did get mapped.
+// Machines never write to it otherwise: what they keep for its rules and
+// ops is in tables of their own, by slot (see kdl_op_t.slot).
+// Loading then walks the whole program once, and refuses it if any
+// pointer, string or array (counts included) runs outside of the file, or
+// if any expression does not leave exactly one value.
+// Binaries are only portable between builds with the same layout, which
+// the header records. Anything else is refused when loading.
+
+#define KDL_BINARY_VERSION 2
+
+// --- Structures ---
+
+// At the start of the file. Integers are in the byte order of the machine
+// that compiled it (checked with `byteOrder`).
+typedef struct {
+    // "kdl\0"
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    // sizeof() of the pointers, kdl_int_t, kdl_float_t, kdl_op_t,
+    // kdl_rule_t and kdl_program_t
+    uint8_t layout[6];
+    uint16_t reserved;
+    uint64_t length;
+    // The address the pointers are for. The file is mapped there if the
+    // address is free, and relocated otherwise.
+    uint64_t base;
+    // Offset of the root kdl_program_t
+    uint64_t root;
+    // Offsets of the pointers in the file, as a uint64_t array
+    uint64_t relocs;
+    uint64_t nRelocs;
+} kdl_binaryHeader_t;
+
+// A mapped binary
+typedef struct {
+    void *map;
+    size_t length;
+    // Points into `map`
+    kdl_program_t program;
+} kdl_binary_t;
+
+// --- Compiling ---
+
+// `out` is allocated with `s`. Lazy child programs (see kdl_parseLazy())
+// are parsed first, so their errors come out here.
+kdl_error_t kdl_compile(kdl_state_t s, const kdl_program_t *program, char **out, size_t *length);
+kdl_error_t kdl_compileFile(kdl_state_t s, const kdl_program_t *program, const char *path);
+
+// --- Memory and initailization ---
+
+kdl_error_t kdl_binary_open(const char *path, kdl_binary_t *out);
+// The program can't be used after this
+void kdl_binary_close(kdl_binary_t *b);
+
+#endif
@@ -1,66 +1,420 @@
 #include "hashmap.h"
 
 #include <sys/types.h>
-#include <md5.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
-
-#define BUCKET_SIZE_STEP 4
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define KDL_HASHMAP_GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define KDL_HASHMAP_GROUP_WIDTH 16
+#else
+#define KDL_HASHMAP_GROUP_WIDTH 8
+#endif
+
+// Control bytes. Anything >= 0 is a full slot holding the 7 bit `h2` of
+// its key's hash.
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+// Keep the table at most 7/8 full
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// One bit per control byte in the group
+typedef uint32_t groupMask_t;
+
+// Number of old slots migrated by every insert, search and remove while
+// rehashing. Has to be large enough that the old table empties before the
+// new one fills up.
+#define REHASH_STEP 16
+
+// searchBatch() works on this many keys at a time. All the keys of a chunk
+// are hashed and prefetched before any of them is resolved.
+#define BATCH_CHUNK 32
+
+#define NO_FREE_ID ((size_t) -1)
+#define IDS_START_SIZE 16
 
 // --- Static helper methods ---
 
-static kdl_hashmap_hash_t stringMD5(const char *str);
-static int stringLength(const char *str);
-static int getIndex(const kdl_hashmap_t *m, const char *key);
-static int findIndex(kdl_hashmap_t *m, const char *key, size_t *bucket, size_t *data);
+static uint64_t rotl(uint64_t x, int r);
+static uint64_t fmix(uint64_t h);
+static uint64_t processEntropy(void);
+static uint64_t mkSeed(const kdl_hashmap_t *m);
+static size_t h1(uint64_t hash);
+static int8_t h2(uint64_t hash);
+static groupMask_t matchByte(const int8_t *group, int8_t value);
+static groupMask_t matchEmpty(const int8_t *group);
+static groupMask_t matchEmptyOrDeleted(const int8_t *group);
+static int lowestBit(groupMask_t mask);
+static bool isInlineKey(size_t keyLen);
+static const char *getKey(const kdl_hashmap_data_t *d);
+static void freeKey(kdl_hashmap_t *m, kdl_hashmap_data_t *d);
+static void setCtrl(kdl_hashmap_table_t *t, size_t i, int8_t value);
+static size_t findFreeSlot(const kdl_hashmap_table_t *t, uint64_t hash);
+static int findInTable(const kdl_hashmap_table_t *t, const char *key, size_t kLen, uint64_t hash, size_t *slot);
+static void putInTable(kdl_hashmap_t *m, kdl_hashmap_table_t *t, kdl_hashmap_data_t e);
+static uint32_t allocId(kdl_hashmap_t *m);
+static void releaseId(kdl_hashmap_t *m, uint32_t id);
+static kdl_hashmap_handle_t mkHandle(const kdl_hashmap_t *m, uint32_t id);
+static void prefetchProbe(const kdl_hashmap_table_t *t, uint64_t hash);
+static int lookup(const kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, kdl_hashmap_result_t *result);
+static void allocTable(kdl_hashmap_t *m, kdl_hashmap_table_t *t, size_t capacity);
+static void freeTableData(kdl_hashmap_t *m, kdl_hashmap_table_t *t);
+static kdl_hashmap_table_t *getTable(kdl_hashmap_t *m, size_t which);
+static void rehashStep(kdl_hashmap_t *m, size_t slots);
+static void finishRehash(kdl_hashmap_t *m);
+static void startRehash(kdl_hashmap_t *m, size_t capacity);
+static size_t capacityFor(size_t elements);
+
+uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Murmur3's finalizer. Every input bit affects every output bit.
+uint64_t fmix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Drawn once per process, 0 until then
+static atomic_uint_least64_t entropy;
+
+// Random bytes from the kernel if it has them ready, otherwise the clocks
+// and the pid
+uint64_t processEntropy(void) {
+    uint64_t seed = atomic_load(&entropy);
+    if (seed != 0) {
+        return seed;
+    }
+#if defined(__linux__)
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != (ssize_t) sizeof(seed)) {
+        seed = 0;
+    }
+#endif
+    if (seed == 0) {
+        struct timespec real, mono;
+        clock_gettime(CLOCK_REALTIME, &real);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        seed = fmix((uint64_t) real.tv_sec * 1000000000ULL + (uint64_t) real.tv_nsec);
+        seed ^= fmix((uint64_t) mono.tv_nsec ^ rotl((uint64_t) getpid(), 32));
+    }
+    seed |= 1;
+    // Whichever thread gets there first, every map agrees on it
+    uint_least64_t expected = 0;
+    if (!atomic_compare_exchange_strong(&entropy, &expected, seed)) {
+        seed = expected;
+    }
+    return seed;
+}
+
+// Random for every process, and different for every map in it, so that
+// keys picked to collide can't be worked out ahead of time
+uint64_t mkSeed(const kdl_hashmap_t *m) {
+    return fmix(processEntropy() ^ (uint64_t) (uintptr_t) m);
+}
+
+// Where to start probing
+size_t h1(uint64_t hash) {
+    return (size_t) (hash >> 7);
+}
+
+// What goes in the control byte
+int8_t h2(uint64_t hash) {
+    return (int8_t) (hash & 0x7F);
+}
+
+#if defined(__AVX2__)
 
-kdl_hashmap_hash_t stringMD5(const char *str) {
-    int length = strlen(str);
-    MD5_CTX c;
-    kdl_hashmap_hash_t hash;
+groupMask_t matchByte(const int8_t *group, int8_t value) {
+    __m256i ctrl = _mm256_loadu_si256((const __m256i *) group);
+    return (groupMask_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(value)));
+}
 
-    MD5Init(&c);
-    MD5Update(&c, (const unsigned char *)str, length);
-    MD5Final(hash.digest, &c);
+groupMask_t matchEmptyOrDeleted(const int8_t *group) {
+    // Both are less than -1, full slots are not
+    __m256i ctrl = _mm256_loadu_si256((const __m256i *) group);
+    return (groupMask_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-1), ctrl));
+}
 
-    return hash;
+#elif defined(__SSE2__)
+
+groupMask_t matchByte(const int8_t *group, int8_t value) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return (groupMask_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
 }
 
-int stringLength(const char *str) {
-    return strlen(str) + 1;
+groupMask_t matchEmptyOrDeleted(const int8_t *group) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return (groupMask_t) _mm_movemask_epi8(_mm_cmplt_epi8(ctrl, _mm_set1_epi8(-1)));
 }
 
-bool stringsEqual(const char *a, size_t lenA, const char *b, size_t lenB) {
-    if (lenA != lenB) {
-        return false;
+#else
+
+groupMask_t matchByte(const int8_t *group, int8_t value) {
+    groupMask_t result = 0;
+    for (int i = 0; i < KDL_HASHMAP_GROUP_WIDTH; i++) {
+        result |= (groupMask_t) (group[i] == value) << i;
     }
-    for (size_t i = 0; i < lenA; i++) {
-        if (a[i] != b[i]) {
-            return false;
+    return result;
+}
+
+groupMask_t matchEmptyOrDeleted(const int8_t *group) {
+    groupMask_t result = 0;
+    for (int i = 0; i < KDL_HASHMAP_GROUP_WIDTH; i++) {
+        result |= (groupMask_t) (group[i] < -1) << i;
+    }
+    return result;
+}
+
+#endif
+
+groupMask_t matchEmpty(const int8_t *group) {
+    return matchByte(group, CTRL_EMPTY);
+}
+
+int lowestBit(groupMask_t mask) {
+    return __builtin_ctz(mask);
+}
+
+bool isInlineKey(size_t keyLen) {
+    return keyLen < KDL_HASHMAP_INLINE_KEY;
+}
+
+const char *getKey(const kdl_hashmap_data_t *d) {
+    return isInlineKey(d->keyLen) ? d->key.local : d->key.heap;
+}
+
+void freeKey(kdl_hashmap_t *m, kdl_hashmap_data_t *d) {
+    if (!isInlineKey(d->keyLen)) {
+        m->s.free(d->key.heap);
+    }
+}
+
+void setCtrl(kdl_hashmap_table_t *t, size_t i, int8_t value) {
+    t->ctrl[i] = value;
+    // Keep the mirrored group in sync
+    if (i < KDL_HASHMAP_GROUP_WIDTH) {
+        t->ctrl[t->nBuckets + i] = value;
+    }
+}
+
+// Probe sequence is triangular over groups, which visits every group
+// exactly once for power of two capacities.
+size_t findFreeSlot(const kdl_hashmap_table_t *t, uint64_t hash) {
+    size_t pos = h1(hash) & t->mask;
+    size_t step = 0;
+    while (true) {
+        groupMask_t match = matchEmptyOrDeleted(t->ctrl + pos);
+        if (match) {
+            return (pos + lowestBit(match)) & t->mask;
         }
+        step += KDL_HASHMAP_GROUP_WIDTH;
+        pos = (pos + step) & t->mask;
+        assert(step <= t->nBuckets); // Table is full, should never happen
     }
-    return true;
 }
 
-int getIndex(const kdl_hashmap_t *m, const char *key) {
-    return *((unsigned long long *)stringMD5(key).digest) & m->mask;
+int findInTable(const kdl_hashmap_table_t *t, const char *key, size_t kLen, uint64_t hash, size_t *slot) {
+    const int8_t tag = h2(hash);
+    size_t pos = h1(hash) & t->mask;
+    size_t step = 0;
+    while (true) {
+        const int8_t *group = t->ctrl + pos;
+        for (groupMask_t match = matchByte(group, tag); match; match &= match - 1) {
+            size_t i = (pos + lowestBit(match)) & t->mask;
+            kdl_hashmap_data_t *d = t->slots + i;
+            if (d->hash == hash && d->keyLen == kLen && memcmp(getKey(d), key, kLen) == 0) {
+                *slot = i;
+                return KDL_HASHMAP_EOK;
+            }
+        }
+        if (matchEmpty(group)) {
+            return KDL_HASHMAP_ENORESULT;
+        }
+        step += KDL_HASHMAP_GROUP_WIDTH;
+        pos = (pos + step) & t->mask;
+        if (step > t->nBuckets) {
+            return KDL_HASHMAP_ENORESULT;
+        }
+    }
+}
+
+void putInTable(kdl_hashmap_t *m, kdl_hashmap_table_t *t, kdl_hashmap_data_t e) {
+    size_t slot = findFreeSlot(t, e.hash);
+    if (t->ctrl[slot] == CTRL_DELETED) {
+        t->nDeleted--;
+    }
+    setCtrl(t, slot, h2(e.hash));
+    t->slots[slot] = e;
+    t->nElements++;
+
+    m->ids[e.id].tableId = t->tableId;
+    m->ids[e.id].slot = slot;
 }
 
-int findIndex(kdl_hashmap_t *m, const char *key, size_t *bucket, size_t *data) {
-    const int iKey = getIndex(m, key);
-    const int kLen = stringLength(key);
-    kdl_hashmap_bucket_t *b = m->buckets + iKey;
-    for (size_t i = 0; i < b->length; i++) {
-        kdl_hashmap_data_t *d = b->data + i;
-        if (stringsEqual(key, kLen, d->key, d->keyLen)) {
-            *bucket = iKey;
-            *data = i;
-            return KDL_HASHMAP_EOK;
+uint32_t allocId(kdl_hashmap_t *m) {
+    size_t id = m->freeId;
+    if (id != NO_FREE_ID) {
+        m->freeId = m->ids[id].slot;
+        return (uint32_t) id;
+    }
+    if (m->nIds + 1 > m->idsSize) {
+        m->idsSize = m->idsSize ? m->idsSize * 2 : IDS_START_SIZE;
+        m->ids = (kdl_hashmap_id_t *) m->s.realloc(m->ids, sizeof(kdl_hashmap_id_t) * m->idsSize);
+    }
+    assert(m->nIds < UINT32_MAX);
+    id = m->nIds++;
+    m->ids[id].generation = 1;
+    return (uint32_t) id;
+}
+
+// Invalidates every handle to the id
+void releaseId(kdl_hashmap_t *m, uint32_t id) {
+    kdl_hashmap_id_t *i = m->ids + id;
+    i->generation++;
+    if (i->generation == 0) {
+        // Zero is reserved for zeroed handles
+        i->generation = 1;
+    }
+    i->slot = m->freeId;
+    m->freeId = id;
+}
+
+kdl_hashmap_handle_t mkHandle(const kdl_hashmap_t *m, uint32_t id) {
+    kdl_hashmap_handle_t h;
+    h.index = id;
+    h.generation = m->ids[id].generation;
+    return h;
+}
+
+// Pull in the first group of control bytes and the first slot that
+// a probe for `hash` will look at
+void prefetchProbe(const kdl_hashmap_table_t *t, uint64_t hash) {
+    size_t pos = h1(hash) & t->mask;
+    __builtin_prefetch(t->ctrl + pos);
+    __builtin_prefetch(t->slots + pos);
+}
+
+// Search both tables, without migrating anything
+int lookup(const kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, kdl_hashmap_result_t *result) {
+    size_t slot = 0;
+    size_t which = 0;
+    int status = findInTable(&m->table, key, keyLen, hash, &slot);
+    if (status != KDL_HASHMAP_EOK && m->rehashing) {
+        which = 1;
+        status = findInTable(&m->old, key, keyLen, hash, &slot);
+    }
+    memset(result, 0, sizeof(kdl_hashmap_result_t));
+    result->bucket = slot;
+    result->data = which;
+    result->code = status;
+    if (status == KDL_HASHMAP_EOK) {
+        const kdl_hashmap_table_t *t = which == 0 ? &m->table : &m->old;
+        result->keyLength = keyLen;
+        result->handle = mkHandle(m, t->slots[slot].id);
+    }
+    return result->code;
+}
+
+void allocTable(kdl_hashmap_t *m, kdl_hashmap_table_t *t, size_t capacity) {
+    kdl_state_t s = m->s;
+    assert(capacity >= KDL_HASHMAP_GROUP_WIDTH && (capacity & (capacity - 1)) == 0);
+    t->tableId = m->nextTableId++;
+    t->nBuckets = capacity;
+    t->mask = capacity - 1; // Know your bitmath
+    t->nElements = 0;
+    t->nDeleted = 0;
+    t->ctrl = (int8_t *) s.malloc(sizeof(int8_t) * (capacity + KDL_HASHMAP_GROUP_WIDTH));
+    memset(t->ctrl, CTRL_EMPTY, sizeof(int8_t) * (capacity + KDL_HASHMAP_GROUP_WIDTH));
+    t->slots = (kdl_hashmap_data_t *) s.malloc(sizeof(kdl_hashmap_data_t) * capacity);
+}
+
+// Frees the keys and values of every element
+void freeTableData(kdl_hashmap_t *m, kdl_hashmap_table_t *t) {
+    for (size_t i = 0; i < t->nBuckets; i++) {
+        if (t->ctrl[i] >= 0) {
+            freeKey(m, t->slots + i);
+            m->freeFunc(m->s, t->slots[i].data);
         }
     }
-    return KDL_HASHMAP_ENORESULT;
+}
+
+kdl_hashmap_table_t *getTable(kdl_hashmap_t *m, size_t which) {
+    return which == 0 ? &m->table : &m->old;
+}
+
+// Move up to `slots` slots of the old table into the current one.
+// Migrated slots become tombstones, so probing the old table for
+// the elements that are left still works.
+void rehashStep(kdl_hashmap_t *m, size_t slots) {
+    if (!m->rehashing) {
+        return;
+    }
+    kdl_hashmap_table_t *old = &m->old;
+    size_t end = m->rehashPos + slots;
+    if (end > old->nBuckets) {
+        end = old->nBuckets;
+    }
+    for (; m->rehashPos < end && old->nElements > 0; m->rehashPos++) {
+        if (old->ctrl[m->rehashPos] >= 0) {
+            kdl_hashmap_data_t *d = old->slots + m->rehashPos;
+            putInTable(m, &m->table, *d);
+            setCtrl(old, m->rehashPos, CTRL_DELETED);
+            old->nElements--;
+        }
+    }
+    if (old->nElements == 0) {
+        m->s.free(old->ctrl);
+        m->s.free(old->slots);
+        memset(old, 0, sizeof(kdl_hashmap_table_t));
+        m->rehashing = false;
+        m->rehashPos = 0;
+    }
+}
+
+void finishRehash(kdl_hashmap_t *m) {
+    if (m->rehashing) {
+        rehashStep(m, m->old.nBuckets);
+    }
+}
+
+// Swap in a fresh table of `capacity` slots. The elements follow over
+// the next few operations.
+void startRehash(kdl_hashmap_t *m, size_t capacity) {
+    finishRehash(m);
+    m->old = m->table;
+    m->rehashPos = 0;
+    m->rehashing = m->old.nElements > 0;
+    allocTable(m, &m->table, capacity);
+    if (!m->rehashing) {
+        m->s.free(m->old.ctrl);
+        m->s.free(m->old.slots);
+        memset(&m->old, 0, sizeof(kdl_hashmap_table_t));
+    }
+}
+
+// Smallest table that holds `elements` without exceeding the max load
+size_t capacityFor(size_t elements) {
+    size_t capacity = KDL_HASHMAP_GROUP_WIDTH;
+    while (MAX_LOAD(capacity) < elements) {
+        capacity <<= 1;
+    }
+    return capacity;
 }
 
 // --- Exported methods ---
@@ -68,72 +422,143 @@ int findIndex(kdl_hashmap_t *m, const char *key, size_t *bucket, size_t *data) {
 // --- Access & modification ---
 
 size_t kdl_hashmap_size(const kdl_hashmap_t *m) {
-    return m->nElements;
+    return m->table.nElements + (m->rehashing ? m->old.nElements : 0);
+}
+
+kdl_hashmap_handle_t kdl_hashmap_insert(kdl_hashmap_t *m, const char *key, void *data) {
+    const size_t kLen = strlen(key);
+    return kdl_hashmap_insertHashed(m, key, kLen, kdl_hashmap_hashKey(m, key, kLen), data);
 }
 
-void kdl_hashmap_insert(kdl_hashmap_t *m, const char *key, void *data) {
-    const int iKey = getIndex(m, key);
-    kdl_hashmap_bucket_t *b = m->buckets + iKey;
-    const size_t newLength = b->length + 1;
-    if (newLength > b->size) {
-        b->size = b->size + BUCKET_SIZE_STEP;
-        b->data = (kdl_hashmap_data_t *) m->s.realloc(b->data, sizeof(kdl_hashmap_data_t) * b->size);
+kdl_hashmap_handle_t kdl_hashmap_insertHashed(kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, void *data) {
+    rehashStep(m, REHASH_STEP);
+
+    kdl_hashmap_table_t *t = &m->table;
+    if (t->nElements + t->nDeleted + 1 > MAX_LOAD(t->nBuckets)) {
+        // Rehashing at the same size is enough if most of the load
+        // is tombstones
+        if (kdl_hashmap_size(m) + 1 > MAX_LOAD(t->nBuckets) / 2) {
+            startRehash(m, t->nBuckets * 2);
+        } else {
+            startRehash(m, t->nBuckets);
+        }
     }
+
     kdl_hashmap_data_t e;
 
-    e.keyLen = stringLength(key);
-    e.key = (void *) m->s.malloc(sizeof(char) * e.keyLen);
-    memcpy(e.key, key, e.keyLen);
+    e.keyLen = keyLen;
+    char *dest = e.key.local;
+    if (!isInlineKey(keyLen)) {
+        dest = e.key.heap = (char *) m->s.malloc(sizeof(char) * (keyLen + 1));
+    }
+    memcpy(dest, key, keyLen);
+    dest[keyLen] = '\0';
 
+    e.hash = hash;
     e.data = data;
+    e.id = allocId(m);
 
-    b->data[b->length++] = e;
-
-    m->nElements++;
+    putInTable(m, &m->table, e);
+    return mkHandle(m, e.id);
 }
 
 
 int kdl_hashmap_search(kdl_hashmap_t *m, const char *key, kdl_hashmap_result_t *result) {
-    size_t bucket = 0;
-    size_t data = 0;
-    int status = findIndex(m, key, &bucket, &data);
-    memset(result, 0, sizeof(kdl_hashmap_result_t));
-    result->bucket = bucket;
-    result->data = data;
-    result->code = status;
-    if (status == KDL_HASHMAP_EOK) {
-        result->keyLength = m->buckets[bucket].data[data].keyLen;
+    const size_t kLen = strlen(key);
+    return kdl_hashmap_searchHashed(m, key, kLen, kdl_hashmap_hashKey(m, key, kLen), result);
+}
+
+int kdl_hashmap_searchHashed(kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, kdl_hashmap_result_t *result) {
+    rehashStep(m, REHASH_STEP);
+    return lookup(m, key, keyLen, hash, result);
+}
+
+void kdl_hashmap_searchBatch(kdl_hashmap_t *m, const char *const *keys, size_t n, kdl_hashmap_result_t *results) {
+    // Migrate before hashing, so that nothing moves under the prefetches
+    rehashStep(m, REHASH_STEP);
+
+    size_t lengths[BATCH_CHUNK];
+    kdl_hashmap_hash_t hashes[BATCH_CHUNK];
+    for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+        size_t count = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            lengths[i] = strlen(keys[base + i]);
+            hashes[i] = kdl_hashmap_hashKey(m, keys[base + i], lengths[i]);
+            prefetchProbe(&m->table, hashes[i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            lookup(m, keys[base + i], lengths[i], hashes[i], results + base + i);
+        }
     }
-    return result->code;
 }
 
 void kdl_hashmap_get(const kdl_hashmap_t *m, kdl_hashmap_result_t search, void **data) {
-    assert(search.bucket < m->nBuckets && search.data < m->buckets[search.bucket].length);
+    const kdl_hashmap_table_t *t = search.data == 0 ? &m->table : &m->old;
+    assert(search.bucket < t->nBuckets && t->ctrl[search.bucket] >= 0);
 
-    kdl_hashmap_data_t d = m->buckets[search.bucket].data[search.data];
-    *data = d.data;
+    *data = t->slots[search.bucket].data;
 }
 
 void kdl_hashmap_remove(kdl_hashmap_t *m, kdl_hashmap_result_t search) {
-    kdl_hashmap_bucket_t *b = m->buckets + search.bucket;
-    assert(b->length > 0);
-    m->s.free(b->data[search.data].key);
-    m->freeFunc(m->s, b->data[search.data].data);
-    b->data[search.data] = b->data[b->length - 1];
-    b->length--;
-    m->nElements--;
+    kdl_hashmap_table_t *t = getTable(m, search.data);
+    assert(search.bucket < t->nBuckets && t->ctrl[search.bucket] >= 0);
+    kdl_hashmap_data_t *d = t->slots + search.bucket;
+    freeKey(m, d);
+    m->freeFunc(m->s, d->data);
+    releaseId(m, d->id);
+    setCtrl(t, search.bucket, CTRL_DELETED);
+    t->nDeleted++;
+    t->nElements--;
+
+    // Step after, the result refers to the table as it was
+    rehashStep(m, REHASH_STEP);
 }
 
 void kdl_hashmap_clear(kdl_hashmap_t *m) {
-    for (size_t b = 0; b < m->nBuckets; b++) {
-        for (size_t d = 0; d < m->buckets[b].length; d++) {
-            m->s.free(m->buckets[b].data[d].key);
-            m->freeFunc(m->s, m->buckets[b].data[d].data);
+    finishRehash(m);
+    kdl_hashmap_table_t *t = &m->table;
+    freeTableData(m, t);
+    for (size_t i = 0; i < t->nBuckets; i++) {
+        if (t->ctrl[i] >= 0) {
+            releaseId(m, t->slots[i].id);
         }
-        // Do not reclaim memory - that can be done with reclaim()
-        m->buckets[b].length = 0;
     }
-    m->nElements = 0;
+    // Do not reclaim memory - that can be done with reclaim()
+    memset(t->ctrl, CTRL_EMPTY, sizeof(int8_t) * (t->nBuckets + KDL_HASHMAP_GROUP_WIDTH));
+    t->nElements = 0;
+    t->nDeleted = 0;
+}
+
+// --- Handles ---
+
+bool kdl_hashmap_valid(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle) {
+    return handle.index < m->nIds && m->ids[handle.index].generation == handle.generation;
+}
+
+int kdl_hashmap_getHandle(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle, void **data) {
+    kdl_hashmap_result_t r;
+    if (kdl_hashmap_resolve(m, handle, &r) != KDL_HASHMAP_EOK) {
+        return KDL_HASHMAP_ENORESULT;
+    }
+    kdl_hashmap_get(m, r, data);
+    return KDL_HASHMAP_EOK;
+}
+
+int kdl_hashmap_resolve(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle, kdl_hashmap_result_t *result) {
+    memset(result, 0, sizeof(kdl_hashmap_result_t));
+    result->code = KDL_HASHMAP_ENORESULT;
+    if (!kdl_hashmap_valid(m, handle)) {
+        return result->code;
+    }
+    const kdl_hashmap_id_t *id = m->ids + handle.index;
+    const kdl_hashmap_table_t *t = id->tableId == m->table.tableId ? &m->table : &m->old;
+    assert(t == &m->table || m->rehashing);
+    result->bucket = id->slot;
+    result->data = t == &m->table ? 0 : 1;
+    result->keyLength = t->slots[id->slot].keyLen;
+    result->handle = handle;
+    result->code = KDL_HASHMAP_EOK;
+    return result->code;
 }
 
 // --- Iteration ---
@@ -141,55 +566,104 @@ void kdl_hashmap_clear(kdl_hashmap_t *m) {
 kdl_hashmap_result_t kdl_hashmap_first(kdl_hashmap_t *m) {
     kdl_hashmap_result_t s;
     memset(&s, 0, sizeof(kdl_hashmap_result_t));
-    s.code = KDL_HASHMAP_ENORESULT;
+    // Whatever is left of the old table goes first.
+    // next() starts one past the current slot.
+    s.data = m->rehashing ? 1 : 0;
+    s.bucket = (size_t) -1;
     kdl_hashmap_next(m, &s);
     return s;
 }
 
 int kdl_hashmap_next(kdl_hashmap_t *m, kdl_hashmap_result_t *i) {
-    i->data++;
-    i->code = KDL_HASHMAP_EOK;
-    if (i->data >= m->buckets[i->bucket].length) {
-        i->data = 0;
-        do {
-            i->bucket++;
-            if (i->bucket >= m->nBuckets) {
-                i->code = KDL_HASHMAP_EEND;
-                break;
+    i->code = KDL_HASHMAP_EEND;
+    while (true) {
+        kdl_hashmap_table_t *t = getTable(m, i->data);
+        for (i->bucket++; i->bucket < t->nBuckets; i->bucket++) {
+            if (t->ctrl[i->bucket] >= 0) {
+                i->keyLength = t->slots[i->bucket].keyLen;
+                i->handle = mkHandle(m, t->slots[i->bucket].id);
+                i->code = KDL_HASHMAP_EOK;
+                return i->code;
             }
-        } while (m->buckets[i->bucket].length == 0);
+        }
+        if (i->data == 0) {
+            break;
+        }
+        i->data = 0;
+        i->bucket = (size_t) -1;
     }
     return i->code;
 }
 
+// --- Hashing ---
+
+// Eight bytes at a time, like the body of murmur3. The length goes into
+// the final mix so that keys differing only in trailing zeros differ.
+kdl_hashmap_hash_t kdl_hashmap_defaultHash(const char *key, size_t length, uint64_t seed) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h = seed;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t k;
+        memcpy(&k, key + i, sizeof(uint64_t));
+        h ^= rotl(k * c1, 31) * c2;
+        h = rotl(h, 27) * 5 + 0x52dce729;
+    }
+    if (i < length) {
+        uint64_t k = 0;
+        memcpy(&k, key + i, length - i);
+        h ^= rotl(k * c1, 31) * c2;
+    }
+    return fmix(h ^ (uint64_t) length);
+}
+
+kdl_hashmap_hash_t kdl_hashmap_hashKey(const kdl_hashmap_t *m, const char *key, size_t length) {
+    return m->hashFunc(key, length, m->seed);
+}
+
 // --- Memory and initailization ---
 
+void kdl_hashmap_reserve(kdl_hashmap_t *m, size_t n) {
+    size_t capacity = capacityFor(n);
+    if (capacity > m->table.nBuckets) {
+        startRehash(m, capacity);
+    }
+    finishRehash(m);
+}
+
 void kdl_hashmap_reclaim(kdl_hashmap_t *m) {
-    for (size_t b = 0; b < m->nBuckets; b++) {
-        kdl_hashmap_bucket_t *bu = m->buckets + b;
-        bu->size = bu->length;
-        bu->data = (kdl_hashmap_data_t *) m->s.realloc(bu->data, sizeof(kdl_hashmap_data_t) * bu->size);
+    finishRehash(m);
+    size_t capacity = capacityFor(m->table.nElements);
+    if (capacity < m->table.nBuckets || m->table.nDeleted > 0) {
+        startRehash(m, capacity);
+        finishRehash(m);
     }
 }
 
 void kdl_hashmap_free(kdl_hashmap_t *m) {
-    for (size_t i = 0; i < m->nBuckets; i++) {
-        for (size_t f = 0; f < m->buckets[i].length; f++) {
-            m->s.free(m->buckets[i].data[f].key);
-            m->freeFunc(m->s, m->buckets[i].data[f].data);
-        }
-        m->s.free(m->buckets[i].data);
+    freeTableData(m, &m->table);
+    m->s.free(m->table.ctrl);
+    m->s.free(m->table.slots);
+    m->s.free(m->ids);
+    if (m->rehashing) {
+        freeTableData(m, &m->old);
+        m->s.free(m->old.ctrl);
+        m->s.free(m->old.slots);
     }
-    m->s.free(m->buckets);
     memset(m, 0, sizeof(kdl_hashmap_t));
 }
 
-void kdl_hashmap_init(kdl_state_t s, kdl_hashmap_t *m, int precision, kdl_hashmap_dataFree_t freeFunc) {
+void kdl_hashmap_init(kdl_state_t s, kdl_hashmap_t *m, int precision, kdl_hashmap_dataFree_t freeFunc, kdl_hashmap_hashFunc_t hashFunc) {
+    memset(m, 0, sizeof(kdl_hashmap_t));
     m->s = s;
     m->freeFunc = freeFunc;
-    m->nElements = 0;
-    m->nBuckets = 1 << precision;
-    m->mask = m->nBuckets - 1; // Know your bitmath
-    m->buckets = (kdl_hashmap_bucket_t *) s.malloc(sizeof(kdl_hashmap_bucket_t) * m->nBuckets);
-    memset(m->buckets, 0, sizeof(kdl_hashmap_bucket_t) * m->nBuckets);
+    m->hashFunc = hashFunc ? hashFunc : kdl_hashmap_defaultHash;
+    m->seed = mkSeed(m);
+    m->freeId = NO_FREE_ID;
+    size_t capacity = (size_t) 1 << precision;
+    if (capacity < KDL_HASHMAP_GROUP_WIDTH) {
+        capacity = KDL_HASHMAP_GROUP_WIDTH;
+    }
+    allocTable(m, &m->table, capacity);
 }
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "def.h"
 
@@ -20,36 +21,102 @@
 
 typedef void(*kdl_hashmap_dataFree_t)(kdl_state_t,void*);
 
-typedef struct {
-    uint8_t digest[16];
-} kdl_hashmap_hash_t;
+typedef uint64_t kdl_hashmap_hash_t;
+
+// Hashes `length` bytes of `key`. `seed` is different for every map, and
+// should change the result.
+typedef kdl_hashmap_hash_t(*kdl_hashmap_hashFunc_t)(const char *key, size_t length, uint64_t seed);
+
+// Keys shorter than this (so that the null terminator fits too) are kept
+// inside the entry itself instead of in a separate allocation
+#define KDL_HASHMAP_INLINE_KEY 32
 
 typedef struct {
     void *data;
-    char *key;
+    // Length of the key, NOT including the null terminator
     size_t keyLen;
+    // Full hash of the key. Compared before the key itself, and reused
+    // when the table grows.
+    kdl_hashmap_hash_t hash;
+    // Index into the map's `ids`
+    uint32_t id;
+    // `local` if keyLen < KDL_HASHMAP_INLINE_KEY, `heap` otherwise.
+    // Either way null terminated.
+    union {
+        char local[KDL_HASHMAP_INLINE_KEY];
+        char *heap;
+    } key;
 } kdl_hashmap_data_t;
 
+// One flat, open-addressing table.
+// Every slot has a control byte: either empty, deleted (a tombstone),
+// or the low 7 bits of the key's hash. Lookups compare a whole group of
+// control bytes at a time (SSE2/AVX2 if available), and only touch
+// `slots` for the few candidates that match.
+typedef struct {
+    // nBuckets + KDL_HASHMAP_GROUP_WIDTH control bytes. The trailing
+    // group mirrors the first so that groups can wrap around the end.
+    int8_t *ctrl;
+    kdl_hashmap_data_t *slots;
+    size_t nBuckets;
+    size_t nElements;
+    // Number of tombstones
+    size_t nDeleted;
+    size_t mask;
+    // Tells tables apart when the current one becomes the old one
+    uint32_t tableId;
+} kdl_hashmap_table_t;
+
+// Where an element currently lives. Elements move when the table grows,
+// this is what lets handles follow them.
+typedef struct {
+    // Incremented every time the id is freed
+    uint32_t generation;
+    uint32_t tableId;
+    // The slot, or the next free id if this one is free
+    size_t slot;
+} kdl_hashmap_id_t;
+
+// Refers to one element for as long as it is in the map, no matter what
+// else is inserted or removed. A zeroed handle is never valid.
 typedef struct {
-    kdl_hashmap_data_t *data;
-    size_t size;
-    size_t length;
-} kdl_hashmap_bucket_t;
+    uint32_t index;
+    uint32_t generation;
+} kdl_hashmap_handle_t;
 
+// Grows by doubling once it passes 7/8 load. Elements are not moved all
+// at once: the previous table is kept in `old`, and every insert, search
+// and remove migrates a few of its slots until it is empty.
 typedef struct {
     kdl_state_t s;
     kdl_hashmap_dataFree_t freeFunc;
-    kdl_hashmap_bucket_t *buckets;
-    size_t nBuckets;
-    size_t nElements;
-    int mask;
+    kdl_hashmap_hashFunc_t hashFunc;
+    uint64_t seed;
+    kdl_hashmap_table_t table;
+    // Only valid if `rehashing`
+    kdl_hashmap_table_t old;
+    // Next slot of `old` to migrate
+    size_t rehashPos;
+    bool rehashing;
+    uint32_t nextTableId;
+
+    kdl_hashmap_id_t *ids;
+    size_t nIds;
+    size_t idsSize;
+    // Head of the free list, (size_t) -1 if empty
+    size_t freeId;
 } kdl_hashmap_t;
 
 
 typedef struct {
+    // The slot index
     size_t bucket;
+    // Which table the slot is in: 0 for the current one, 1 for the one
+    // being migrated away from
     size_t data;
     size_t keyLength;
+    // Set by searches and iteration
+    kdl_hashmap_handle_t handle;
     int code;
 } kdl_hashmap_result_t;
 
@@ -57,9 +124,24 @@ typedef struct {
 
 size_t kdl_hashmap_size(const kdl_hashmap_t *m);
 // Key must be null terminated. Not the same for value.
-void kdl_hashmap_insert(kdl_hashmap_t *m, const char *key, void *value);
-// Searches are valid so long as the underlying container has not been modified
+// The key must not already be in the map.
+kdl_hashmap_handle_t kdl_hashmap_insert(kdl_hashmap_t *m, const char *key, void *value);
+// A result is only valid until the next call on the map, searches
+// included: while the map is rehashing, every call (search() too) moves a
+// few elements out of the old table. Keep a handle to refer to an element
+// for longer.
 int kdl_hashmap_search(kdl_hashmap_t *m, const char *key, kdl_hashmap_result_t *result);
+// Same as insert() and search(), for callers that already know the key's
+// length and hash (from kdl_hashmap_hashKey()). Saves hashing the same
+// key twice when a search is followed by an insert.
+// The key does not need to be null terminated.
+kdl_hashmap_handle_t kdl_hashmap_insertHashed(kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, void *value);
+int kdl_hashmap_searchHashed(kdl_hashmap_t *m, const char *key, size_t keyLen, kdl_hashmap_hash_t hash, kdl_hashmap_result_t *result);
+// Searches for `n` null terminated keys at once, putting the result for
+// `keys[i]` in `results[i]`. Faster than as many search() calls for large
+// maps, since the memory for every key is prefetched before any of them
+// is compared.
+void kdl_hashmap_searchBatch(kdl_hashmap_t *m, const char *const *keys, size_t n, kdl_hashmap_result_t *results);
 // These two getters pretty much just return the pointer to the data.
 // They do NOT copy anything.
 // `count` is the length of the pointed data, and may be null.
@@ -67,16 +149,43 @@ void kdl_hashmap_get(const kdl_hashmap_t *m, kdl_hashmap_result_t search, void *
 void kdl_hashmap_remove(kdl_hashmap_t *m, kdl_hashmap_result_t search);
 void kdl_hashmap_clear(kdl_hashmap_t *m);
 
+// --- Handles ---
+
+// All O(1).
+// True if the handle's element is still in the map
+bool kdl_hashmap_valid(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle);
+// Returns KDL_HASHMAP_ENORESULT if the handle is no longer valid
+int kdl_hashmap_getHandle(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle, void **data);
+// Turns a handle back into a result, eg. to remove() the element.
+// Returns KDL_HASHMAP_ENORESULT if the handle is no longer valid.
+int kdl_hashmap_resolve(const kdl_hashmap_t *m, kdl_hashmap_handle_t handle, kdl_hashmap_result_t *result);
+
 // --- Iteration ---
 
+// Only get() may be called on the map between first() and the last
+// next(). Anything else, searches included, may move elements between
+// tables, which iteration would then visit twice or not at all.
 kdl_hashmap_result_t kdl_hashmap_first(kdl_hashmap_t *m);
 // Returns errors: PSD_HASHMAP_EEND
 int kdl_hashmap_next(kdl_hashmap_t *m, kdl_hashmap_result_t *r);
 
+// --- Hashing ---
+
+// Fast, non-cryptographic, seeded 64 bit hash. The default `hashFunc`.
+kdl_hashmap_hash_t kdl_hashmap_defaultHash(const char *key, size_t length, uint64_t seed);
+// Hash a key the way this particular map does (hash function and seed)
+kdl_hashmap_hash_t kdl_hashmap_hashKey(const kdl_hashmap_t *m, const char *key, size_t length);
+
 // --- Memory and initailization ---
 
+// Grows the table so that `n` elements fit without any further resizing.
+// Done all at once, so best called before the map is filled.
+void kdl_hashmap_reserve(kdl_hashmap_t *m, size_t n);
+// Shrinks the table to the smallest size that fits the current elements
 void kdl_hashmap_reclaim(kdl_hashmap_t *m);
 void kdl_hashmap_free(kdl_hashmap_t *m);
-void kdl_hashmap_init(kdl_state_t s, kdl_hashmap_t*m, int precision, kdl_hashmap_dataFree_t freeFunc);
+// Starts with (1 << precision) slots, but never less than one group.
+// `hashFunc` may be NULL, in which case kdl_hashmap_defaultHash() is used.
+void kdl_hashmap_init(kdl_state_t s, kdl_hashmap_t*m, int precision, kdl_hashmap_dataFree_t freeFunc, kdl_hashmap_hashFunc_t hashFunc);
 
 #endif
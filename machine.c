@@ -6,110 +6,8 @@
 #include <assert.h>
 
 #define PROG_BUF_STEP 64
-
-// -- arithmetic functions
-
-kdl_float_t addFloat(kdl_float_t a, kdl_float_t b) {
-    return a + b;
-}
-
-kdl_int_t addInt(kdl_int_t a, kdl_int_t b) {
-    return a + b;
-}
-
-kdl_float_t subFloat(kdl_float_t a, kdl_float_t b) {
-    return a - b;
-}
-
-kdl_int_t subInt(kdl_int_t a, kdl_int_t b) {
-    return a - b;
-}
-
-kdl_float_t divFloat(kdl_float_t a, kdl_float_t b) {
-    return a / b;
-}
-
-kdl_int_t divInt(kdl_int_t a, kdl_int_t b) {
-    return a / b;
-}
-
-kdl_float_t mulFloat(kdl_float_t a, kdl_float_t b) {
-    return a * b;
-}
-
-kdl_int_t mulInt(kdl_int_t a, kdl_int_t b) {
-    return a * b;
-}
-
-kdl_int_t equFloat(kdl_float_t a, kdl_float_t b) {
-    return a == b;
-}
-
-kdl_int_t equInt(kdl_int_t a, kdl_int_t b) {
-    return a == b;
-}
-
-kdl_int_t leqFloat(kdl_float_t a, kdl_float_t b) {
-    return a <= b;
-}
-
-kdl_int_t leqInt(kdl_int_t a, kdl_int_t b) {
-    return a <= b;
-}
-
-kdl_int_t geqInt(kdl_int_t a, kdl_int_t b) {
-    return a >= b;
-}
-
-kdl_int_t geqFloat(kdl_float_t a, kdl_float_t b) {
-    return a >= b;
-}
-
-kdl_int_t gthFloat(kdl_float_t a, kdl_float_t b) {
-    return a > b;
-}
-
-kdl_int_t gthInt(kdl_int_t a, kdl_int_t b) {
-    return a > b;
-}
-
-kdl_int_t lthFloat(kdl_float_t a, kdl_float_t b) {
-    return a < b;
-}
-
-kdl_int_t lthInt(kdl_int_t a, kdl_int_t b) {
-    return a < b;
-}
-
-kdl_int_t andFloat(kdl_float_t a, kdl_float_t b) {
-    return (int)a && (int)b;
-}
-
-kdl_int_t andInt(kdl_int_t a, kdl_int_t b) {
-    return a && b;
-}
-
-kdl_int_t orFloat(kdl_float_t a, kdl_float_t b) {
-    return (int)a || (int)b;
-}
-
-kdl_int_t orInt(kdl_int_t a, kdl_int_t b) {
-    return a || b;
-}
-
-kdl_int_t notFloat(kdl_float_t a) {
-    return !((int)a);
-}
-
-kdl_int_t notInt(kdl_int_t a) {
-    return !a;
-}
-
-kdl_int_t notint(kdl_int_t a) {
-    return !a;
-}
-
-// -- end arithmetic functions
+// Batched setters resolve this many names at a time
+#define VAR_BATCH_SIZE 64
 
 // Default malloc
 void *defMalloc(size_t n) {
@@ -138,8 +36,11 @@ void defFree(void *p) {
 
 
 
+// Only variables own what they point to
 void freeData(kdl_state_t s, kdl_data_t *d) {
-    s.free(d->data);
+    if (d->datatype == KDL_DT_STR) {
+        s.free((char *) d->value.s);
+    }
     memset(d, 0, sizeof(kdl_data_t));
 }
 
@@ -165,8 +66,9 @@ void appendRules(kdl_machine_t *m, kdl_rule_t *rules, size_t length, kdl_program
         dest->rules = (kdl_rule_t *) m->s.realloc(dest->rules, sizeof(kdl_rule_t) * dest->size);
     }
     for (size_t i = 0; i < length; i++) {
-        if (!rules[i].active) {
-            rules[i].active = true;
+        kdl_ruleState_t *state = &m->rules[rules[i].slot];
+        if (!state->active) {
+            state->active = true;
             dest->rules[dest->length++] = rules[i];
         }
     }
@@ -177,10 +79,15 @@ void appendProgram(kdl_machine_t *m, kdl_program_t *src, kdl_programBuffer_t *de
 }
 
 void backwriteBuffer(kdl_machine_t *m, kdl_programBuffer_t *src, kdl_programBuffer_t *dest) {
-    dest->size = src->size;
+    if (dest->size < src->length) {
+        dest->size = src->size;
+        dest->rules = (kdl_rule_t *) m->s.realloc(dest->rules, sizeof(kdl_rule_t) * dest->size);
+    }
     dest->length = src->length;
-    dest->rules = (kdl_rule_t *) m->s.realloc(dest->rules, sizeof(kdl_rule_t) * dest->size);
-    memcpy(dest->rules, src->rules, sizeof(kdl_rule_t) * src->length);
+    // Both may still be NULL
+    if (src->length > 0) {
+        memcpy(dest->rules, src->rules, sizeof(kdl_rule_t) * src->length);
+    }
 }
 
 void copyString(kdl_machine_t *m, const char *src, char **dest) {
@@ -189,90 +96,163 @@ void copyString(kdl_machine_t *m, const char *src, char **dest) {
     memcpy(*dest, src, len);
 }
 
-void copyData(kdl_machine_t *m, int type, void *data, kdl_data_t *dest) {
+// `data` points to a value of the given type. Strings are copied, for
+// variables to own.
+void copyData(kdl_machine_t *m, int type, const void *data, kdl_data_t *dest) {
     dest->datatype = type;
     switch(type) {
     case KDL_DT_INT:
-        dest->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-        *((kdl_int_t *)dest->data) = *((kdl_int_t *) data);
+        dest->value.i = *((const kdl_int_t *) data);
         break;
     case KDL_DT_PRC: // Fallthrough
     case KDL_DT_FLT:
-        dest->data = (kdl_float_t *) m->s.malloc(sizeof(kdl_float_t));
-        *((kdl_float_t *)dest->data) = *((kdl_float_t *) data);
+        dest->value.f = *((const kdl_float_t *) data);
         break;
-    case KDL_DT_STR:
-        copyString(m, (char *) data, (char **) &dest->data);
+    case KDL_DT_STR: {
+        char *copy;
+        copyString(m, (const char *) data, &copy);
+        dest->value.s = copy;
         break;
+    }
     case KDL_DT_NIL: // Fallthrough
     default:
         assert(false);
     }
 }
 
-void mkName(kdl_machine_t *m, const char *context, const char *name, char **result) {
+// `resultLen` does not include the null terminator
+void mkName(kdl_machine_t *m, const char *context, const char *name, char **result, size_t *resultLen) {
     size_t lenC = context ? strlen(context) : 0;
     size_t lenI = context && context[0] ? 1 : 0;
     size_t lenN = strlen(name);
     size_t size = lenC + lenI + lenN + 1;
     char *lookup = (char *) m->s.malloc(sizeof(char) * size);
-    memcpy(lookup, context, sizeof(char) * lenC);
+    if (lenC > 0) {
+        memcpy(lookup, context, sizeof(char) * lenC);
+    }
     memcpy(lookup + lenC, " ", sizeof(char) * lenI);
     memcpy(lookup + lenC + lenI, name, sizeof(char) * lenN);
     lookup[lenC + lenI + lenN] = '\0';
     *result = lookup;
+    *resultLen = lenC + lenI + lenN;
 }
 
-kdl_entry_t *mkBlankVar(kdl_machine_t *m, const char *fullName) {
+kdl_entry_t *mkBlankVar(kdl_machine_t *m, const char *fullName, size_t nameLen) {
     kdl_entry_t *val = (kdl_entry_t *) m->s.malloc(sizeof(kdl_entry_t));
-    size_t size = strlen(fullName) + 1;
+    size_t size = nameLen + 1;
     val->name = (char *) m->s.malloc(sizeof(char) * size);
     memcpy(val->name, fullName, size);
     val->watcher = NULL;
     val->data.datatype = KDL_DT_INT;
-    kdl_int_t *v = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-    *v = 0;
-    val->data.data = (void *) v;
+    val->data.value.i = 0;
     return val;
 }
 
-void getVarRef(kdl_machine_t *m, const char *fullName, kdl_entry_t **out) {
+// The name is hashed once, for both the search and the insert on a miss.
+// `handle` may be NULL.
+void getVarHandle(kdl_machine_t *m, const char *fullName, size_t nameLen, kdl_entry_t **out, kdl_varHandle_t *handle) {
+    kdl_hashmap_hash_t hash = kdl_hashmap_hashKey(&m->vars, fullName, nameLen);
     kdl_hashmap_result_t r;
-    kdl_hashmap_search(&m->vars, fullName, &r);
+    kdl_hashmap_searchHashed(&m->vars, fullName, nameLen, hash, &r);
     if (r.code != KDL_HASHMAP_EOK) {
-        kdl_entry_t *result = mkBlankVar(m, fullName);
-        kdl_hashmap_insert(&m->vars, fullName, (void *) result);
+        kdl_entry_t *result = mkBlankVar(m, fullName, nameLen);
+        kdl_hashmap_handle_t h = kdl_hashmap_insertHashed(&m->vars, fullName, nameLen, hash, (void *) result);
+        kdl_trie_insert(&m->varIndex, fullName, nameLen, (void *) result);
         *out = result;
+        if (handle) {
+            *handle = h;
+        }
     } else {
         kdl_hashmap_get(&m->vars, r, (void **) out);
+        if (handle) {
+            *handle = r.handle;
+        }
     }
 }
 
-void setVar(kdl_machine_t *m, const char *fullName, int type, void *data) {
-    kdl_entry_t *ptr;
-    getVarRef(m, fullName, &ptr);
-    freeData(m->s, &ptr->data);
+void getVarRef(kdl_machine_t *m, const char *fullName, size_t nameLen, kdl_entry_t **out) {
+    getVarHandle(m, fullName, nameLen, out, NULL);
+}
+
+// NULL if the variable no longer exists
+kdl_entry_t *getVarByHandle(kdl_machine_t *m, kdl_varHandle_t handle) {
+    kdl_entry_t *e = NULL;
+    if (kdl_hashmap_getHandle(&m->vars, handle, (void **) &e) != KDL_HASHMAP_EOK) {
+        return NULL;
+    }
+    return e;
+}
+
+// Resolve up to VAR_BATCH_SIZE names with a single batched search,
+// creating whichever variables do not exist yet
+void getVarRefs(kdl_machine_t *m, const char *const *names, size_t n, kdl_entry_t **out) {
+    assert(n <= VAR_BATCH_SIZE);
+    kdl_hashmap_result_t results[VAR_BATCH_SIZE];
+    kdl_hashmap_searchBatch(&m->vars, names, n, results);
+    // Take the hits before inserting anything, inserts invalidate results
+    for (size_t i = 0; i < n; i++) {
+        out[i] = NULL;
+        if (results[i].code == KDL_HASHMAP_EOK) {
+            kdl_hashmap_get(&m->vars, results[i], (void **) &out[i]);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (out[i] == NULL) {
+            getVarRef(m, names[i], strlen(names[i]), &out[i]);
+        }
+    }
+}
+
+void setVarRef(kdl_machine_t *m, kdl_entry_t *ptr, const char *fullName, int type, const void *data) {
+    // `data` may be the old string
+    kdl_data_t old = ptr->data;
     copyData(m, type, data, &ptr->data);
+    freeData(m->s, &old);
     if (ptr->watcher) {
         ptr->watcher(m, fullName, &ptr->data);
     }
 }
 
-void getVarByName(kdl_machine_t *m, const char *fullName, kdl_data_t *out) {
-    kdl_entry_t *data;
-    getVarRef(m, fullName, &data);
-    copyData(m, data->data.datatype, data->data.data, out);
+void setVar(kdl_machine_t *m, const char *fullName, int type, const void *data) {
+    kdl_entry_t *ptr;
+    getVarRef(m, fullName, strlen(fullName), &ptr);
+    setVarRef(m, ptr, fullName, type, data);
+}
+
+// `values` is an array of `n` elements of the given type's size
+void setVars(kdl_machine_t *m, const char *const *names, size_t n, int type, const void *values, size_t valueSize) {
+    kdl_entry_t *refs[VAR_BATCH_SIZE];
+    for (size_t base = 0; base < n; base += VAR_BATCH_SIZE) {
+        size_t count = n - base < VAR_BATCH_SIZE ? n - base : VAR_BATCH_SIZE;
+        getVarRefs(m, names + base, count, refs);
+        for (size_t i = 0; i < count; i++) {
+            const void *value = (const char *) values + valueSize * (base + i);
+            setVarRef(m, refs[i], names[base + i], type, value);
+        }
+    }
 }
 
-void getVar(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *out) {
-    char *lookup = NULL;
-    mkName(m, context, name, &lookup);
-    getVarByName(m, lookup, out);
-    m->s.free(lookup);
+// The variable is looked up the first time only, after which the machine
+// keeps a handle to it in the op's slot. Removing the variable invalidates
+// the handle, so the op looks it up again then.
+void getVar(kdl_machine_t *m, const kdl_op_t *op, kdl_data_t *out) {
+    kdl_varHandle_t *link = &m->links[op->slot];
+    kdl_entry_t *e = getVarByHandle(m, *link);
+    if (e == NULL) {
+        char *lookup = NULL;
+        size_t lookupLen = 0;
+        mkName(m, op->context, (const char *) op->value, &lookup, &lookupLen);
+        getVarHandle(m, lookup, lookupLen, &e, link);
+        m->s.free(lookup);
+    }
+    *out = e->data;
 }
 
-// Does not do any copy
-bool getVerb(kdl_machine_t *m, const char *name, kdl_verb_t **out) {
+// Does not do any copy. Only looks at the machine's own verbs.
+bool getOwnVerb(kdl_machine_t *m, const char *name, kdl_verb_t **out) {
+    if (kdl_hashmap_size(&m->verbs) == 0) {
+        return false;
+    }
     kdl_hashmap_result_t r;
     kdl_hashmap_search(&m->verbs, name, &r);
     if (r.code != KDL_HASHMAP_EOK) {
@@ -282,9 +262,19 @@ bool getVerb(kdl_machine_t *m, const char *name, kdl_verb_t **out) {
     return true;
 }
 
+// Copies, since a registry's verbs may be freed as soon as we stop reading
+bool getVerb(kdl_machine_t *m, const char *name, kdl_verb_t *out) {
+    kdl_verb_t *own;
+    if (getOwnVerb(m, name, &own)) {
+        *out = *own;
+        return true;
+    }
+    return m->registry != NULL && kdl_registry_get(m->registry, m->reader, name, out);
+}
+
 void setVerb(kdl_machine_t *m, const char *name, kdl_verb_t verb) {
     kdl_verb_t *ptr;
-    if (getVerb(m, name, &ptr)) {
+    if (getOwnVerb(m, name, &ptr)) {
         *ptr = verb;
     } else {
         ptr = (kdl_verb_t *) m->s.malloc(sizeof(kdl_verb_t));
@@ -293,186 +283,375 @@ void setVerb(kdl_machine_t *m, const char *name, kdl_verb_t verb) {
     }
 }
 
-typedef kdl_float_t(fltFunc_t)(kdl_float_t,kdl_float_t);
-typedef kdl_int_t(fltIntFunc_t)(kdl_float_t,kdl_float_t);
-typedef kdl_int_t(intFunc_t)(kdl_int_t,kdl_int_t);
-
-typedef kdl_int_t(bIntFunc_t)(kdl_int_t);
-typedef kdl_int_t(bFltFunc_t)(kdl_float_t);
-
-void arithmetic(kdl_machine_t *m, kdl_data_t *stack, size_t *stackLen, fltFunc_t fltFunc, intFunc_t intFunc, kdl_data_t *result) {
-    assert(*stackLen >= 2);
-    kdl_data_t *a = &stack[*stackLen - 2];
-    kdl_data_t *b = &stack[*stackLen - 1];
-    assert(a->datatype == KDL_DT_FLT || a->datatype == KDL_DT_INT); // Error
-    assert(b->datatype == KDL_DT_FLT || b->datatype == KDL_DT_INT); // Error
-    if (a->datatype == KDL_DT_FLT || b->datatype == KDL_DT_FLT) {
-        result->datatype = KDL_DT_FLT;
-        kdl_float_t av = (kdl_float_t)(a->datatype == KDL_DT_FLT ? *((kdl_float_t *)a->data) : *((kdl_int_t *)a->data));
-        kdl_float_t bv = (kdl_float_t)(b->datatype == KDL_DT_FLT ? *((kdl_float_t *)b->data) : *((kdl_int_t *)b->data));
-        kdl_float_t r = fltFunc(av, bv);
-        freeData(m->s, a);
-        freeData(m->s, b);
-        *stackLen -= 2;
-        result->data = (kdl_float_t *) m->s.malloc(sizeof(kdl_float_t));
-        *((kdl_float_t *)result->data) = r;
-    } else {
-        result->datatype = KDL_DT_INT;
-        kdl_int_t av = (kdl_int_t)(a->datatype != KDL_DT_INT ? *((kdl_float_t *)a->data) : *((kdl_int_t *)a->data));
-        kdl_int_t bv = (kdl_int_t)(b->datatype != KDL_DT_INT ? *((kdl_float_t *)b->data) : *((kdl_int_t *)b->data));
-        kdl_int_t r = intFunc(av, bv);
-        freeData(m->s, a);
-        freeData(m->s, b);
-        *stackLen -= 2;
-        result->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-        *((kdl_int_t *)result->data) = r;
-    }
-}
-
-void arithmeticInt(kdl_machine_t *m, kdl_data_t *stack, size_t *stackLen, fltIntFunc_t fltFunc, intFunc_t intFunc, kdl_data_t *result) {
-    assert(*stackLen >= 2);
-    kdl_data_t *a = &stack[*stackLen - 2];
-    kdl_data_t *b = &stack[*stackLen - 1];
-    assert(a->datatype == KDL_DT_FLT || a->datatype == KDL_DT_INT); // Error
-    assert(b->datatype == KDL_DT_FLT || b->datatype == KDL_DT_INT); // Error
-    if (a->datatype == KDL_DT_FLT || b->datatype == KDL_DT_FLT) {
-        result->datatype = KDL_DT_INT;
-        kdl_float_t av = (kdl_float_t)(a->datatype == KDL_DT_FLT ? *((kdl_float_t *)a->data) : *((kdl_int_t *)a->data));
-        kdl_float_t bv = (kdl_float_t)(b->datatype == KDL_DT_FLT ? *((kdl_float_t *)b->data) : *((kdl_int_t *)b->data));
-        kdl_int_t r = fltFunc(av, bv);
-        freeData(m->s, a);
-        freeData(m->s, b);
-        *stackLen -= 2;
-        result->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-        *((kdl_float_t *)result->data) = r;
-    } else {
-        result->datatype = KDL_DT_INT;
-        kdl_int_t av = (kdl_int_t)(a->datatype != KDL_DT_INT ? *((kdl_float_t *)a->data) : *((kdl_int_t *)a->data));
-        kdl_int_t bv = (kdl_int_t)(b->datatype != KDL_DT_INT ? *((kdl_float_t *)b->data) : *((kdl_int_t *)b->data));
-        kdl_int_t r = intFunc(av, bv);
-        freeData(m->s, a);
-        freeData(m->s, b);
-        *stackLen -= 2;
-        result->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-        *((kdl_int_t *)result->data) = r;
-    }
-}
-
-void binaryArithmetic(kdl_machine_t *m, kdl_data_t *stack, size_t *stackLen, bFltFunc_t fltFunc, bIntFunc_t intFunc, kdl_data_t *result) {
-    assert(*stackLen >= 1);
-    kdl_data_t *a = &stack[*stackLen - 1];
-    assert(a->datatype == KDL_DT_FLT || a->datatype == KDL_DT_INT); // Error
-    if (a->datatype == KDL_DT_FLT) {
-        result->datatype = KDL_DT_INT;
-        kdl_float_t av = *((kdl_float_t *)a->data);
-        kdl_float_t r = fltFunc(av);
-        freeData(m->s, a);
-        *stackLen -= 1;
-        result->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_float_t));
-        *((kdl_int_t *)result->data) = r;
-    } else {
-        result->datatype = KDL_DT_INT;
-        kdl_int_t av = *((kdl_int_t *)a->data);
-        kdl_int_t r = intFunc(av);
-        freeData(m->s, a);
-        *stackLen -= 1;
-        result->data = (kdl_int_t *) m->s.malloc(sizeof(kdl_int_t));
-        *((kdl_int_t *)result->data) = r;
+kdl_float_t asFloat(const kdl_data_t *d) {
+    return d->datatype == KDL_DT_FLT ? d->value.f : (kdl_float_t) d->value.i;
+}
+
+// KDL_DT_NIL if `op` is not a literal
+int literalType(int op) {
+    switch(op) {
+    case KDL_OP_PINT:
+        return KDL_DT_INT;
+    case KDL_OP_PFLOAT:
+        return KDL_DT_FLT;
+    case KDL_OP_PSTR:
+        return KDL_DT_STR;
+    case KDL_OP_PPERC:
+        return KDL_DT_PRC;
+    default:
+        return KDL_DT_NIL;
+    }
+}
 
+// `op` must be a literal. Strings are not copied.
+void pushLiteral(const kdl_op_t *op, kdl_data_t *out) {
+    out->datatype = literalType(op->op);
+    switch(out->datatype) {
+    case KDL_DT_INT:
+        out->value.i = *((const kdl_int_t *) op->value);
+        break;
+    case KDL_DT_PRC: // Fallthrough
+    case KDL_DT_FLT:
+        out->value.f = *((const kdl_float_t *) op->value);
+        break;
+    case KDL_DT_STR:
+        out->value.s = (const char *) op->value;
+        break;
+    default:
+        assert(false);
     }
 }
 
-void doCompute(kdl_machine_t *m, kdl_compute_t *c, kdl_data_t *result) {
-    kdl_data_t *stack = m->s.malloc(sizeof(kdl_data_t) * c->length);
-    size_t stackLen = 0;
+// -- interpreter
+
+// Labels as values (GCC, Clang) let every handler jump straight to the
+// next op's handler, found by op in `handlers`. Define KDL_NO_THREADED to
+// dispatch with a switch.
+#if defined(__GNUC__) && !defined(KDL_NO_THREADED)
+#define KDL_THREADED
+#define LABEL(name) (__extension__ &&name)
+#define JUMP(target) __extension__ ({ goto *(target); })
+#define HANDLER(op, name) name:
+#define NEXT if (++op == end) { goto done; } JUMP(handlers[op->op + 1]);
+#else
+#define HANDLER(op, name) case op:
+#define NEXT if (++op == end) { goto done; } goto dispatch;
+#endif
+
+// Binary operators work on the two values on top of the stack, `a` below
+// `b`, and leave their result in `a`
+#define OPERANDS \
+    assert(top - stack >= 2); \
+    kdl_data_t *a = top - 2; \
+    kdl_data_t *b = top - 1; \
+    assert(a->datatype == KDL_DT_FLT || a->datatype == KDL_DT_INT); /* Error */ \
+    assert(b->datatype == KDL_DT_FLT || b->datatype == KDL_DT_INT); /* Error */ \
+    bool flt = a->datatype == KDL_DT_FLT || b->datatype == KDL_DT_FLT; \
+    top--;
+
+// A float if either operand is one
+#define ARITHMETIC(OP) { \
+    OPERANDS \
+    if (flt) { \
+        a->value.f = asFloat(a) OP asFloat(b); \
+        a->datatype = KDL_DT_FLT; \
+    } else { \
+        a->value.i = a->value.i OP b->value.i; \
+    } \
+}
+
+#define COMPARISON(OP) { \
+    OPERANDS \
+    a->value.i = flt ? asFloat(a) OP asFloat(b) : a->value.i OP b->value.i; \
+    a->datatype = KDL_DT_INT; \
+}
+
+// Floats are truncated first
+#define LOGIC(OP) { \
+    OPERANDS \
+    a->value.i = flt ? (int) asFloat(a) OP (int) asFloat(b) : a->value.i OP b->value.i; \
+    a->datatype = KDL_DT_INT; \
+}
+
+// Runs `c` into `result`. Ops are known good by now (see prepareCompute()).
+void doCompute(kdl_machine_t *m, const kdl_compute_t *c, kdl_data_t *result) {
+#ifdef KDL_THREADED
+    static const void *const handlers[] = {
+        [KDL_OP_NOOP + 1] = LABEL(noop),
+        [KDL_OP_PINT + 1] = LABEL(pint),
+        [KDL_OP_PFLOAT + 1] = LABEL(pfloat),
+        [KDL_OP_PSTR + 1] = LABEL(pstr),
+        [KDL_OP_PVAR + 1] = LABEL(pvar),
+        [KDL_OP_ADD + 1] = LABEL(add),
+        [KDL_OP_SUB + 1] = LABEL(sub),
+        [KDL_OP_DIV + 1] = LABEL(div),
+        [KDL_OP_MUL + 1] = LABEL(mul),
+        [KDL_OP_EQU + 1] = LABEL(equ),
+        [KDL_OP_LEQ + 1] = LABEL(leq),
+        [KDL_OP_GEQ + 1] = LABEL(geq),
+        [KDL_OP_LTH + 1] = LABEL(lth),
+        [KDL_OP_GTH + 1] = LABEL(gth),
+        [KDL_OP_AND + 1] = LABEL(and),
+        [KDL_OP_OR + 1] = LABEL(or),
+        [KDL_OP_NOT + 1] = LABEL(not),
+        [KDL_OP_PPERC + 1] = LABEL(pperc),
+    };
+#endif
+
+    // Constants (as written, or folded by the parser) need no stack
+    if (c->length == 1 && literalType(c->opers[0].op) != KDL_DT_NIL) {
+        pushLiteral(&c->opers[0], result);
+        return;
+    }
+
+    kdl_data_t *stack = m->stack;
+    kdl_data_t *top = stack;
+    assert(c->length <= m->stackSize); // Error: program was not prepared
+    const kdl_op_t *op = c->opers;
+    const kdl_op_t *end = c->opers + c->length;
+
+#ifdef KDL_THREADED
+    JUMP(handlers[op->op + 1]);
+#else
+dispatch:
+    switch (op->op) {
+#endif
+    HANDLER(KDL_OP_NOOP, noop)
+        NEXT
+    HANDLER(KDL_OP_PINT, pint)
+        top->datatype = KDL_DT_INT;
+        top->value.i = *((const kdl_int_t *) op->value);
+        top++;
+        NEXT
+    HANDLER(KDL_OP_PFLOAT, pfloat)
+        top->datatype = KDL_DT_FLT;
+        top->value.f = *((const kdl_float_t *) op->value);
+        top++;
+        NEXT
+    HANDLER(KDL_OP_PPERC, pperc)
+        top->datatype = KDL_DT_PRC;
+        top->value.f = *((const kdl_float_t *) op->value);
+        top++;
+        NEXT
+    HANDLER(KDL_OP_PSTR, pstr)
+        top->datatype = KDL_DT_STR;
+        top->value.s = (const char *) op->value;
+        top++;
+        NEXT
+    HANDLER(KDL_OP_PVAR, pvar)
+        getVar(m, op, top);
+        assert(top->datatype != KDL_DT_NIL);
+        top++;
+        NEXT
+    HANDLER(KDL_OP_ADD, add)
+        ARITHMETIC(+)
+        NEXT
+    HANDLER(KDL_OP_SUB, sub)
+        ARITHMETIC(-)
+        NEXT
+    HANDLER(KDL_OP_DIV, div)
+        ARITHMETIC(/)
+        NEXT
+    HANDLER(KDL_OP_MUL, mul)
+        ARITHMETIC(*)
+        NEXT
+    HANDLER(KDL_OP_EQU, equ)
+        COMPARISON(==)
+        NEXT
+    HANDLER(KDL_OP_LEQ, leq)
+        COMPARISON(<=)
+        NEXT
+    HANDLER(KDL_OP_GEQ, geq)
+        COMPARISON(>=)
+        NEXT
+    HANDLER(KDL_OP_LTH, lth)
+        COMPARISON(<)
+        NEXT
+    HANDLER(KDL_OP_GTH, gth)
+        COMPARISON(>)
+        NEXT
+    HANDLER(KDL_OP_AND, and)
+        LOGIC(&&)
+        NEXT
+    HANDLER(KDL_OP_OR, or)
+        LOGIC(||)
+        NEXT
+    HANDLER(KDL_OP_NOT, not) {
+        assert(top - stack >= 1);
+        kdl_data_t *a = top - 1;
+        assert(a->datatype == KDL_DT_FLT || a->datatype == KDL_DT_INT); // Error
+        a->value.i = a->datatype == KDL_DT_FLT ? !((int) a->value.f) : !a->value.i;
+        a->datatype = KDL_DT_INT;
+        NEXT
+    }
+#ifndef KDL_THREADED
+    default:
+        assert(false); // Error: unknown op
+    }
+#endif
+
+done:
+    assert(top - stack == 1); // Tmp; error check
+    *result = stack[0];
+}
 
+// -- end interpreter
+
+typedef struct {
+    kdl_verb_t verb;
+    // Of the machine's verbs and of its registry when `verb` was looked up
+    uint64_t verbsVersion;
+    uint64_t registryVersion;
+} binding_t;
+
+// Grows the evaluation buffers to hold `stack` values and `params`
+// parameters
+void fitBuffers(kdl_machine_t *m, size_t stack, size_t params) {
+    if (stack > m->stackSize) {
+        m->stack = (kdl_data_t *) m->s.realloc(m->stack, sizeof(kdl_data_t) * stack);
+        m->stackSize = stack;
+    }
+    if (params > m->paramsSize) {
+        m->params = (kdl_data_t *) m->s.realloc(m->params, sizeof(kdl_data_t) * params);
+        m->paramsSize = params;
+    }
+}
+
+// Grows the slot tables to hold `nRules` rules and `nLinks` variable ops.
+// New slots start zeroed: inactive, unbound and unlinked.
+void fitSlots(kdl_machine_t *m, size_t nRules, size_t nLinks) {
+    if (nRules > m->rulesSize) {
+        size_t size = nRules * 2;
+        m->rules = (kdl_ruleState_t *) m->s.realloc(m->rules, sizeof(kdl_ruleState_t) * size);
+        memset(m->rules + m->rulesSize, 0, sizeof(kdl_ruleState_t) * (size - m->rulesSize));
+        m->rulesSize = size;
+    }
+    if (nLinks > m->linksSize) {
+        size_t size = nLinks * 2;
+        m->links = (kdl_varHandle_t *) m->s.realloc(m->links, sizeof(kdl_varHandle_t) * size);
+        memset(m->links + m->linksSize, 0, sizeof(kdl_varHandle_t) * (size - m->linksSize));
+        m->linksSize = size;
+    }
+    m->nRules = nRules > m->nRules ? nRules : m->nRules;
+    m->nLinks = nLinks > m->nLinks ? nLinks : m->nLinks;
+}
+
+// Forgets the state of the loaded program, for the next one to number its
+// slots from 0
+void clearSlots(kdl_machine_t *m) {
+    if (m->nRules > 0) {
+        memset(m->rules, 0, sizeof(kdl_ruleState_t) * m->nRules);
+    }
+    if (m->nLinks > 0) {
+        memset(m->links, 0, sizeof(kdl_varHandle_t) * m->nLinks);
+    }
+    m->nRules = 0;
+    m->nLinks = 0;
+}
+
+// Sizes the stack for `c`, and makes room for the slots of its variable
+// ops. With `number`, gives them their slots first.
+void prepareCompute(kdl_machine_t *m, kdl_compute_t *c, bool number) {
+    fitBuffers(m, c->length, 0);
     for (size_t i = 0; i < c->length; i++) {
-        kdl_op_t *op = c->opers + i;
-        kdl_data_t e;
-        e.data = NULL;
-        e.datatype = KDL_DT_NIL;
-        switch(op->op) {
-        case KDL_OP_NOOP:
-            // Do nothing
-            break;
-        case KDL_OP_PINT:
-            e.datatype = KDL_DT_INT;
-            copyData(m, KDL_DT_INT, op->value, &e);
-            break;
-        case KDL_OP_PFLOAT:
-            e.datatype = KDL_DT_FLT;
-            copyData(m, KDL_DT_FLT, op->value, &e);
-            break;
-        case KDL_OP_PSTR:
-            e.datatype = KDL_DT_STR;
-            copyData(m, KDL_DT_STR, op->value, &e);
-            break;
-        case KDL_OP_PPERC:
-            e.datatype = KDL_DT_PRC;
-            copyData(m, KDL_DT_PRC, op->value, &e);
-            break;
-        case KDL_OP_PVAR:
-            getVar(m, op->context, (char *) op->value, &e);
-            break;
-        case KDL_OP_ADD:
-            arithmetic(m, stack, &stackLen, addFloat, addInt, &e);
-            break;
-        case KDL_OP_SUB:
-            arithmetic(m, stack, &stackLen, subFloat, subInt, &e);
-            break;
-        case KDL_OP_DIV:
-            arithmetic(m, stack, &stackLen, divFloat, divInt, &e);
-            break;
-        case KDL_OP_MUL:
-            arithmetic(m, stack, &stackLen, mulFloat, mulInt, &e);
-            break;
-        case KDL_OP_EQU:
-            arithmeticInt(m, stack, &stackLen, equFloat, equInt, &e);
-            break;
-        case KDL_OP_LEQ:
-            arithmeticInt(m, stack, &stackLen, leqFloat, leqInt, &e);
-            break;
-        case KDL_OP_GEQ:
-            arithmeticInt(m, stack, &stackLen, geqFloat, geqInt, &e);
-            break;
-        case KDL_OP_LTH:
-            arithmeticInt(m, stack, &stackLen, lthFloat, lthInt, &e);
-            break;
-        case KDL_OP_GTH:
-            arithmeticInt(m, stack, &stackLen, gthFloat, gthInt, &e);
-            break;
-        case KDL_OP_AND:
-            arithmeticInt(m, stack, &stackLen, andFloat, andInt, &e);
-            break;
-        case KDL_OP_OR:
-            arithmeticInt(m, stack, &stackLen, orFloat, orInt, &e);
-            break;
-        case KDL_OP_NOT:
-            binaryArithmetic(m, stack, &stackLen, notFloat, notInt, &e);
-            break;
-        default:
-            assert(false);
+        kdl_op_t *op = &c->opers[i];
+        assert(op->op >= KDL_OP_NOOP && op->op <= KDL_OP_PPERC); // Error: unknown op
+        if (op->op != KDL_OP_PVAR) {
+            continue;
+        }
+        if (number) {
+            op->slot = m->nLinks;
         }
-        assert(e.datatype != KDL_DT_NIL);
-        stack[stackLen++] = e;
+        fitSlots(m, 0, op->slot + 1);
     }
-    assert(stackLen == 1); // Tmp; error check
-    *result = stack[0];
-    m->s.free(stack);
 }
 
-void doExecute(kdl_machine_t *m, kdl_execute_t *c) {
-    if (c->order.verb != NULL) {
-        kdl_verb_t *verb;
-        if (!getVerb(m, c->order.verb, &verb)) {
+// Gets `p` ready to run: sizes the evaluation buffers for it, and binds
+// every rule to the binding of its verb name. The verb itself is only
+// looked up when the rule first runs, since verbs are usually added after
+// loading.
+// Parsed programs are given their slots here (`number`). Binaries come
+// with theirs, and are only read.
+void prepareProgram(kdl_machine_t *m, kdl_program_t *p, bool number) {
+    for (size_t i = 0; i < p->length; i++) {
+        kdl_rule_t *rule = &p->rules[i];
+        kdl_execute_t *c = &rule->execute;
+        if (number) {
+            rule->slot = m->nRules;
+        }
+        fitSlots(m, rule->slot + 1, 0);
+        fitBuffers(m, 0, c->order.nParams);
+        prepareCompute(m, &rule->compute, number);
+        for (size_t j = 0; j < c->order.nParams; j++) {
+            prepareCompute(m, &c->order.params[j], number);
+        }
+        binding_t *b = NULL;
+        if (c->order.verb != NULL) {
+            kdl_hashmap_result_t r;
+            kdl_hashmap_search(&m->bindings, c->order.verb, &r);
+            if (r.code == KDL_HASHMAP_EOK) {
+                kdl_hashmap_get(&m->bindings, r, (void **) &b);
+            } else {
+                b = (binding_t *) m->s.malloc(sizeof(binding_t));
+                memset(b, 0, sizeof(binding_t)); // Version 0 is never current
+                kdl_hashmap_insert(&m->bindings, c->order.verb, b);
+            }
+        }
+        m->rules[rule->slot].binding = b;
+        if (c->child.lazy == NULL) {
+            prepareProgram(m, &c->child, number);
+        } else if (c->child.lazy->parsed) {
+            prepareProgram(m, &c->child.lazy->program, number);
+        }
+    }
+}
+
+kdl_verb_t *getBoundVerb(kdl_machine_t *m, const kdl_rule_t *rule) {
+    const kdl_action_t *a = &rule->execute.order;
+    binding_t *b = (binding_t *) m->rules[rule->slot].binding;
+    assert(b != NULL); // Error: program was not bound
+    uint64_t registryVersion = m->registry ? kdl_registry_version(m->registry) : 0;
+    if (b->verbsVersion != m->verbsVersion || b->registryVersion != registryVersion) {
+        if (!getVerb(m, a->verb, &b->verb)) {
             assert(m->defVerb.func != NULL); // Error: verb not found, and no fallback specified
-            verb = &m->defVerb;
+            b->verb = m->defVerb;
         }
+        b->verbsVersion = m->verbsVersion;
+        b->registryVersion = registryVersion;
+    }
+    return &b->verb;
+}
+
+// Parses the child program first if it is lazy
+kdl_program_t *getChild(kdl_machine_t *m, kdl_execute_t *c) {
+    kdl_program_t *child = &c->child;
+    if (child->lazy != NULL) {
+        bool parsed = child->lazy->parsed;
+        kdl_error_t e = kdl_parseLazyChild(m->s, child->lazy);
+        if (e.code != KDL_ERR_OK) {
+            m->lazyError = e;
+        }
+        child = &child->lazy->program;
+        if (!parsed) {
+            prepareProgram(m, child, true);
+        }
+    }
+    return child;
+}
+
+void doExecute(kdl_machine_t *m, kdl_rule_t *r) {
+    kdl_execute_t *c = &r->execute;
+    if (c->order.verb != NULL) {
+        kdl_verb_t *verb = getBoundVerb(m, r);
         if (verb->validate && c->order.nParams != verb->datatypesLen) {
             assert(false); // Error: invalid number of parameters
         }
-        kdl_data_t *params = (kdl_data_t *) m->s.malloc(sizeof(kdl_data_t) * c->order.nParams);
+        // Computes only use the stack, so the parameters can't be
+        // overwritten while they are gathered
+        kdl_data_t *params = m->params;
         size_t paramsLen = 0;
+        // Verbs may run the machine again, so only this call's copies go
+        kdl_arenaMark_t mark = kdl_arena_mark(&m->paramStrings);
         for (size_t i = 0; i < c->order.nParams; i++) {
             kdl_data_t result;
             doCompute(m, &c->order.params[i], &result);
@@ -480,20 +659,19 @@ void doExecute(kdl_machine_t *m, kdl_execute_t *c) {
                 // TODO: handle correctly
                 assert(false); // Error: datatype mismatch
             }
+            if (result.datatype == KDL_DT_STR) {
+                result.value.s = kdl_arena_strndup(&m->paramStrings, result.value.s, strlen(result.value.s));
+            }
             params[paramsLen++] = result;
         }
 
         verb->func(m, c->order.context, c->order.verb, params, paramsLen);
-
-        for (size_t i = 0; i < paramsLen; i++) {
-            freeData(m->s, &params[i]);
-        }
-        m->s.free(params);
+        kdl_arena_rewind(&m->paramStrings, mark);
     }
 
     // Now add child elements to program
 
-    appendProgram(m, &c->child, &m->pbuf[m->back]);
+    appendProgram(m, getChild(m, c), &m->pbuf[m->back]);
 }
 
 void kdl_machine_setInt(kdl_machine_t *m, const char *name, kdl_int_t value) {
@@ -508,11 +686,89 @@ void kdl_machine_setFloat(kdl_machine_t *m, const char *name, kdl_float_t value)
     setVar(m, name, KDL_DT_FLT, (void *) &value);
 }
 
+void kdl_machine_setInts(kdl_machine_t *m, const char *const *names, const kdl_int_t *values, size_t n) {
+    setVars(m, names, n, KDL_DT_INT, values, sizeof(kdl_int_t));
+}
+
+void kdl_machine_setFloats(kdl_machine_t *m, const char *const *names, const kdl_float_t *values, size_t n) {
+    setVars(m, names, n, KDL_DT_FLT, values, sizeof(kdl_float_t));
+}
+
+kdl_varHandle_t kdl_machine_getHandle(kdl_machine_t *m, const char *name) {
+    kdl_entry_t *e;
+    kdl_varHandle_t h;
+    getVarHandle(m, name, strlen(name), &e, &h);
+    return h;
+}
+
+int kdl_machine_setIntByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_int_t value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    setVarRef(m, e, e->name, KDL_DT_INT, (void *) &value);
+    return KDL_ERR_OK;
+}
+
+int kdl_machine_setStringByHandle(kdl_machine_t *m, kdl_varHandle_t handle, const char *value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    setVarRef(m, e, e->name, KDL_DT_STR, (void *) value);
+    return KDL_ERR_OK;
+}
+
+int kdl_machine_setFloatByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_float_t value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    setVarRef(m, e, e->name, KDL_DT_FLT, (void *) &value);
+    return KDL_ERR_OK;
+}
+
+int kdl_machine_getIntByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_int_t *value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    if (e->data.datatype != KDL_DT_INT) {
+        return KDL_ERR_TYP;
+    }
+    *value = e->data.value.i;
+    return KDL_ERR_OK;
+}
+
+int kdl_machine_getStringByHandle(kdl_machine_t *m, kdl_varHandle_t handle, const char **value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    if (e->data.datatype != KDL_DT_STR) {
+        return KDL_ERR_TYP;
+    }
+    *value = e->data.value.s;
+    return KDL_ERR_OK;
+}
+
+int kdl_machine_getFloatByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_float_t *value) {
+    kdl_entry_t *e = getVarByHandle(m, handle);
+    if (!e) {
+        return KDL_ERR_REF;
+    }
+    if (e->data.datatype != KDL_DT_FLT) {
+        return KDL_ERR_TYP;
+    }
+    *value = e->data.value.f;
+    return KDL_ERR_OK;
+}
+
 int kdl_machine_getInt(kdl_machine_t *m, const char *name, kdl_int_t *value) {
     kdl_entry_t *e;
-    getVarRef(m, name, &e);
+    getVarRef(m, name, strlen(name), &e);
     if (e->data.datatype == KDL_DT_INT) {
-        *value = *((kdl_int_t *)e->data.data);
+        *value = e->data.value.i;
         return KDL_ERR_OK;
     } else {
         return KDL_ERR_TYP;
@@ -521,9 +777,9 @@ int kdl_machine_getInt(kdl_machine_t *m, const char *name, kdl_int_t *value) {
 
 int kdl_machine_getString(kdl_machine_t *m, const char *name, const char **value) {
     kdl_entry_t *e;
-    getVarRef(m, name, &e);
+    getVarRef(m, name, strlen(name), &e);
     if (e->data.datatype == KDL_DT_STR) {
-        *value = (char *) e->data.data;
+        *value = e->data.value.s;
         return KDL_ERR_OK;
     } else {
         return KDL_ERR_TYP;
@@ -532,9 +788,9 @@ int kdl_machine_getString(kdl_machine_t *m, const char *name, const char **value
 
 int kdl_machine_getFloat(kdl_machine_t *m, const char *name, kdl_float_t *value) {
     kdl_entry_t *e;
-    getVarRef(m, name, &e);
+    getVarRef(m, name, strlen(name), &e);
     if (e->data.datatype == KDL_DT_FLT) {
-        *value = *((kdl_float_t *)e->data.data);
+        *value = e->data.value.f;
         return KDL_ERR_OK;
     } else {
         return KDL_ERR_TYP;
@@ -543,19 +799,76 @@ int kdl_machine_getFloat(kdl_machine_t *m, const char *name, kdl_float_t *value)
 
 
 
+typedef struct {
+    kdl_machine_t *m;
+    kdl_varVisitor_t visitor;
+    void *user;
+} varVisit_t;
+
+void visitVar_fwd(void *user, void *value) {
+    varVisit_t *v = (varVisit_t *) user;
+    kdl_entry_t *e = (kdl_entry_t *) value;
+    v->visitor(v->m, e->name, &e->data, v->user);
+}
+
+// The entry is already out of the index
+void removeVar_fwd(void *user, void *value) {
+    kdl_machine_t *m = (kdl_machine_t *) user;
+    kdl_entry_t *e = (kdl_entry_t *) value;
+    kdl_hashmap_result_t r;
+    kdl_hashmap_search(&m->vars, e->name, &r);
+    assert(r.code == KDL_HASHMAP_EOK);
+    kdl_hashmap_remove(&m->vars, r);
+}
+
+void kdl_machine_forEachVar(kdl_machine_t *m, const char *prefix, kdl_varVisitor_t visitor, void *user) {
+    varVisit_t v;
+    v.m = m;
+    v.visitor = visitor;
+    v.user = user;
+    kdl_trie_forEach(&m->varIndex, prefix, visitVar_fwd, &v);
+}
+
+size_t kdl_machine_countVars(kdl_machine_t *m, const char *prefix) {
+    return kdl_trie_count(&m->varIndex, prefix);
+}
+
+void kdl_machine_removeVars(kdl_machine_t *m, const char *prefix) {
+    kdl_trie_removePrefix(&m->varIndex, prefix, removeVar_fwd, m);
+}
+
 void kdl_machine_addWatcher(kdl_machine_t *m, const char *target, kdl_watcher_t callback) {
     kdl_entry_t *e;
-    getVarRef(m, target, &e);
+    getVarRef(m, target, strlen(target), &e);
     e->watcher = callback;
 }
 
 
 void kdl_machine_addVerb(kdl_machine_t *m, const char *target, kdl_verb_t v) {
     setVerb(m, target, v);
+    m->verbsVersion++;
 }
 
 void kdl_machine_addDefVerb(kdl_machine_t *m, kdl_verb_t v) {
     m->defVerb = v;
+    m->verbsVersion++;
+}
+
+void kdl_machine_setRegistry(kdl_machine_t *m, kdl_registry_t *r) {
+    if (m->registry) {
+        kdl_registry_removeReader(m->registry, m->reader);
+    }
+    m->registry = r;
+    m->reader = r ? kdl_registry_addReader(r) : NULL;
+    m->verbsVersion++;
+}
+
+void kdl_mkVerbRegistry(kdl_registry_t *out) {
+    kdl_state_t s;
+    s.malloc = defMalloc;
+    s.realloc = defRealloc;
+    s.free = defFree;
+    kdl_registry_init(s, out, sizeof(kdl_verb_t));
 }
 
 #define UNUSED(x) (void)(x)
@@ -577,6 +890,8 @@ void kdl_mkMachine(kdl_machine_t *out) {
 
     m.defVerb.validate = false;
     m.defVerb.func = defDefVerb;
+    m.lazyError.code = KDL_ERR_OK;
+    m.lazyError.message = "No error";
 
     memset(&m.start, 0, sizeof(kdl_program_t));
     memset(m.pbuf, 0, sizeof(m.pbuf));
@@ -584,12 +899,19 @@ void kdl_mkMachine(kdl_machine_t *out) {
     m.front = 0;
     m.back = 1;
 
-    kdl_hashmap_init(m.s, &m.verbs, 4, freeVerb_fwd);
-    kdl_hashmap_init(m.s, &m.vars, 4, freeEntry_fwd);
+    kdl_hashmap_init(m.s, &m.verbs, 4, freeVerb_fwd, NULL);
+    kdl_hashmap_init(m.s, &m.bindings, 4, freeVerb_fwd, NULL);
+    m.verbsVersion = 1;
+    kdl_hashmap_init(m.s, &m.vars, 4, freeEntry_fwd, NULL);
+    kdl_trie_init(m.s, &m.varIndex);
+    kdl_arena_init(m.s, &m.paramStrings, 0);
 
     *out = m;
 }
 
+void kdl_machine_reserve(kdl_machine_t *m, size_t nVars) {
+    kdl_hashmap_reserve(&m->vars, nVars);
+}
 
 void rewindToStart(kdl_machine_t *m) {
     m->pbuf[m->front].length = 0;
@@ -598,13 +920,470 @@ void rewindToStart(kdl_machine_t *m) {
     backwriteBuffer(m, &m->pbuf[m->front], &m->pbuf[m->back]);
 }
 
+// Frees whatever was loaded before
+void replaceStart(kdl_machine_t *m, kdl_program_t p) {
+    kdl_freeProgram(m->s, &m->start);
+    kdl_binary_close(&m->binary);
+    m->start = p;
+    memset(&m->lazyError, 0, sizeof(kdl_error_t));
+    m->lazyError.code = KDL_ERR_OK;
+    m->lazyError.message = "No error";
+}
+
+// -- reloading
+
+// Rules are matched by what they are: their condition and action (not
+// their children, so that editing a child does not lose its siblings),
+// their parent's match, and how many siblings before them are the same.
+// The key hashes all of that, to find candidates. Each is then compared.
+typedef uint64_t ruleKey_t;
+
+typedef struct {
+    ruleKey_t key;
+    // How many siblings before it are the same
+    size_t nth;
+} ruleId_t;
+
+typedef struct {
+    kdl_rule_t *rule;
+    // Where the old rule was in the front buffer
+    size_t order;
+} keptRule_t;
+
+typedef struct {
+    ruleKey_t key;
+    size_t index;
+} sibling_t;
+
+// An active rule of the old program
+typedef struct oldRule_p {
+    const kdl_rule_t *rule;
+    // NULL for top level rules
+    const struct oldRule_p *parent;
+    size_t nth;
+    // Where it is in the front buffer, 0 for top level rules
+    size_t order;
+    // Another rule with the same key
+    struct oldRule_p *next;
+} oldRule_t;
+
+typedef struct {
+    kdl_machine_t *m;
+    // Where the old program's child rules are in the front buffer, by
+    // slot. 0 for the others.
+    size_t *orders;
+    // Key of an active rule of the old program -> the first oldRule_t with
+    // it. Top level rules are always active, so they are only here if they
+    // have active children.
+    kdl_hashmap_t active;
+    oldRule_t *oldRules;
+    size_t oldRulesLen;
+    // Child rules of the new program that stay active
+    keptRule_t *kept;
+    size_t keptLen;
+    size_t keptSize;
+    // A stack of the ids of the rules of the programs being walked
+    ruleId_t *ids;
+    size_t idsLen;
+    size_t idsSize;
+    // Scratch for idRules()
+    sibling_t *siblings;
+    size_t siblingsSize;
+} reload_t;
+
+ruleKey_t hashBytes(ruleKey_t h, const void *data, size_t length) {
+    return kdl_hashmap_defaultHash((const char *) data, length, h);
+}
+
+// NULL and "" are both the root context
+ruleKey_t hashString(ruleKey_t h, const char *str) {
+    if (str == NULL) {
+        str = "";
+    }
+    return hashBytes(h, str, strlen(str) + 1);
+}
+
+// long double has padding, so its bytes can't be hashed. Two doubles hold
+// all of its precision.
+ruleKey_t hashFloat(ruleKey_t h, kdl_float_t f) {
+    double parts[2];
+    parts[0] = (double) f;
+    parts[1] = (double) (f - parts[0]);
+    return hashBytes(h, parts, sizeof(parts));
+}
+
+ruleKey_t hashCompute(ruleKey_t h, const kdl_compute_t *c) {
+    h = hashBytes(h, &c->length, sizeof(c->length));
+    for (size_t i = 0; i < c->length; i++) {
+        const kdl_op_t *op = &c->opers[i];
+        h = hashBytes(h, &op->op, sizeof(op->op));
+        h = hashString(h, op->context);
+        if (op->value == NULL) {
+            continue;
+        }
+        switch (op->op) {
+        case KDL_OP_PINT:
+            h = hashBytes(h, op->value, sizeof(kdl_int_t));
+            break;
+        case KDL_OP_PFLOAT:
+        case KDL_OP_PPERC:
+            h = hashFloat(h, *(const kdl_float_t *) op->value);
+            break;
+        default:
+            h = hashString(h, (const char *) op->value);
+        }
+    }
+    return h;
+}
+
+// Everything but the children
+ruleKey_t hashRule(ruleKey_t parent, const kdl_rule_t *rule) {
+    ruleKey_t h = hashCompute(parent, &rule->compute);
+    const kdl_action_t *a = &rule->execute.order;
+    h = hashString(h, a->verb);
+    if (a->verb != NULL) {
+        h = hashString(h, a->context);
+    }
+    h = hashBytes(h, &a->nParams, sizeof(a->nParams));
+    for (size_t i = 0; i < a->nParams; i++) {
+        h = hashCompute(h, &a->params[i]);
+    }
+    return h;
+}
+
+// Equal for what hashString() hashes the same
+bool sameString(const char *a, const char *b) {
+    return strcmp(a == NULL ? "" : a, b == NULL ? "" : b) == 0;
+}
+
+// Equal for what hashCompute() hashes the same
+bool sameCompute(const kdl_compute_t *a, const kdl_compute_t *b) {
+    if (a->length != b->length) {
+        return false;
+    }
+    for (size_t i = 0; i < a->length; i++) {
+        const kdl_op_t *x = &a->opers[i];
+        const kdl_op_t *y = &b->opers[i];
+        if (x->op != y->op || !sameString(x->context, y->context) || (x->value == NULL) != (y->value == NULL)) {
+            return false;
+        }
+        if (x->value == NULL) {
+            continue;
+        }
+        switch (x->op) {
+        case KDL_OP_PINT:
+            if (*(const kdl_int_t *) x->value != *(const kdl_int_t *) y->value) {
+                return false;
+            }
+            break;
+        case KDL_OP_PFLOAT:
+        case KDL_OP_PPERC:
+            if (*(const kdl_float_t *) x->value != *(const kdl_float_t *) y->value) {
+                return false;
+            }
+            break;
+        default:
+            if (!sameString((const char *) x->value, (const char *) y->value)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Equal for what hashRule() hashes the same
+bool sameRule(const kdl_rule_t *a, const kdl_rule_t *b) {
+    const kdl_action_t *x = &a->execute.order;
+    const kdl_action_t *y = &b->execute.order;
+    if (!sameCompute(&a->compute, &b->compute) || !sameString(x->verb, y->verb) ||
+        (x->verb != NULL && !sameString(x->context, y->context)) || x->nParams != y->nParams) {
+        return false;
+    }
+    for (size_t i = 0; i < x->nParams; i++) {
+        if (!sameCompute(&x->params[i], &y->params[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int compareSiblings(const void *a, const void *b) {
+    const sibling_t *x = (const sibling_t *) a;
+    const sibling_t *y = (const sibling_t *) b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Pushes the ids of every rule of `p` on `r->ids`. They are still there
+// after more ids are pushed and popped, but may move.
+void idRules(reload_t *r, const kdl_program_t *p, ruleKey_t parent) {
+    kdl_state_t s = r->m->s;
+    if (r->idsLen + p->length > r->idsSize) {
+        r->idsSize = (r->idsLen + p->length) * 2;
+        r->ids = (ruleId_t *) s.realloc(r->ids, sizeof(ruleId_t) * r->idsSize);
+    }
+    if (p->length > r->siblingsSize) {
+        r->siblingsSize = p->length * 2;
+        r->siblings = (sibling_t *) s.realloc(r->siblings, sizeof(sibling_t) * r->siblingsSize);
+    }
+    for (size_t i = 0; i < p->length; i++) {
+        r->siblings[i].key = hashRule(parent, &p->rules[i]);
+        r->siblings[i].index = i;
+    }
+    // Brings siblings that are likely the same together, in order. Only
+    // the first of a run is compared to the rest, which is enough for keys.
+    if (p->length > 1) {
+        qsort(r->siblings, p->length, sizeof(sibling_t), compareSiblings);
+    }
+    ruleId_t *ids = r->ids + r->idsLen;
+    size_t nth = 0;
+    size_t first = 0;
+    for (size_t i = 0; i < p->length; i++) {
+        sibling_t *sibling = &r->siblings[i];
+        if (i > 0 && sibling->key == r->siblings[first].key &&
+            sameRule(&p->rules[sibling->index], &p->rules[r->siblings[first].index])) {
+            nth++;
+        } else {
+            nth = 0;
+            first = i;
+        }
+        ids[sibling->index].key = nth > 0 ? hashBytes(sibling->key, &nth, sizeof(nth)) : sibling->key;
+        ids[sibling->index].nth = nth;
+    }
+    r->idsLen += p->length;
+}
+
+// The first entry with `hash` in `map`, NULL if there is none
+void *firstWithHash(kdl_hashmap_t *map, ruleKey_t hash) {
+    kdl_hashmap_result_t result;
+    void *first = NULL;
+    if (kdl_hashmap_searchHashed(map, (const char *) &hash, sizeof(hash), hash, &result) == KDL_HASHMAP_EOK) {
+        kdl_hashmap_get(map, result, &first);
+    }
+    return first;
+}
+
+// The old rule that `rule`, with id `id`, takes the place of. NULL if
+// there is none.
+const oldRule_t *findOld(reload_t *r, const kdl_rule_t *rule, ruleId_t id, const oldRule_t *parent) {
+    const oldRule_t *o = (const oldRule_t *) firstWithHash(&r->active, id.key);
+    for (; o != NULL; o = o->next) {
+        if (o->parent == parent && o->nth == id.nth && sameRule(o->rule, rule)) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+// Makes `o` findable by its key
+void addOld(reload_t *r, oldRule_t *o, ruleKey_t key) {
+    oldRule_t *first = (oldRule_t *) firstWithHash(&r->active, key);
+    if (first == NULL) {
+        kdl_hashmap_insertHashed(&r->active, (const char *) &key, sizeof(key), key, o);
+        return;
+    }
+    while (first->next != NULL) {
+        first = first->next;
+    }
+    first->next = o;
+}
+
+// Records the active rules under `p`, whose own match is `parent`, and
+// returns how many there were. Top level rules are only recorded if they
+// have active children, since they are active anyway.
+// Unparsed lazy children can't have been activated.
+size_t recordOldRules(reload_t *r, const kdl_program_t *p, ruleKey_t parentKey, const oldRule_t *parent) {
+    bool top = parent == NULL;
+    if (p->lazy != NULL) {
+        if (!p->lazy->parsed) {
+            return 0;
+        }
+        p = &p->lazy->program;
+    }
+    if (p->length == 0) {
+        return 0;
+    }
+    size_t found = 0;
+    size_t first = r->idsLen;
+    idRules(r, p, parentKey);
+    for (size_t i = 0; i < p->length; i++) {
+        const kdl_rule_t *rule = &p->rules[i];
+        // Active child rules are all in the front buffer
+        size_t order = top ? 0 : r->orders[rule->slot];
+        if (!top && order == 0) {
+            continue;
+        }
+        // Taken now, for the children to point at. Given back if it turns
+        // out not to be needed, which is only when nothing came after.
+        oldRule_t *o = &r->oldRules[r->oldRulesLen++];
+        o->rule = rule;
+        o->parent = parent;
+        o->nth = r->ids[first + i].nth;
+        o->order = order;
+        o->next = NULL;
+        ruleId_t id = r->ids[first + i];
+        size_t children = recordOldRules(r, &rule->execute.child, id.key, o);
+        if (!top || children > 0) {
+            addOld(r, o, id.key);
+        } else {
+            r->oldRulesLen--;
+        }
+        found += children + !top;
+    }
+    r->idsLen = first;
+    return found;
+}
+
+// Finds the rules under `p` that take the place of an active old rule,
+// the children of `parent`
+void keepNewRules(reload_t *r, kdl_program_t *p, ruleKey_t parentKey, const oldRule_t *parent) {
+    if (p->length == 0) {
+        return;
+    }
+    size_t first = r->idsLen;
+    idRules(r, p, parentKey);
+    for (size_t i = 0; i < p->length; i++) {
+        kdl_rule_t *rule = &p->rules[i];
+        ruleId_t id = r->ids[first + i];
+        const oldRule_t *o = findOld(r, rule, id, parent);
+        if (o == NULL) {
+            continue;
+        }
+        if (parent != NULL) {
+            if (r->keptLen == r->keptSize) {
+                r->keptSize = r->keptSize == 0 ? PROG_BUF_STEP : r->keptSize * 2;
+                r->kept = (keptRule_t *) r->m->s.realloc(r->kept, sizeof(keptRule_t) * r->keptSize);
+            }
+            r->kept[r->keptLen].rule = rule;
+            r->kept[r->keptLen++].order = o->order;
+        }
+        keepNewRules(r, getChild(r->m, &rule->execute), id.key, o);
+    }
+    r->idsLen = first;
+}
+
+int compareKept(const void *a, const void *b) {
+    size_t x = ((const keptRule_t *) a)->order;
+    size_t y = ((const keptRule_t *) b)->order;
+    return (x > y) - (x < y);
+}
+
+// Values belong to the reload
+void noFree(kdl_state_t s, void *data) {
+    (void) s;
+    (void) data;
+}
+
+// Indexes the front buffer's child rules, and makes room for the old
+// rules that are active
+void indexFront(reload_t *r) {
+    kdl_machine_t *m = r->m;
+    kdl_programBuffer_t *front = &m->pbuf[m->front];
+    r->orders = (size_t *) m->s.malloc(sizeof(size_t) * (m->nRules + 1));
+    memset(r->orders, 0, sizeof(size_t) * (m->nRules + 1));
+    for (size_t i = m->start.length; i < front->length; i++) {
+        r->orders[front->rules[i].slot] = i;
+    }
+    // One per rule of the buffer at most
+    kdl_hashmap_init(m->s, &r->active, 4, noFree, NULL);
+    kdl_hashmap_reserve(&r->active, front->length);
+    r->oldRules = (oldRule_t *) m->s.malloc(sizeof(oldRule_t) * (front->length + 1));
+}
+
+// Puts the top level rules of `p` in the front buffer, then the kept ones
+// in the order they were activated
+void rebuildFront(reload_t *r, kdl_program_t *p) {
+    kdl_programBuffer_t *front = &r->m->pbuf[r->m->front];
+    front->length = 0;
+    appendProgram(r->m, p, front);
+    if (r->keptLen > 1) {
+        qsort(r->kept, r->keptLen, sizeof(keptRule_t), compareKept);
+    }
+    for (size_t i = 0; i < r->keptLen; i++) {
+        appendRules(r->m, r->kept[i].rule, 1, front);
+    }
+}
+
+// -- end reloading
+
 kdl_error_t kdl_machine_load(kdl_machine_t *m, const char *input) {
+    return kdl_machine_loadN(m, input, strlen(input));
+}
+
+kdl_error_t kdl_machine_loadN(kdl_machine_t *m, const char *input, size_t length) {
     kdl_program_t p;
-    kdl_error_t e = kdl_parse(m->s, input, &p);
+    kdl_error_t e = kdl_parseParallel(m->s, input, length, m->threads, m->lazy, &p);
     if (e.code != KDL_ERR_OK) {
         return e;
     }
-    m->start = p;
+    clearSlots(m);
+    prepareProgram(m, &p, true);
+    replaceStart(m, p);
+    rewindToStart(m);
+    return e;
+}
+
+kdl_error_t kdl_machine_reload(kdl_machine_t *m, const char *input) {
+    return kdl_machine_reloadN(m, input, strlen(input));
+}
+
+kdl_error_t kdl_machine_reloadN(kdl_machine_t *m, const char *input, size_t length) {
+    kdl_program_t p;
+    kdl_error_t e = kdl_parseParallel(m->s, input, length, m->threads, m->lazy, &p);
+    if (e.code != KDL_ERR_OK) {
+        return e;
+    }
+    reload_t r;
+    memset(&r, 0, sizeof(reload_t));
+    r.m = m;
+
+    indexFront(&r);
+    recordOldRules(&r, &m->start, 0, NULL);
+    // The old program's slots are not needed past here
+    clearSlots(m);
+    prepareProgram(m, &p, true);
+    keepNewRules(&r, &p, 0, NULL);
+    rebuildFront(&r, &p);
+    backwriteBuffer(m, &m->pbuf[m->front], &m->pbuf[m->back]);
+    replaceStart(m, p);
+
+    m->s.free(r.orders);
+    kdl_hashmap_free(&r.active);
+    m->s.free(r.oldRules);
+    m->s.free(r.kept);
+    m->s.free(r.ids);
+    m->s.free(r.siblings);
+    return e;
+}
+
+kdl_error_t kdl_machine_loadFile(kdl_machine_t *m, const char *path) {
+    kdl_source_close(&m->failedSource);
+    kdl_source_t src;
+    kdl_error_t e = kdl_source_openFile(m->s, path, &src);
+    if (e.code != KDL_ERR_OK) {
+        return e;
+    }
+    e = kdl_machine_loadN(m, src.data, src.length);
+    if (e.code != KDL_ERR_OK) {
+        m->failedSource = src;
+    } else {
+        kdl_source_close(&src);
+    }
+    return e;
+}
+
+kdl_error_t kdl_machine_loadBinary(kdl_machine_t *m, const char *path) {
+    kdl_binary_t b;
+    kdl_error_t e = kdl_binary_open(path, &b);
+    if (e.code != KDL_ERR_OK) {
+        return e;
+    }
+    clearSlots(m);
+    prepareProgram(m, &b.program, false);
+    replaceStart(m, b.program);
+    m->binary = b;
     rewindToStart(m);
     return e;
 }
@@ -620,12 +1399,12 @@ void kdl_machine_run(kdl_machine_t *m) {
             if (result.datatype != KDL_DT_INT) {
                 assert(false); // Error: conditional expression did not return int
             }
-            run = *((kdl_int_t*)result.data) == 0 ? false : true;
+            run = result.value.i == 0 ? false : true;
         } else {
             run = true;
         }
         if (run) {
-            doExecute(m, &r->execute);
+            doExecute(m, r);
         }
     }
 
@@ -642,6 +1421,16 @@ void kdl_machine_free(kdl_machine_t *machine) {
     machine->s.free(machine->pbuf[0].rules);
     machine->s.free(machine->pbuf[1].rules);
     kdl_hashmap_free(&machine->vars);
+    kdl_trie_free(&machine->varIndex);
     kdl_hashmap_free(&machine->verbs);
+    kdl_hashmap_free(&machine->bindings);
+    machine->s.free(machine->stack);
+    machine->s.free(machine->params);
+    machine->s.free(machine->rules);
+    machine->s.free(machine->links);
+    kdl_arena_free(&machine->paramStrings);
+    kdl_machine_setRegistry(machine, NULL);
+    kdl_source_close(&machine->failedSource);
+    kdl_binary_close(&machine->binary);
     memset(machine, 0, sizeof(kdl_machine_t));
 }
@@ -6,6 +6,11 @@
 #include "def.h"
 #include "parser.h"
 #include "hashmap.h"
+#include "trie.h"
+#include "registry.h"
+#include "source.h"
+#include "compile.h"
+#include "arena.h"
 
 // For assertions only, never used seriously
 #define KDL_DT_NIL 0
@@ -20,13 +25,27 @@
 
 struct _kdl_machine_t;
 
+// Numbers are held in place. Strings are not copied: they point into the
+// program or into a variable, and only last until the variable is set
+// again or the program is replaced.
 typedef struct {
     int datatype;
-    void *data;
+    union {
+        kdl_int_t i;
+        // Percentages too
+        kdl_float_t f;
+        const char *s;
+    } value;
 } kdl_data_t;
 
+// `params` belongs to the machine, and is only valid during the call
 typedef void(*kdl_function_t)(struct _kdl_machine_t *machine, const char *context, const char *name, kdl_data_t *params, size_t paramsLen);
 typedef void(*kdl_watcher_t)(struct _kdl_machine_t *machine, const char *name, kdl_data_t *data);
+typedef void(*kdl_varVisitor_t)(struct _kdl_machine_t *machine, const char *name, kdl_data_t *data, void *user);
+
+// Refers to one variable for as long as it exists, which saves looking
+// its name up on every access. Only kdl_machine_removeVars() invalidates it.
+typedef kdl_hashmap_handle_t kdl_varHandle_t;
 
 typedef struct {
     kdl_function_t func;
@@ -41,6 +60,15 @@ typedef struct {
     kdl_watcher_t watcher;
 } kdl_entry_t;
 
+// What a machine keeps for one rule of its program
+typedef struct {
+    // Copied to the program buffers, which only happens once
+    bool active;
+    // Where the machine keeps what the verb currently refers to. NULL if
+    // there is no verb.
+    void *binding;
+} kdl_ruleState_t;
+
 typedef struct {
     kdl_rule_t *rules;
     size_t length;
@@ -48,34 +76,131 @@ typedef struct {
 } kdl_programBuffer_t;
 
 typedef struct _kdl_machine_t {
-    kdl_program_t start; // Never changes
+    kdl_program_t start; // Only changes when (re)loading
     kdl_programBuffer_t pbuf[2];
     size_t front;
     size_t back;
 
     kdl_state_t s;
     kdl_hashmap_t vars;
+    // The same variables as `vars`, ordered by context
+    kdl_trie_t varIndex;
     kdl_hashmap_t verbs;
+    // Shared verbs, looked up after `verbs`. NULL if not set.
+    kdl_registry_t *registry;
+    kdl_registryReader_t *reader;
+    // What every verb name in the loaded programs is bound to, by name.
+    // Bindings are looked up again once `verbsVersion` or the registry's
+    // version moved since they were made.
+    kdl_hashmap_t bindings;
+    uint64_t verbsVersion;
+    // The state of the program's rules, and the variables its ops read, by
+    // slot (see kdl_op_t.slot). Programs are never written to once loaded,
+    // so that binaries run from where they are mapped. Every load numbers
+    // slots from 0 again.
+    kdl_ruleState_t *rules;
+    size_t nRules;
+    size_t rulesSize;
+    kdl_varHandle_t *links;
+    size_t nLinks;
+    size_t linksSize;
+    // Evaluation scratch space, big enough for the largest compute and the
+    // widest action of every program loaded so far
+    kdl_data_t *stack;
+    size_t stackSize;
+    kdl_data_t *params;
+    size_t paramsSize;
+    // Copies of the string parameters, for as long as the verb runs. The
+    // variables they come from may be set, and freed, by the verb.
+    kdl_arena_t paramStrings;
 
     kdl_verb_t defVerb;
+    // Set before loading to parse child programs only once they first run
+    // (see kdl_parseLazy()). A child that fails to parse then runs as an
+    // empty program, and its error goes in `lazyError`.
+    bool lazy;
+    // The last lazy child that failed to parse since the program was
+    // loaded, KDL_ERR_OK if none did. Points into the program.
+    kdl_error_t lazyError;
+    // Set before loading to parse big programs on this many threads (see
+    // kdl_parseParallel()). 0 or 1 parses on the calling thread.
+    size_t threads;
+    // The file of the last failed kdl_machine_loadFile(), which the error
+    // points into
+    kdl_source_t failedSource;
+    // Where `start` lives if it was loaded with kdl_machine_loadBinary()
+    kdl_binary_t binary;
 } kdl_machine_t;
 
 void kdl_machine_setInt(kdl_machine_t *m, const char *name, kdl_int_t value);
 void kdl_machine_setString(kdl_machine_t *m, const char *name, const char *value);
 void kdl_machine_setFloat(kdl_machine_t *m, const char *name, kdl_float_t value);
+// Same as calling setInt()/setFloat() for every `names[i]` and `values[i]`
+// in order, but the lookups are batched, which is faster when a host pushes
+// many values at once.
+void kdl_machine_setInts(kdl_machine_t *m, const char *const *names, const kdl_int_t *values, size_t n);
+void kdl_machine_setFloats(kdl_machine_t *m, const char *const *names, const kdl_float_t *values, size_t n);
 
 int kdl_machine_getInt(kdl_machine_t *m, const char *name, kdl_int_t *value);
 // The value is not allocated
 int kdl_machine_getString(kdl_machine_t *m, const char *name, const char **value);
 int kdl_machine_getFloat(kdl_machine_t *m, const char *name, kdl_float_t *value);
 
+// Like the getters, will create an integer of value zero if the variable
+// doesn't exist
+kdl_varHandle_t kdl_machine_getHandle(kdl_machine_t *m, const char *name);
+// Same as the by-name versions, but return KDL_ERR_REF if the variable
+// has been removed since
+int kdl_machine_setIntByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_int_t value);
+int kdl_machine_setStringByHandle(kdl_machine_t *m, kdl_varHandle_t handle, const char *value);
+int kdl_machine_setFloatByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_float_t value);
+int kdl_machine_getIntByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_int_t *value);
+// The value is not allocated
+int kdl_machine_getStringByHandle(kdl_machine_t *m, kdl_varHandle_t handle, const char **value);
+int kdl_machine_getFloatByHandle(kdl_machine_t *m, kdl_varHandle_t handle, kdl_float_t *value);
+
+// Every variable named `prefix`, or under the context `prefix` (so
+// "akatsuki" covers "akatsuki armor health" but not "akatsukiII speed").
+// The empty string covers every variable.
+// Visits in order of name, and takes time proportional to the number of
+// variables visited, not to the total.
+void kdl_machine_forEachVar(kdl_machine_t *m, const char *prefix, kdl_varVisitor_t visitor, void *user);
+size_t kdl_machine_countVars(kdl_machine_t *m, const char *prefix);
+// Deletes the variables, watchers included. Ops that read one of them look
+// it up again the next time they run.
+void kdl_machine_removeVars(kdl_machine_t *m, const char *prefix);
+
 // If it doesn't exist, will create an integer of value zero
 void kdl_machine_addWatcher(kdl_machine_t *m, const char *target, kdl_watcher_t callback);
 void kdl_machine_addVerb(kdl_machine_t *m, const char *target, kdl_verb_t v);
 void kdl_machine_addDefVerb(kdl_machine_t *m, kdl_verb_t v);
+// Makes the machine use the verbs of `r`, a registry of kdl_verb_t (see
+// kdl_mkVerbRegistry()), in addition to its own. Many machines can share
+// one registry, and it can be updated while they run on other threads.
+// NULL detaches the machine. The registry must outlive the machine.
+void kdl_machine_setRegistry(kdl_machine_t *m, kdl_registry_t *r);
+void kdl_mkVerbRegistry(kdl_registry_t *out);
 
 void kdl_mkMachine(kdl_machine_t *out);
+// Size the variable table up front for `nVars` variables, so that it does
+// not have to grow while running. Best called right after kdl_mkMachine.
+void kdl_machine_reserve(kdl_machine_t *m, size_t nVars);
 kdl_error_t kdl_machine_load(kdl_machine_t *machine, const char *program);
+// `program` need not be null terminated, and is not needed after this
+kdl_error_t kdl_machine_loadN(kdl_machine_t *machine, const char *program, size_t length);
+// Maps the file instead of reading it into memory. An error stays valid
+// until the next loadFile() or until the machine is freed.
+kdl_error_t kdl_machine_loadFile(kdl_machine_t *machine, const char *path);
+// Swaps in a new program between two runs, keeping the variables. Child
+// rules that were activated stay active if neither they nor any of their
+// parents changed, and run in the same order as before. Rules are matched
+// by what they are, not where they are, so rules can be added, removed
+// or moved around them. On error, the running program is left as is.
+kdl_error_t kdl_machine_reload(kdl_machine_t *machine, const char *program);
+kdl_error_t kdl_machine_reloadN(kdl_machine_t *machine, const char *program, size_t length);
+// A program compiled by kdl_compileFile(). It is run from the mapped file
+// as is, without parsing or copying it.
+kdl_error_t kdl_machine_loadBinary(kdl_machine_t *machine, const char *path);
 void kdl_machine_run(kdl_machine_t *machine);
 
 void kdl_machine_free(kdl_machine_t *machine);
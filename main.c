@@ -18,13 +18,13 @@ void cb_print(kdl_machine_t *m, const char *context, const char *name, kdl_data_
     for (size_t i = 0; i < length; i++) {
         switch(params[i].datatype) {
         case KDL_DT_INT:
-            printf(" %llu", *((kdl_int_t *) params[i].data));
+            printf(" %llu", params[i].value.i);
             break;
         case KDL_DT_FLT:
-            printf(" %Lf", *((kdl_float_t *) params[i].data));
+            printf(" %Lf", params[i].value.f);
             break;
         case KDL_DT_STR:
-            printf(" %s", (char *) params[i].data);
+            printf(" %s", params[i].value.s);
             break;
         }
     }
@@ -47,14 +47,14 @@ void cb_default(kdl_machine_t *m, const char *context, const char *name, kdl_dat
         kdl_data_t p = params[i];
         switch (p.datatype) {
         case KDL_DT_INT:
-            kdl_machine_setInt(m, buffer, *((kdl_int_t *)p.data));
-            // printf("Set %lu to %llu\n", i, *((kdl_int_t *)p.data));
+            kdl_machine_setInt(m, buffer, p.value.i);
+            // printf("Set %lu to %llu\n", i, p.value.i);
             break;
         case KDL_DT_STR:
-            kdl_machine_setString(m, buffer, (char *) p.data);
+            kdl_machine_setString(m, buffer, p.value.s);
             break;
         case KDL_DT_FLT:
-            kdl_machine_setFloat(m, buffer, *((kdl_float_t *)p.data));
+            kdl_machine_setFloat(m, buffer, p.value.f);
             break;
         }
     }
@@ -65,7 +65,7 @@ void cb_result(kdl_machine_t *m, const char *context, const char *name, kdl_data
     UNUSED(context);
     UNUSED(name);
     UNUSED(length);
-    printf("RESULT: %llu\n", *((kdl_int_t *)params[0].data));
+    printf("RESULT: %llu\n", params[0].value.i);
     printf("Terminating program ungracefully (this is not a bad thing)...\n");
     exit(1);
 }
@@ -75,8 +75,8 @@ void cb_write_int(kdl_machine_t *m, const char *context, const char *name, kdl_d
     UNUSED(context);
     UNUSED(name);
     UNUSED(length);
-    // printf("Writing '%llu' to '%s'\n", *((kdl_int_t *)params[1].data), (char *) params[0].data);
-    kdl_machine_setInt(m, (char *) params[0].data, *((kdl_int_t*)params[1].data));
+    // printf("Writing '%llu' to '%s'\n", params[1].value.i, params[0].value.s);
+    kdl_machine_setInt(m, params[0].value.s, params[1].value.i);
 }
 
 void cb_write_float(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
@@ -84,7 +84,7 @@ void cb_write_float(kdl_machine_t *m, const char *context, const char *name, kdl
     UNUSED(context);
     UNUSED(name);
     UNUSED(length);
-    kdl_machine_setFloat(m, (char *) params[0].data, *((kdl_float_t*)params[1].data));
+    kdl_machine_setFloat(m, params[0].value.s, params[1].value.f);
 }
 
 void cb_write_string(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
@@ -92,7 +92,7 @@ void cb_write_string(kdl_machine_t *m, const char *context, const char *name, kd
     UNUSED(context);
     UNUSED(name);
     UNUSED(length);
-    kdl_machine_setString(m, (char *) params[0].data, (char *) params[1].data);
+    kdl_machine_setString(m, params[0].value.s, params[1].value.s);
 }
 
 void cb_do(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
@@ -100,16 +100,17 @@ void cb_do(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *
     UNUSED(context);
     UNUSED(name);
     UNUSED(length);
-    printf("Doing: %s...\n", (char *) params[0].data);
+    printf("Doing: %s...\n", params[0].value.s);
 }
 
-void initializeMachine(kdl_machine_t *machine) {
+// Shared by every machine, see initializeMachine()
+void buildVerbs(kdl_registry_t *verbs) {
     kdl_verb_t verb;
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = false;
     verb.func = cb_print;
-    kdl_machine_addVerb(machine, "print", verb);
+    kdl_registry_set(verbs, "print", &verb);
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = true;
@@ -117,7 +118,7 @@ void initializeMachine(kdl_machine_t *machine) {
     verb.datatypesLen = 2;
     verb.datatypes[0] = KDL_DT_STR;
     verb.datatypes[1] = KDL_DT_INT;
-    kdl_machine_addVerb(machine, "writeInt", verb);
+    kdl_registry_set(verbs, "writeInt", &verb);
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = true;
@@ -125,7 +126,7 @@ void initializeMachine(kdl_machine_t *machine) {
     verb.datatypesLen = 2;
     verb.datatypes[0] = KDL_DT_STR;
     verb.datatypes[1] = KDL_DT_FLT;
-    kdl_machine_addVerb(machine, "writeFloat", verb);
+    kdl_registry_set(verbs, "writeFloat", &verb);
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = true;
@@ -134,22 +135,34 @@ void initializeMachine(kdl_machine_t *machine) {
     verb.datatypesLen = 2;
     verb.datatypes[0] = KDL_DT_STR;
     verb.datatypes[1] = KDL_DT_STR;
-    kdl_machine_addVerb(machine, "write", verb);
+    kdl_registry_set(verbs, "write", &verb);
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = true;
     verb.func = cb_do;
     verb.datatypesLen = 1;
     verb.datatypes[0] = KDL_DT_STR;
-    kdl_machine_addVerb(machine, "do", verb);
+    kdl_registry_set(verbs, "do", &verb);
 
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = true;
     verb.func = cb_result;
     verb.datatypesLen = 1;
     verb.datatypes[0] = KDL_DT_INT;
-    kdl_machine_addVerb(machine, "result", verb);
+    kdl_registry_set(verbs, "result", &verb);
+}
+
+void initializeMachine(kdl_machine_t *machine) {
+    static kdl_registry_t verbs;
+    static bool built = false;
+    if (!built) {
+        kdl_mkVerbRegistry(&verbs);
+        buildVerbs(&verbs);
+        built = true;
+    }
+    kdl_machine_setRegistry(machine, &verbs);
 
+    kdl_verb_t verb;
     memset(&verb, 0, sizeof(kdl_verb_t));
     verb.validate = false;
     verb.func = cb_default;
@@ -158,19 +171,17 @@ void initializeMachine(kdl_machine_t *machine) {
 
 void runDemo0() {
     printf("---- demo 0 ---\n");
-    FILE *testFile = fopen("./demo/fib.com", "r");
-    assert(testFile);
-    char buffer[2048];
-    size_t written = fread(buffer, sizeof(char), 2047, testFile);
-    buffer[written] = '\0';
+    kdl_machine_t machine;
+    kdl_mkMachine(&machine);
+    kdl_source_t source;
+    kdl_error_t error = kdl_source_openFile(machine.s, "./demo/fib.com", &source);
+    assert(error.code == KDL_ERR_OK);
 
     printf("Running program:\n-----------\n");
-    printf("%s", buffer);
+    printf("%.*s", (int) source.length, source.data);
     printf("\n-----------\n");
 
-    kdl_machine_t machine;
-    kdl_mkMachine(&machine);
-    kdl_error_t error = kdl_machine_load(&machine, buffer);
+    error = kdl_machine_loadN(&machine, source.data, source.length);
     if (error.code != KDL_ERR_OK) {
         printf("ERROR: %s\n", error.message);
         if (error.hasDataLen) {
@@ -180,6 +191,8 @@ void runDemo0() {
             printf("At: '%.*s\n'", (int) MIN(10, len), error.data);
         }
     }
+    // Errors point into the source
+    kdl_source_close(&source);
 
     initializeMachine(&machine);
     printf("---- Fibinochi sequence to 20 (21?) iterations ----\n");
@@ -191,19 +204,17 @@ void runDemo0() {
 
 void runDemo1() {
     printf("--- demo 1 ---\n");
-    FILE *testFile = fopen("./demo/rain.com", "r");
-    assert(testFile);
-    char buffer[2048];
-    size_t written = fread(buffer, sizeof(char), 2047, testFile);
-    buffer[written] = '\0';
+    kdl_machine_t machine;
+    kdl_mkMachine(&machine);
+    kdl_source_t source;
+    kdl_error_t error = kdl_source_openFile(machine.s, "./demo/rain.com", &source);
+    assert(error.code == KDL_ERR_OK);
 
     printf("Running program:\n-----------\n");
-    printf("%s", buffer);
+    printf("%.*s", (int) source.length, source.data);
     printf("\n-----------\n");
 
-    kdl_machine_t machine;
-    kdl_mkMachine(&machine);
-    kdl_error_t error = kdl_machine_load(&machine, buffer);
+    error = kdl_machine_loadN(&machine, source.data, source.length);
     if (error.code != KDL_ERR_OK) {
         printf("ERROR: %s\n", error.message);
         if (error.hasDataLen) {
@@ -213,6 +224,8 @@ void runDemo1() {
             printf("At: '%.*s\n'", (int) MIN(10, len), error.data);
         }
     }
+    // Errors point into the source
+    kdl_source_close(&source);
 
     initializeMachine(&machine);
 
@@ -269,19 +282,17 @@ void echoRun(kdl_machine_t *m) {
 
 void runDemo2() {
     printf("--- demo 2 ---\n");
-    FILE *testFile = fopen("./demo/order.com", "r");
-    assert(testFile);
-    char buffer[2048];
-    size_t written = fread(buffer, sizeof(char), 2047, testFile);
-    buffer[written] = '\0';
+    kdl_machine_t machine;
+    kdl_mkMachine(&machine);
+    kdl_source_t source;
+    kdl_error_t error = kdl_source_openFile(machine.s, "./demo/order.com", &source);
+    assert(error.code == KDL_ERR_OK);
 
     printf("Running program:\n-----------\n");
-    printf("%s", buffer);
+    printf("%.*s", (int) source.length, source.data);
     printf("\n-----------\n");
 
-    kdl_machine_t machine;
-    kdl_mkMachine(&machine);
-    kdl_error_t error = kdl_machine_load(&machine, buffer);
+    error = kdl_machine_loadN(&machine, source.data, source.length);
     if (error.code != KDL_ERR_OK) {
         printf("ERROR: %s\n", error.message);
         if (error.hasDataLen) {
@@ -291,6 +302,8 @@ void runDemo2() {
             printf("At: '%.*s\n'", (int) MIN(10, len), error.data);
         }
     }
+    // Errors point into the source
+    kdl_source_close(&source);
 
     initializeMachine(&machine);
 
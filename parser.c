@@ -1,4 +1,6 @@
 #include "parser.h"
+#include "scan.h"
+#include "hashmap.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +8,9 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define MAX_STRING_LEN 1028
 
@@ -16,9 +21,17 @@
 #define MAX_COMPUTE_PARAMS 512
 #define MAX_EXECUTE_PARAMS 512
 #define PROGRAM_BUFFER_SIZE 512
+// First chunk of each arena. Every getCompute() takes ~32KB of scratch.
+#define SCRATCH_CHUNK_SIZE (64 * 1024)
+#define PROGRAM_CHUNK_SIZE (4 * 1024)
 
 #define MAX_PREC 20
 
+// Inputs are only split for parsing on many threads into pieces of at
+// least this size, and into this many per thread
+#define MIN_CHUNK_SIZE (256 * 1024)
+#define CHUNKS_PER_THREAD 4
+
 #define ERROR_START kdl_error_t _err = noError();
 #define ERROR_IS goto noerror; error:
 #define ERROR_NONE noerror:
@@ -27,6 +40,8 @@
 #define NO_ERROR goto end;
 #define ERROR(a,b,c) _err = mkError(a,b,(c).value,(c).valueLen,true); goto error;
 #define NTERROR(a,b,c) _err = mkError(a,b,c,0,false); goto error;
+// The input need not be null terminated, so errors in it carry a length
+#define LERROR(a,b,c,d) _err = mkError(a,b,c,d,true); goto error;
 
 #define TEST(exp) if (isError(_err = (exp))) goto error;
 
@@ -54,39 +69,92 @@ typedef struct {
     int depth;
 } contextTracker_t;
 
-static kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *outOp, bool *outGlobal);
-static kdl_error_t getMark(kdl_state_t s, contextTracker_t context, int depth, kdl_tokenization_t *t, size_t *i, contextTracker_t *out, bool *got);
+// Nothing is freed one allocation at a time: whatever ends up in the
+// program goes to `program`, everything else to `scratch`. Scratch space
+// is given back (rewound) by the function that took it before returning,
+// and errors just drop both arenas.
+typedef struct {
+    kdl_state_t s;
+    kdl_arena_t scratch;
+    kdl_arena_t *program;
+    // The arena `program` ends up in, once parsing on many threads is done
+    kdl_arena_t *root;
+    // Child programs are skipped over, see kdl_parseLazy()
+    bool lazy;
+    // Ops taken out of computes by foldCompute()
+    size_t folded;
+    // Context strings are interned, see getContextString()
+    kdl_hashmap_t contexts;
+    char *lastContext;
+    size_t lastContextLen;
+} parser_t;
+
+// Top level rules parsed on their own, see kdl_parseParallel()
+typedef struct {
+    const char *input;
+    size_t length;
+    kdl_arena_t program;
+    kdl_program_t result;
+    kdl_error_t error;
+    size_t folded;
+} chunk_t;
+
+typedef struct {
+    kdl_state_t s;
+    bool lazy;
+    kdl_arena_t *root;
+    chunk_t *chunks;
+    size_t nChunks;
+    // The next chunk a thread can take
+    atomic_size_t next;
+} parseJob_t;
+
+static kdl_error_t getRawValue(parser_t *p, kdl_token_t token, void **outValue, int *outOp, bool *outGlobal);
+static kdl_error_t getMark(parser_t *p, contextTracker_t context, int depth, kdl_tokenization_t *t, size_t *i, contextTracker_t *out, bool *got);
 static kdl_error_t mkError(int code, const char *message, const char *pointer, size_t length, bool hasLength);
 static kdl_error_t noError();
 static bool isError(kdl_error_t error);
-static void getContextString(kdl_state_t s, contextTracker_t tracker, char **out);
+static void getContextString(parser_t *p, contextTracker_t tracker, char **out);
+static void noFree(kdl_state_t s, void *data);
+static void mkParser(parser_t *p, kdl_state_t s, bool lazy, kdl_arena_t *program, kdl_arena_t *root);
+static void freeParser(parser_t *p);
 static bool tokenEqChar22(kdl_token_t t, char a, char b, int type);
 static bool tokenEqCharNT(kdl_token_t t, char c);
 static bool tokenEqChar(kdl_token_t t, char c, int type);
-static void freeTokenization(kdl_state_t s, kdl_tokenization_t *t);
-static void freeOp(kdl_state_t s, kdl_op_t *o);
-static void freeCompute(kdl_state_t s, kdl_compute_t *c);
-static void freeAction(kdl_state_t s, kdl_action_t *a);
-static void freeExecute(kdl_state_t s, kdl_execute_t *e);
-static void freeRule(kdl_state_t s, kdl_rule_t *e);
 static kdl_error_t addToContext(kdl_token_t currentToken, contextTracker_t *tracker, const char *word, size_t wordLen);
-static void mkContext(kdl_state_t s, int depth, contextTracker_t *out);
-static void freeContext(kdl_state_t s, contextTracker_t *tracker);
-static kdl_error_t getContext(kdl_state_t s, kdl_token_t currentToken, int depth, contextTracker_t base, size_t levels, contextTracker_t *out);
+static void mkContext(parser_t *p, int depth, contextTracker_t *out);
+static kdl_error_t getContext(parser_t *p, kdl_token_t currentToken, int depth, contextTracker_t base, size_t levels, contextTracker_t *out);
 static bool isNumber(char c);
 static bool isCharOrUns(char c);
-static kdl_error_t getToken(const char *input, kdl_token_t *token, size_t *skip, bool *eof);
-static void createStringCopyNoWhitespace(kdl_state_t s, const char *input, size_t length, char **out);
-static void infixToPostfix(kdl_state_t s, element_t *input, size_t inputLen, int maxPrec, void ***out, size_t *outLength);
-static kdl_error_t tokenize(kdl_state_t s, const char *input, kdl_tokenization_t *out);
-static kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out, char terminate);
-static kdl_error_t getValue(kdl_state_t s, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out);
-static kdl_error_t getExecute(kdl_state_t s, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_execute_t *out);
-static kdl_error_t getRule(kdl_state_t s, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_rule_t *rule);
-static kdl_error_t getProgram(kdl_state_t s, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out, char terminate);
+static kdl_error_t getToken(const char *input, const char *end, kdl_token_t *token, size_t *skip, bool *eof);
+static void createStringCopyNoWhitespace(kdl_arena_t *a, const char *input, size_t length, char **out);
+static void infixToPostfix(kdl_arena_t *a, element_t *input, size_t inputLen, int maxPrec, void ***out, size_t *outLength);
+static bool isNumericLiteral(const kdl_op_t *op);
+static bool isIntLiteral(const kdl_op_t *op, kdl_int_t value);
+static kdl_float_t literalFloat(const kdl_op_t *op);
+static bool fitsInt(kdl_float_t value);
+static bool foldOp(parser_t *p, int op, const kdl_op_t *a, const kdl_op_t *b, kdl_op_t *out);
+static void dropOps(kdl_op_t **ops, size_t *length, size_t at, size_t n);
+static void foldCompute(parser_t *p, kdl_op_t **ops, size_t *length);
+static void reportFolded(size_t folded);
+static void tokenize(kdl_state_t s, const char *input, size_t length, kdl_tokenization_t *out);
+static bool hasToken(kdl_tokenization_t *t, size_t i);
+static kdl_token_t tokenAt(kdl_tokenization_t *t, size_t i);
+static void dropTokens(kdl_tokenization_t *t, size_t i);
+static void freeTokenization(kdl_tokenization_t *t);
+static kdl_error_t getCompute(parser_t *p, contextTracker_t parent, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out, char terminate);
+static kdl_error_t getValue(parser_t *p, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out);
+static kdl_error_t getExecute(parser_t *p, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_execute_t *out);
+static kdl_error_t getRule(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_rule_t *rule);
+static kdl_error_t getProgram(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out, char terminate);
+static kdl_error_t skipProgram(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out);
+static kdl_error_t parseTokens(parser_t *p, contextTracker_t context, const char *input, size_t length, kdl_program_t *out);
+static kdl_error_t parse(kdl_state_t s, const char *input, size_t length, bool lazy, kdl_program_t *out);
+static size_t splitRules(kdl_state_t s, const char *input, size_t length, size_t chunkSize, chunk_t **out);
+static void *parseChunks(void *job);
 
 // Parse value literal (consumes single token)
-kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *outOp, bool *outGlobal) {
+kdl_error_t getRawValue(parser_t *p, kdl_token_t token, void **outValue, int *outOp, bool *outGlobal) {
     ERROR_START
 
     assert(token.type != KDL_TK_CTRL);
@@ -95,7 +163,9 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
     void *value = NULL;
     char *string = NULL;
     bool global = false;
-    createStringCopyNoWhitespace(s, token.value, token.valueLen, (char **) &string);
+    // Numbers only need the string while they are being converted
+    bool keepString = token.type == KDL_TK_WORD || token.type == KDL_TK_STR;
+    createStringCopyNoWhitespace(keepString ? p->program : &p->scratch, token.value, token.valueLen, (char **) &string);
     switch(token.type) {
     case KDL_TK_WORD:
         // Variable, by process of elimination.
@@ -103,7 +173,7 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
         op = KDL_OP_PVAR;
         break;
     case KDL_TK_INT:
-        value = s.malloc(sizeof(kdl_int_t));
+        value = kdl_arena_alloc(p->program, sizeof(kdl_int_t));
         *((kdl_int_t *)value) = (kdl_int_t) strtoll(string, NULL, 10);
         if (errno == ERANGE) {
             ERROR(KDL_ERR_VAL, "Integer too large", token)
@@ -111,7 +181,7 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
         op = KDL_OP_PINT;
         break;
     case KDL_TK_FLOAT:
-        value = s.malloc(sizeof(kdl_float_t));
+        value = kdl_arena_alloc(p->program, sizeof(kdl_float_t));
         *((kdl_float_t *) value) = (kdl_float_t) strtold(string, NULL);
         if (errno == ERANGE) {
             ERROR(KDL_ERR_VAL, "Floating point number too large", token)
@@ -119,7 +189,7 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
         op = KDL_OP_PFLOAT;
         break;
     case KDL_TK_PERC:
-        value = s.malloc(sizeof(kdl_float_t));
+        value = kdl_arena_alloc(p->program, sizeof(kdl_float_t));
         // Docs say that strtold() doesn't care if there's junk at the end
         // of the input.
         // And I suppose that goes for our trailing %
@@ -141,7 +211,7 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
             // Skip the >, we already have the information we need
             doOffset = offset + 1;
         }
-        createStringCopyNoWhitespace(s, token.value + doOffset, token.valueLen - doOffset, (char **) &value);
+        createStringCopyNoWhitespace(p->program, token.value + doOffset, token.valueLen - doOffset, (char **) &value);
         op = KDL_OP_PVAR;
         break;
     }
@@ -155,8 +225,6 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
 
     if (value == NULL) {
         value = string;
-    } else {
-        s.free(string);
     }
 
     *outValue = value;
@@ -165,9 +233,6 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
 
     ERROR_IS
 
-    s.free(value);
-    s.free(string);
-
     ERROR_NONE
 
     ERROR_END
@@ -177,7 +242,7 @@ kdl_error_t getRawValue(kdl_state_t s, kdl_token_t token, void **outValue, int *
 // `got`: if the get was successful, and `i` was incremented
 // Format:
 // ^* <WORDS> :
-kdl_error_t getMark(kdl_state_t s, contextTracker_t context, int depth, kdl_tokenization_t *t, size_t *i, contextTracker_t *out, bool *got) {
+kdl_error_t getMark(parser_t *p, contextTracker_t context, int depth, kdl_tokenization_t *t, size_t *i, contextTracker_t *out, bool *got) {
     ERROR_START
 
     *got = false;
@@ -187,46 +252,42 @@ kdl_error_t getMark(kdl_state_t s, contextTracker_t context, int depth, kdl_toke
     memset(&nc, 0, sizeof(contextTracker_t));
 
     size_t jumpers = 0;
-    while (tokenEqChar(t->tokens[f], '^', KDL_TK_CTRL)) {
+    while (tokenEqChar(tokenAt(t, f), '^', KDL_TK_CTRL)) {
         jumpers++;
         f++;
-        if (f >= t->nTokens) {
-            ERROR(KDL_ERR_EOF, "Reached EOF while reading mark jumpers", t->tokens[f-1])
+        if (!hasToken(t, f)) {
+            ERROR(KDL_ERR_EOF, "Reached EOF while reading mark jumpers", tokenAt(t, f-1))
         }
     }
 
 
     if (jumpers == 0) {
-        mkContext(s, depth, &nc);
+        mkContext(p, depth, &nc);
     } else {
-        TEST(getContext(s, t->tokens[f], depth, context, jumpers - 1, &nc))
+        TEST(getContext(p, tokenAt(t, f), depth, context, jumpers - 1, &nc))
     }
 
-    while (t->tokens[f].type == KDL_TK_WORD) {
-        kdl_token_t token = t->tokens[f];
+    while (tokenAt(t, f).type == KDL_TK_WORD) {
+        kdl_token_t token = tokenAt(t, f);
         TEST(addToContext(token, &nc, token.value, token.valueLen))
         f++;
-        if (f >= t->nTokens) {
-            ERROR(KDL_ERR_EOF, "Reached EOF while reading mark", t->tokens[f-1])
+        if (!hasToken(t, f)) {
+            ERROR(KDL_ERR_EOF, "Reached EOF while reading mark", tokenAt(t, f-1))
         }
     }
 
-    if (tokenEqChar(t->tokens[f], ':', KDL_TK_CTRL)) {
+    if (tokenEqChar(tokenAt(t, f), ':', KDL_TK_CTRL)) {
         f++;
         *i = f;
         *out = nc;
         *got = true;
     } else if (jumpers > 0) {
-        ERROR(KDL_ERR_EXP, "Expected ':' at end of mark", t->tokens[f])
-    } else {
-        freeContext(s, &nc);
+        ERROR(KDL_ERR_EXP, "Expected ':' at end of mark", tokenAt(t, f))
     }
 
 
     ERROR_IS
 
-    freeContext(s, &nc);
-
     ERROR_NONE
 
     ERROR_END
@@ -251,71 +312,63 @@ bool isError(kdl_error_t error) {
 }
 
 // Get the null-terminated string representation of a context.
-void getContextString(kdl_state_t s, contextTracker_t tracker, char **out) {
-    *out = (char *) s.malloc(sizeof(char) * (tracker.contextLen + 1));
-    memcpy(*out, tracker.context, sizeof(char) * tracker.contextLen);
-    (*out)[tracker.contextLen] = '\0';
-}
-
-bool tokenEqChar22(kdl_token_t t, char a, char b, int type) {
-    return t.valueLen == 2 && t.value[0] == a && t.value[1] == b && t.type == type;
-}
-
-bool tokenEqCharNT(kdl_token_t t, char c) {
-    return t.valueLen == 1 && t.value[0] == c;
-}
-
-bool tokenEqChar(kdl_token_t t, char c, int type) {
-    return t.type == type && t.valueLen == 1 && t.value[0] == c;
-}
-
-void freeTokenization(kdl_state_t s, kdl_tokenization_t *t) {
-    // Tokens do not hold onto memory, just pointer offsets in the input string
-    s.free(t->tokens);
-    memset(t, 0, sizeof(kdl_tokenization_t));
+// Goes in the program.
+// Interned: the same context gives the same pointer for everything the
+// parser puts in the program. Rules mostly repeat the context of the one
+// before, so that is tried first.
+void getContextString(parser_t *p, contextTracker_t tracker, char **out) {
+    if (p->lastContext != NULL && p->lastContextLen == tracker.contextLen
+            && memcmp(p->lastContext, tracker.context, tracker.contextLen) == 0) {
+        *out = p->lastContext;
+        return;
+    }
+    kdl_hashmap_hash_t hash = kdl_hashmap_hashKey(&p->contexts, tracker.context, tracker.contextLen);
+    kdl_hashmap_result_t r;
+    kdl_hashmap_searchHashed(&p->contexts, tracker.context, tracker.contextLen, hash, &r);
+    if (r.code == KDL_HASHMAP_EOK) {
+        kdl_hashmap_get(&p->contexts, r, (void **) out);
+    } else {
+        *out = kdl_arena_strndup(p->program, tracker.context, tracker.contextLen);
+        kdl_hashmap_insertHashed(&p->contexts, tracker.context, tracker.contextLen, hash, (void *) *out);
+    }
+    p->lastContext = *out;
+    p->lastContextLen = tracker.contextLen;
 }
 
-void freeOp(kdl_state_t s, kdl_op_t *o) {
-    s.free(o->context);
-    s.free(o->value);
-    memset(o, 0, sizeof(kdl_op_t));
+// The interned strings belong to the program
+void noFree(kdl_state_t s, void *data) {
+    (void) s;
+    (void) data;
 }
 
-void freeCompute(kdl_state_t s, kdl_compute_t *c) {
-    for (size_t i = 0; i < c->length; i++) {
-        freeOp(s, &c->opers[i]);
-    }
-    memset(c, 0, sizeof(kdl_compute_t));
+void mkParser(parser_t *p, kdl_state_t s, bool lazy, kdl_arena_t *program, kdl_arena_t *root) {
+    p->s = s;
+    p->lazy = lazy;
+    p->folded = 0;
+    p->program = program;
+    p->root = root;
+    kdl_arena_init(s, &p->scratch, SCRATCH_CHUNK_SIZE);
+    kdl_hashmap_init(s, &p->contexts, 4, noFree, NULL);
+    p->lastContext = NULL;
+    p->lastContextLen = 0;
 }
 
-void freeProgram(kdl_state_t s, kdl_program_t *p) {
-    for (size_t i = 0; i < p->length; i++) {
-        freeRule(s, &p->rules[i]);
-    }
-    s.free(p->rules);
-    memset(p, 0, sizeof(kdl_program_t));
+// Not `program`, which is the caller's
+void freeParser(parser_t *p) {
+    kdl_arena_free(&p->scratch);
+    kdl_hashmap_free(&p->contexts);
 }
 
-void freeAction(kdl_state_t s, kdl_action_t *a) {
-    s.free(a->context);
-    s.free(a->verb);
-    for (size_t i = 0; i < a->nParams; i++) {
-        freeCompute(s, &a->params[i]);
-    }
-    s.free(a->params);
-    memset(a, 0, sizeof(kdl_action_t));
+bool tokenEqChar22(kdl_token_t t, char a, char b, int type) {
+    return t.valueLen == 2 && t.value[0] == a && t.value[1] == b && t.type == type;
 }
 
-void freeExecute(kdl_state_t s, kdl_execute_t *e) {
-    freeProgram(s, &e->child);
-    freeAction(s, &e->order);
-    memset(e, 0, sizeof(kdl_execute_t));
+bool tokenEqCharNT(kdl_token_t t, char c) {
+    return t.valueLen == 1 && t.value[0] == c;
 }
 
-void freeRule(kdl_state_t s, kdl_rule_t *e) {
-    freeExecute(s, &e->execute);
-    freeCompute(s, &e->compute);
-    memset(e, 0, sizeof(kdl_rule_t));
+bool tokenEqChar(kdl_token_t t, char c, int type) {
+    return t.type == type && t.valueLen == 1 && t.value[0] == c;
 }
 
 // Add a single word to the context of a given length.
@@ -343,40 +396,36 @@ kdl_error_t addToContext(kdl_token_t currentToken, contextTracker_t *tracker, co
     ERROR_END
 }
 
-// Make a fresh context
-void mkContext(kdl_state_t s, int depth, contextTracker_t *out) {
-    out->context = (char *) s.malloc(sizeof(char) * CONTEXT_BUFFER_SIZE);
-    out->indices = (size_t *) s.malloc(sizeof(size_t) * CONTEXT_BUFFER_SIZE);
+// Make a fresh context, in scratch space
+void mkContext(parser_t *p, int depth, contextTracker_t *out) {
+    out->context = (char *) kdl_arena_alloc(&p->scratch, sizeof(char) * CONTEXT_BUFFER_SIZE);
+    out->indices = (size_t *) kdl_arena_alloc(&p->scratch, sizeof(size_t) * CONTEXT_BUFFER_SIZE);
     out->contextLen = 0;
     out->indicesLen = 0;
     out->depth = depth;
 }
 
-void freeContext(kdl_state_t s, contextTracker_t *out) {
-    s.free(out->context);
-    s.free(out->indices);
-    memset(out, 0, sizeof(contextTracker_t));
-}
-
 // Initialize context based off of a given context.
 // The OUT parameter must be blank (we allocate fresh memory here)
 // Levels is the number of words (scopes, whatever) that should be discarded.
 // Note that surpassing the number of words with `levels` will result in a
 // fresh, blank context being returned
-kdl_error_t getContext(kdl_state_t s, kdl_token_t currentToken, int depth, contextTracker_t base, size_t levels, contextTracker_t *out) {
+kdl_error_t getContext(parser_t *p, kdl_token_t currentToken, int depth, contextTracker_t base, size_t levels, contextTracker_t *out) {
     ERROR_START
 
     contextTracker_t result;
-    mkContext(s, depth, &result);
-    if (levels < base.indicesLen) {
-        TEST(addToContext(currentToken, &result, base.context, levels > 0 ? base.indices[base.indicesLen - levels] : base.contextLen))
+    mkContext(p, depth, &result);
+    // Word by word, so that marks further down can jump out of these too
+    size_t keep = levels < base.indicesLen ? base.indicesLen - levels : 0;
+    for (size_t w = 0; w < keep; w++) {
+        size_t start = base.indices[w];
+        size_t end = w + 1 < base.indicesLen ? base.indices[w + 1] - 1 : base.contextLen;
+        TEST(addToContext(currentToken, &result, base.context + start, end - start))
     }
     *out = result;
 
     ERROR_IS
 
-    freeContext(s, &result);
-
     ERROR_NONE
 
     ERROR_END
@@ -393,27 +442,40 @@ bool isCharOrUns(char c) {
 }
 
 // `eof` is set to true if we reached EOF.
-// `input` must be null-terminated.
-kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eof) {
+// Reads no further than `end`. A null character counts as the end too.
+kdl_error_t getToken(const char *input, const char *end, kdl_token_t *out, size_t *skip, bool *eof) {
     ERROR_START
 
+    const size_t n = (size_t) (end - input);
+    // Never reads past the end
+    #define AT(k) ((k) < n ? input[k] : '\0')
+
+    // What is left from `k` on
+    #define REST(k) ((k) < n ? n - (k) : 0)
+
     size_t i = 0;
     size_t l = 0;
     size_t s = 0;
     int t = KDL_TK_CTRL;
-    for (; input[i] && (isspace(input[i]) || input[i] == '#'); i++) {
+    for (;;) {
+        i += kdl_scan_space(input + i, REST(i));
+        if (AT(i) != '#') {
+            break;
+        }
         // Skip comments
-        if (input[i] == '#') {
-            for (; input[i] && input[i] != '\n' && input[i] != '\r'; i++);
-            if (input[i] == '\r' && input[i+1] == '\n') {
-                i++;
-            }
+        i += kdl_scan_line(input + i, REST(i));
+        if (AT(i) == '\r' && AT(i+1) == '\n') {
+            i++;
         }
+        if (i >= n) {
+            break;
+        }
+        i++;
     }
-    char c = input[i];
+    char c = AT(i);
     char seek = '\0';
     if (c) {
-        seek = input[i+1];
+        seek = AT(i+1);
     } else {
         *eof = true;
         NO_ERROR
@@ -448,16 +510,16 @@ kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eo
     case '(':
     case ')':
     case '?':
+    case '^':
         l = 1;
         break;
     case '[':
         t = KDL_TK_STR;
         i++;
         // TODO: Die on invalid characters
-        for (; input[i+l] != ']'; l++) {
-            if (!input[i+l]) {
-                NTERROR(KDL_ERR_UNX, "Expected something other than EOF while reading string literal", input)
-            }
+        l = kdl_scan_char(input + i, REST(i), ']');
+        if (AT(i+l) != ']') {
+            LERROR(KDL_ERR_UNX, "Expected something other than EOF while reading string literal", input + i - 1, n - i + 1)
         }
         s = 1;
         break;
@@ -465,10 +527,9 @@ kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eo
         t = KDL_TK_VAR;
         i++;
         // TODO: Die on invalid characters
-        for (; input[i+l] != '}'; l++) {
-            if (!input[i+l]) {
-                NTERROR(KDL_ERR_UNX, "Expected something other than EOF while reading variable", input)
-            }
+        l = kdl_scan_char(input + i, REST(i), '}');
+        if (AT(i+l) != '}') {
+            LERROR(KDL_ERR_UNX, "Expected something other than EOF while reading variable", input + i - 1, n - i + 1)
         }
         s = 1;
         break;
@@ -477,22 +538,21 @@ kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eo
         // And it shouldn't!
         if (isNumber(c)) {
             t = KDL_TK_INT;
-            for (; isNumber(input[i+l]); l++);
-            if (input[i+l] == '.') {
+            l = kdl_scan_digits(input + i, REST(i));
+            if (AT(i+l) == '.') {
                 t = KDL_TK_FLOAT;
                 l++;
-                for (; isNumber(input[i+l]); l++);
+                l += kdl_scan_digits(input + i + l, REST(i+l));
             }
-            if (input[i+l] == '%') {
+            if (AT(i+l) == '%') {
                 t = KDL_TK_PERC;
                 l++;
             }
-        } else if (isCharOrUns(input[i+l])) {
+        } else if (isCharOrUns(AT(i+l))) {
             t = KDL_TK_WORD;
-            for (; isCharOrUns(input[i+l]) || isNumber(input[i+l]); l++);
+            l = kdl_scan_word(input + i, REST(i));
         } else {
-            printf("\n%i\n", (int) c);
-            NTERROR(KDL_ERR_UNX, "Unrecognized character", input)
+            LERROR(KDL_ERR_UNX, "Unrecognized character", input + i, 1)
         }
     }
     // LOOK AT THIS
@@ -502,6 +562,9 @@ kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eo
     out->type = t;
     *skip = s;
 
+    #undef AT
+    #undef REST
+
     ERROR_IS
 
     ERROR_NONE
@@ -509,13 +572,14 @@ kdl_error_t getToken(const char *input, kdl_token_t *out, size_t *skip, bool *eo
     ERROR_END
 }
 
-// Create a null-terminated string from a non-null terminated string and length
-void createStringCopyNoWhitespace(kdl_state_t s, const char *input, size_t length, char **out) {
-    char *result = (char *) s.malloc(sizeof(char) * (length + 1));
+// Create a null-terminated string from a non-null terminated string and length.
+// The result is never longer than the input, so it is squeezed in place.
+void createStringCopyNoWhitespace(kdl_arena_t *a, const char *input, size_t length, char **out) {
+    char *result = kdl_arena_strndup(a, input, length);
     size_t resultLen = 0;
     for (size_t i = 0; i < length; i++) {
-        if (!isspace(input[i])) {
-            result[resultLen++] = input[i];
+        if (!isspace(result[i])) {
+            result[resultLen++] = result[i];
         } else if (resultLen > 0 && !isspace(result[resultLen - 1])) {
             // Admitidly this also means we admit funny characters.
             // This also means that we admit funny characters.
@@ -523,7 +587,6 @@ void createStringCopyNoWhitespace(kdl_state_t s, const char *input, size_t lengt
         }
     }
     result[resultLen++] = '\0';
-    result = (char *) s.realloc(result, sizeof(char) * resultLen);
 
     *out = result;
 }
@@ -533,7 +596,7 @@ void createStringCopyNoWhitespace(kdl_state_t s, const char *input, size_t lengt
 // a cumulitive max precidence of maxPrec (MUST be correct!!!) from infix
 // notation to postifx notation.
 // !! Zero length input OK!!
-void infixToPostfix(kdl_state_t s, element_t *input, size_t inputLen, int maxPrec, void ***out, size_t *outLength) {
+void infixToPostfix(kdl_arena_t *a, element_t *input, size_t inputLen, int maxPrec, void ***out, size_t *outLength) {
     if (inputLen == 0) {
         *out = NULL;
         *outLength = 0;
@@ -548,8 +611,8 @@ void infixToPostfix(kdl_state_t s, element_t *input, size_t inputLen, int maxPre
     // Prevents precidence collisions
     const int precStride = maxPrec + 1;
 
-    level_t *levels = (level_t *) s.malloc(sizeof(element_t) * inputLen);
-    void  **stack = (void **) s.malloc(sizeof(void *) * inputLen);
+    level_t *levels = (level_t *) kdl_arena_alloc(a, sizeof(level_t) * inputLen);
+    void  **stack = (void **) kdl_arena_alloc(a, sizeof(void *) * inputLen);
     size_t levelsLen = 0;
     size_t stackLen = 0;
 
@@ -590,64 +653,326 @@ void infixToPostfix(kdl_state_t s, element_t *input, size_t inputLen, int maxPre
         stack[stackLen++] = levels[--levelsLen].data;
     }
 
-    s.free(levels);
-
-    stack = s.realloc(stack, sizeof(void *) * stackLen);
-
     *out = stack;
     *outLength = stackLen;
 }
 
-// Perform the tokenization of the string
-kdl_error_t tokenize(kdl_state_t s, const char *input, kdl_tokenization_t *out) {
-    ERROR_START
+bool isNumericLiteral(const kdl_op_t *op) {
+    return op->op == KDL_OP_PINT || op->op == KDL_OP_PFLOAT;
+}
 
-    size_t size = TOKEN_BUFFER_SIZE;
-    kdl_tokenization_t result;
-    result.nTokens = 0;
-    result.tokens = (kdl_token_t *) s.malloc(sizeof(kdl_token_t) * size);
-    kdl_token_t token;
-    const char *offset = input;
-    bool eof = false;
-    while (true) {
-        size_t skip = 0;
-        TEST(getToken(offset, &token, &skip, &eof))
-        if (eof) {
+bool isIntLiteral(const kdl_op_t *op, kdl_int_t value) {
+    return op->op == KDL_OP_PINT && *((kdl_int_t *) op->value) == value;
+}
+
+kdl_float_t literalFloat(const kdl_op_t *op) {
+    if (op->op == KDL_OP_PFLOAT) {
+        return *((kdl_float_t *) op->value);
+    }
+    return (kdl_float_t) *((kdl_int_t *) op->value);
+}
+
+// The machine's logic operators cast floats to int
+bool fitsInt(kdl_float_t value) {
+    return value >= INT_MIN && value <= INT_MAX;
+}
+
+// `op` on literals, the way the machine would do it: ints stay ints, and
+// anything with a float in it is done on floats. False if the result is
+// left to the machine (division by zero, overflow). `b` is NULL for '!'.
+bool foldOp(parser_t *p, int op, const kdl_op_t *a, const kdl_op_t *b, kdl_op_t *out) {
+    bool isFloat = false;
+    kdl_int_t r = 0;
+    kdl_float_t rf = 0;
+    if (a->op == KDL_OP_PFLOAT || (b != NULL && b->op == KDL_OP_PFLOAT)) {
+        kdl_float_t x = literalFloat(a);
+        kdl_float_t y = b != NULL ? literalFloat(b) : 0;
+        switch(op) {
+        case KDL_OP_ADD: rf = x + y; isFloat = true; break;
+        case KDL_OP_SUB: rf = x - y; isFloat = true; break;
+        case KDL_OP_MUL: rf = x * y; isFloat = true; break;
+        case KDL_OP_DIV: rf = x / y; isFloat = true; break;
+        case KDL_OP_EQU: r = x == y; break;
+        case KDL_OP_LEQ: r = x <= y; break;
+        case KDL_OP_GEQ: r = x >= y; break;
+        case KDL_OP_LTH: r = x < y; break;
+        case KDL_OP_GTH: r = x > y; break;
+        case KDL_OP_AND:
+        case KDL_OP_OR:
+            if (!fitsInt(x) || !fitsInt(y)) {
+                return false;
+            }
+            r = op == KDL_OP_AND ? ((int) x && (int) y) : ((int) x || (int) y);
+            break;
+        case KDL_OP_NOT:
+            if (!fitsInt(x)) {
+                return false;
+            }
+            r = !((int) x);
             break;
+        default:
+            return false;
         }
-        if (result.nTokens + 1 > size) {
-            size += TOKEN_BUFFER_SIZE;
-            result.tokens = (kdl_token_t *) s.realloc(result.tokens, sizeof(kdl_token_t) * size);
+    } else {
+        kdl_int_t x = *((kdl_int_t *) a->value);
+        kdl_int_t y = b != NULL ? *((kdl_int_t *) b->value) : 0;
+        switch(op) {
+        case KDL_OP_ADD:
+            if (__builtin_add_overflow(x, y, &r)) {
+                return false;
+            }
+            break;
+        case KDL_OP_SUB:
+            if (__builtin_sub_overflow(x, y, &r)) {
+                return false;
+            }
+            break;
+        case KDL_OP_MUL:
+            if (__builtin_mul_overflow(x, y, &r)) {
+                return false;
+            }
+            break;
+        case KDL_OP_DIV:
+            if (y == 0 || (x == LLONG_MIN && y == -1)) {
+                return false;
+            }
+            r = x / y;
+            break;
+        case KDL_OP_EQU: r = x == y; break;
+        case KDL_OP_LEQ: r = x <= y; break;
+        case KDL_OP_GEQ: r = x >= y; break;
+        case KDL_OP_LTH: r = x < y; break;
+        case KDL_OP_GTH: r = x > y; break;
+        case KDL_OP_AND: r = x && y; break;
+        case KDL_OP_OR: r = x || y; break;
+        case KDL_OP_NOT: r = !x; break;
+        default:
+            return false;
         }
-        result.tokens[result.nTokens++] = token;
-        offset = token.value + token.valueLen + skip;
     }
 
-    result.tokens = (kdl_token_t *) s.realloc(result.tokens, sizeof(kdl_token_t) * result.nTokens);
+    out->context = NULL;
+    out->slot = 0;
+    if (isFloat) {
+        out->op = KDL_OP_PFLOAT;
+        out->value = kdl_arena_alloc(p->program, sizeof(kdl_float_t));
+        *((kdl_float_t *) out->value) = rf;
+    } else {
+        out->op = KDL_OP_PINT;
+        out->value = kdl_arena_alloc(p->program, sizeof(kdl_int_t));
+        *((kdl_int_t *) out->value) = r;
+    }
+    return true;
+}
 
-    *out = result;
+// Take `n` ops out at `at`
+void dropOps(kdl_op_t **ops, size_t *length, size_t at, size_t n) {
+    memmove(ops + at, ops + at + n, sizeof(kdl_op_t *) * (*length - at - n));
+    *length -= n;
+}
 
-    ERROR_IS
+// Simplifies a postfix compute in place, so that rules don't redo the
+// same work every tick:
+//     operators on number literals are done here ("(2 * 60) + 5" -> 125)
+//     "+ 0", "- 0", "* 1" and "/ 1" go, on either side where that holds,
+//     but only next to another operator: a variable may hold a string,
+//     which the machine has to fail on
+//     "!!" goes where only the truth of the value matters (operands of ',',
+//     ';' and '!')
+// Operators on anything else (variables, strings, percentages) are left
+// for the machine to run, or to complain about.
+void foldCompute(parser_t *p, kdl_op_t **ops, size_t *length) {
+    // Where an operand on the stack starts in `ops`, and how many ops it
+    // takes up
+    typedef struct {
+        size_t start;
+        size_t length;
+    } operand_t;
+
+    size_t inLength = *length;
+    operand_t *operands = (operand_t *) kdl_arena_alloc(&p->scratch, sizeof(operand_t) * (inLength + 1));
+    size_t nOperands = 0;
+    // Ops kept so far. Never past `i`, so `ops` can be written as it is read.
+    size_t out = 0;
+
+    for (size_t i = 0; i < inLength; i++) {
+        kdl_op_t *op = ops[i];
+        size_t arity = 2;
+        switch(op->op) {
+        case KDL_OP_PINT:
+        case KDL_OP_PFLOAT:
+        case KDL_OP_PSTR:
+        case KDL_OP_PVAR:
+        case KDL_OP_PPERC:
+            arity = 0;
+            break;
+        case KDL_OP_NOT:
+            arity = 1;
+            break;
+        }
+        if (nOperands < arity) {
+            // Not a whole expression. The machine can tell what is wrong.
+            memmove(ops + out, ops + i, sizeof(kdl_op_t *) * (inLength - i));
+            out += inLength - i;
+            break;
+        }
+        ops[out++] = op;
+        if (arity == 0) {
+            operands[nOperands].start = out - 1;
+            operands[nOperands].length = 1;
+            nOperands++;
+            continue;
+        }
 
-    s.free(result.tokens);
+        operand_t *a = &operands[nOperands - arity];
+        operand_t *b = &operands[nOperands - 1];
+        nOperands -= arity;
+
+        if (op->op == KDL_OP_AND || op->op == KDL_OP_OR || op->op == KDL_OP_NOT) {
+            for (size_t k = 0; k < arity; k++) {
+                operand_t *o = k == 0 ? a : b;
+                while (o->length > 2 && ops[o->start + o->length - 1]->op == KDL_OP_NOT && ops[o->start + o->length - 2]->op == KDL_OP_NOT) {
+                    dropOps(ops, &out, o->start + o->length - 2, 2);
+                    o->length -= 2;
+                    if (o == a && arity == 2) {
+                        b->start -= 2;
+                    }
+                }
+            }
+        }
 
-    ERROR_NONE
+        operand_t result;
+        result.start = a->start;
+        result.length = out - a->start;
+
+        kdl_op_t folded;
+        if (isNumericLiteral(ops[a->start]) && a->length == 1 && (arity == 1 || (isNumericLiteral(ops[b->start]) && b->length == 1))
+                && foldOp(p, op->op, ops[a->start], arity == 2 ? ops[b->start] : NULL, &folded)) {
+            kdl_op_t *f = (kdl_op_t *) kdl_arena_alloc(&p->scratch, sizeof(kdl_op_t));
+            *f = folded;
+            ops[a->start] = f;
+            out = a->start + 1;
+            result.length = 1;
+        } else if (arity == 2) {
+            bool add = op->op == KDL_OP_ADD;
+            bool sub = op->op == KDL_OP_SUB;
+            bool mul = op->op == KDL_OP_MUL;
+            bool div = op->op == KDL_OP_DIV;
+            // Only an operator is sure to leave a number. A variable can
+            // hold anything, and a literal on the other side is not
+            // numeric (or it would have been folded).
+            kdl_op_t *aLast = ops[a->start + a->length - 1];
+            kdl_op_t *bLast = ops[b->start + b->length - 1];
+            bool aIsNumber = a->length > 1 && aLast->op >= KDL_OP_ADD && aLast->op <= KDL_OP_NOT;
+            bool bIsNumber = b->length > 1 && bLast->op >= KDL_OP_ADD && bLast->op <= KDL_OP_NOT;
+            if (aIsNumber && b->length == 1 && (((add || sub) && isIntLiteral(ops[b->start], 0)) || ((mul || div) && isIntLiteral(ops[b->start], 1)))) {
+                out = b->start;
+                result.length = a->length;
+            } else if (bIsNumber && a->length == 1 && ((add && isIntLiteral(ops[a->start], 0)) || (mul && isIntLiteral(ops[a->start], 1)))) {
+                out--;
+                dropOps(ops, &out, a->start, 1);
+                result.length = b->length;
+            }
+        }
+        operands[nOperands++] = result;
+    }
 
-    ERROR_END
+    p->folded += inLength - out;
+    *length = out;
+}
+
+// Only built with KDL_DEBUG_FOLD
+void reportFolded(size_t folded) {
+#ifdef KDL_DEBUG_FOLD
+    fprintf(stderr, "kdl: folding took out %zu ops\n", folded);
+#else
+    (void) folded;
+#endif
+}
+
+// Get ready to read tokens from `input`. Nothing is read yet.
+void tokenize(kdl_state_t s, const char *input, size_t length, kdl_tokenization_t *out) {
+    memset(out, 0, sizeof(kdl_tokenization_t));
+    out->s = s;
+    out->size = TOKEN_BUFFER_SIZE;
+    out->tokens = (kdl_token_t *) s.malloc(sizeof(kdl_token_t) * out->size);
+    out->offset = input;
+    out->end = input + length;
+    out->error = noError();
+}
+
+// Reads tokens until token `i` is there. False if the input runs out
+// first, or is not valid (which sets `error`).
+bool hasToken(kdl_tokenization_t *t, size_t i) {
+    assert(i >= t->base); // Error: token was dropped
+    while (i >= t->base + t->nTokens) {
+        if (t->eof) {
+            return false;
+        }
+        kdl_token_t token;
+        size_t skip = 0;
+        kdl_error_t e = getToken(t->offset, t->end, &token, &skip, &t->eof);
+        if (isError(e)) {
+            t->error = e;
+            t->eof = true;
+            return false;
+        }
+        if (t->eof) {
+            return false;
+        }
+        if (t->nTokens + 1 > t->size) {
+            t->size *= 2;
+            t->tokens = (kdl_token_t *) t->s.realloc(t->tokens, sizeof(kdl_token_t) * t->size);
+        }
+        t->tokens[t->nTokens++] = token;
+        t->offset = token.value + token.valueLen + skip;
+    }
+    return true;
+}
+
+// Past the end of the input, this is an empty control token that matches
+// nothing
+kdl_token_t tokenAt(kdl_tokenization_t *t, size_t i) {
+    if (!hasToken(t, i)) {
+        kdl_token_t eof;
+        eof.type = KDL_TK_CTRL;
+        eof.value = t->offset;
+        eof.valueLen = 0;
+        return eof;
+    }
+    return t->tokens[i - t->base];
 }
 
-kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out, char terminate) {
+// Forget every token before `i`
+void dropTokens(kdl_tokenization_t *t, size_t i) {
+    assert(i >= t->base);
+    size_t n = i - t->base;
+    if (n > t->nTokens) {
+        n = t->nTokens;
+    }
+    memmove(t->tokens, t->tokens + n, sizeof(kdl_token_t) * (t->nTokens - n));
+    t->nTokens -= n;
+    t->base += n;
+}
+
+void freeTokenization(kdl_tokenization_t *t) {
+    // Tokens do not hold onto memory, just pointer offsets in the input string
+    t->s.free(t->tokens);
+    memset(t, 0, sizeof(kdl_tokenization_t));
+}
+
+kdl_error_t getCompute(parser_t *p, contextTracker_t parent, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out, char terminate) {
     ERROR_START
 
-    contextTracker_t *contexts = (contextTracker_t *) s.malloc(sizeof(contextTracker_t) * MAX_CONTEXT_DEPTH);
-    element_t *elements = (element_t *) s.malloc(sizeof(element_t) * KDL_MAX_EXP_SIZE);
+    kdl_arenaMark_t mark = kdl_arena_mark(&p->scratch);
+    contextTracker_t *contexts = (contextTracker_t *) kdl_arena_alloc(&p->scratch, sizeof(contextTracker_t) * MAX_CONTEXT_DEPTH);
+    element_t *elements = (element_t *) kdl_arena_alloc(&p->scratch, sizeof(element_t) * KDL_MAX_EXP_SIZE);
     kdl_op_t **stack = NULL;
     size_t contextsLen = 0;
     size_t elementsLen = 0;
     size_t stackLen = 0;
 
-    // `parent` is never free'd, it is only here to provide for lookbehinds;
-    // We are not allowed to free `parent`
+    // `parent` is only here to provide for lookbehinds
     contexts[contextsLen++] = parent;
 
     // Loop variables
@@ -655,12 +980,15 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
     int depth = parent.depth;
     bool loop = true;
 
-    for (; loop && *i < t->nTokens; (*i)++) {
-        kdl_token_t token = t->tokens[*i];
+    for (; loop && hasToken(t, *i); (*i)++) {
+        kdl_token_t token = tokenAt(t, *i);
         if (elementsLen >= KDL_MAX_EXP_SIZE) {
             ERROR(KDL_ERR_BUF, "Expression buffer size exceeded (elements/operations)", token)
         }
         if (tokenEqChar(token, terminate, KDL_TK_CTRL) && terminate != ')') {
+            if (depth > parent.depth) {
+                ERROR(KDL_ERR_EXP, "Expected ')' before the end of the expression", token)
+            }
             (*i)++;
             break;
         }
@@ -727,7 +1055,7 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
                     bool got = false;
                     contextTracker_t nc;
                     size_t ti = *i + 1;
-                    TEST(getMark(s, contexts[contextsLen - 1], depth, t, &ti, &nc, &got))
+                    TEST(getMark(p, contexts[contextsLen - 1], depth, t, &ti, &nc, &got))
                     if (got) {
                         // getMark, like everyone else, puts us just after its
                         // content. The loop increments i by one every time, so
@@ -738,19 +1066,19 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
                     break;
                 }
                 case ')':
+                    // Leaves the mark of the parenthesis it closes, if it
+                    // had one
+                    if (contextsLen > 1 && contexts[contextsLen - 1].depth == depth) {
+                        contextsLen--;
+                    }
                     depth--;
                     e.precChange = -1;
-                    assert(contextsLen > 0);
-                    if (depth <= contexts[contextsLen - 1].depth && contextsLen == 1) {
-                        assert(depth <= parent.depth); // Same thing
-                        if (terminate == ')') {
-                            loop = false;
-                        } else {
-                            ERROR(KDL_ERR_UNX, "Unmatched ')'", t->tokens[*i])
-                        }
-                    } else {
-                        assert(contextsLen != 1);
-                        freeContext(s, &contexts[--contextsLen]);
+                    // A value in parenthesis ends with the one it started
+                    // with, anything else only groups
+                    if (depth == parent.depth && terminate == ')') {
+                        loop = false;
+                    } else if (depth < parent.depth) {
+                        ERROR(KDL_ERR_UNX, "Unmatched ')'", tokenAt(t, *i))
                     }
                     break;
                 default:
@@ -771,26 +1099,28 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
             }
             break;
         default:
-            TEST(getRawValue(s, token, &value, &op, &global))
+            TEST(getRawValue(p, token, &value, &op, &global))
         }
-        if (loop && op != KDL_OP_NOOP) {
+        if (e.precChange != 0) {
+            elements[elementsLen++] = e;
+        } else if (loop && op != KDL_OP_NOOP) {
             if (value == NULL) {
-                createStringCopyNoWhitespace(s, token.value, token.valueLen, (char **) &value);
+                createStringCopyNoWhitespace(p->program, token.value, token.valueLen, (char **) &value);
             }
 
             kdl_op_t *opv = NULL;
-            opv = (kdl_op_t *) malloc(sizeof(kdl_op_t));
+            opv = (kdl_op_t *) kdl_arena_alloc(&p->scratch, sizeof(kdl_op_t));
             opv->op = op;
             opv->value = value;
+            opv->slot = 0;
             if (global) {
                 opv->context = NULL;
             } else {
-                getContextString(s, contexts[contextsLen - 1], &opv->context);
+                getContextString(p, contexts[contextsLen - 1], &opv->context);
             }
             e.data = opv;
             elements[elementsLen++] = e;
         } else {
-            s.free(value);
             value = NULL;
         }
         assert(e.prec <= MAX_PREC);
@@ -798,13 +1128,14 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
 
 
 
-    infixToPostfix(s, elements, elementsLen, MAX_PREC, (void ***) &stack, &stackLen);
+    infixToPostfix(&p->scratch, elements, elementsLen, MAX_PREC, (void ***) &stack, &stackLen);
+    foldCompute(p, stack, &stackLen);
 
     // Flatten the stack.
     // Supposidly this improves CPU cache or smthn idk.
     // Well I like flat arrays so...!!!!
     kdl_compute_t compute;
-    compute.opers = (kdl_op_t *) s.malloc(sizeof(kdl_op_t) * stackLen);
+    compute.opers = stackLen ? (kdl_op_t *) kdl_arena_alloc(p->program, sizeof(kdl_op_t) * stackLen) : NULL;
     compute.length = stackLen;
 
     for (size_t f = 0; f < stackLen; f++) {
@@ -815,33 +1146,18 @@ kdl_error_t getCompute(kdl_state_t s, contextTracker_t parent, kdl_tokenization_
 
     ERROR_IS
 
-    for (size_t f = 0; f < stackLen; f++) {
-        s.free(stack[f]->context);
-        s.free(stack[f]->value);
-    }
-
     ERROR_NONE
 
-    for (size_t f = 1; f < contextsLen; f++) {
-        freeContext(s, &contexts[f]);
-    }
-
-    for (size_t f = 0; f < stackLen; f++) {
-        s.free(stack[f]);
-    }
-
-    s.free(contexts);
-    s.free(elements);
-    s.free(stack);
+    kdl_arena_rewind(&p->scratch, mark);
 
     ERROR_END
 }
 
 // For the parameters to the verb
-kdl_error_t getValue(kdl_state_t s, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out) {
+kdl_error_t getValue(parser_t *p, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_compute_t *out) {
     ERROR_START
 
-    kdl_token_t token = t->tokens[*i];
+    kdl_token_t token = tokenAt(t, *i);
     kdl_compute_t result;
     memset(&result, 0, sizeof(kdl_compute_t));
     if (token.type == KDL_TK_CTRL && !tokenEqChar(token, '(', KDL_TK_CTRL)) {
@@ -850,21 +1166,22 @@ kdl_error_t getValue(kdl_state_t s, contextTracker_t parentContext, kdl_tokeniza
     if (token.type == KDL_TK_CTRL) {
         // Thus, must be (, and so we can forward it...
         // (*i)++; getCompute needs the parenthesies
-        TEST(getCompute(s, parentContext, t, i, &result, ')'))
+        TEST(getCompute(p, parentContext, t, i, &result, ')'))
         // (*i)++; getCompute consumes everything
     } else {
         // Must be single-token literal, then
         kdl_op_t op;
+        op.slot = 0;
         bool global = false;
-        TEST(getRawValue(s, token, &op.value, &op.op, &global))
+        TEST(getRawValue(p, token, &op.value, &op.op, &global))
         if (global) {
             op.context = NULL;
         } else {
-            getContextString(s, parentContext, &op.context);
+            getContextString(p, parentContext, &op.context);
         }
         (*i)++;
         result.length = 1;
-        result.opers = (kdl_op_t *) s.malloc(sizeof(kdl_op_t) * result.length);
+        result.opers = (kdl_op_t *) kdl_arena_alloc(p->program, sizeof(kdl_op_t) * result.length);
         result.opers[0] = op;
     }
 
@@ -878,41 +1195,44 @@ kdl_error_t getValue(kdl_state_t s, contextTracker_t parentContext, kdl_tokeniza
 }
 
 // The verb et al.
-kdl_error_t getExecute(kdl_state_t s, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_execute_t *out) {
+kdl_error_t getExecute(parser_t *p, contextTracker_t parentContext, kdl_tokenization_t *t, size_t *i, kdl_execute_t *out) {
     ERROR_START
 
+    kdl_arenaMark_t mark = kdl_arena_mark(&p->scratch);
     kdl_execute_t result;
     // Lol all my problems solved.
     // All zero-init.
     // Very fancy.
     memset(&result, 0, sizeof(kdl_execute_t));
-    kdl_token_t token = t->tokens[*i];
+    kdl_token_t token = tokenAt(t, *i);
     bool gotNewContext = false;
     contextTracker_t context = parentContext;
 
     if (token.type == KDL_TK_WORD) {
-        getContextString(s, context, &result.order.context);
-        result.order.verb = (char *) s.malloc(sizeof(char) * (token.valueLen + 1));
-        memcpy(result.order.verb, token.value, token.valueLen);
-        result.order.verb[token.valueLen] = '\0';
-        // Now for the parameters
-        result.order.params = (kdl_compute_t *) s.malloc(sizeof(kdl_compute_t) * MAX_COMPUTE_PARAMS);
+        getContextString(p, context, &result.order.context);
+        result.order.verb = kdl_arena_strndup(p->program, token.value, token.valueLen);
+        // Now for the parameters. Collected in scratch space, and copied
+        // once we know how many there are.
+        kdl_compute_t *params = (kdl_compute_t *) kdl_arena_alloc(&p->scratch, sizeof(kdl_compute_t) * MAX_COMPUTE_PARAMS);
         result.order.nParams = 0; // Formality, already zero from memset
 
         (*i)++;
 
-        kdl_token_t lToken = t->tokens[*i];
+        kdl_token_t lToken = tokenAt(t, *i);
         while (lToken.type != KDL_TK_CTRL || tokenEqCharNT(lToken, '(')) {
             if (result.order.nParams >= MAX_COMPUTE_PARAMS) {
                 ERROR(KDL_ERR_BUF, "Compute buffer size exceeded while parsing value", lToken)
             }
             kdl_compute_t compute;
-            TEST(getValue(s, context, t, i, &compute))
-            result.order.params[result.order.nParams++] = compute;
-            lToken = t->tokens[*i];
+            TEST(getValue(p, context, t, i, &compute))
+            params[result.order.nParams++] = compute;
+            lToken = tokenAt(t, *i);
         }
 
-        result.order.params = (kdl_compute_t *) s.realloc(result.order.params, sizeof(kdl_compute_t) * result.order.nParams);
+        if (result.order.nParams > 0) {
+            result.order.params = (kdl_compute_t *) kdl_arena_alloc(p->program, sizeof(kdl_compute_t) * result.order.nParams);
+            memcpy(result.order.params, params, sizeof(kdl_compute_t) * result.order.nParams);
+        }
 
     } else if (tokenEqChar22(token, ':', ':', KDL_TK_CTRL)) {
         if (gotNewContext) {
@@ -923,13 +1243,17 @@ kdl_error_t getExecute(kdl_state_t s, contextTracker_t parentContext, kdl_tokeni
         ERROR(KDL_ERR_UNX, "Unexpected tokens while processing execute", token)
     }
 
-    kdl_token_t token2 = t->tokens[*i];
+    kdl_token_t token2 = tokenAt(t, *i);
 
     if (tokenEqChar22(token2, ':', ':', KDL_TK_CTRL)) {
         (*i)++;
-        TEST(getProgram(s, context, t, i, &result.child, ')'))
+        if (p->lazy) {
+            TEST(skipProgram(p, context, t, i, &result.child))
+        } else {
+            TEST(getProgram(p, context, t, i, &result.child, ')'))
+        }
     } else {
-        kdl_token_t finalToken = t->tokens[*i];
+        kdl_token_t finalToken = tokenAt(t, *i);
         if (!tokenEqChar(finalToken, ')', KDL_TK_CTRL)) {
             ERROR(KDL_ERR_EXP, "Expected ')' at end of execute", finalToken)
         }
@@ -940,41 +1264,38 @@ kdl_error_t getExecute(kdl_state_t s, contextTracker_t parentContext, kdl_tokeni
 
     ERROR_IS
 
-    freeExecute(s, &result);
-
     ERROR_NONE
 
-    if (gotNewContext) {
-        freeContext(s, &context);
-    }
+    kdl_arena_rewind(&p->scratch, mark);
 
     ERROR_END
 }
 
-kdl_error_t getRule(kdl_state_t s, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_rule_t *rule) {
+kdl_error_t getRule(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_rule_t *rule) {
     ERROR_START
 
+    // For the rule's context
+    kdl_arenaMark_t mark = kdl_arena_mark(&p->scratch);
     kdl_rule_t result;
     memset(&result, 0, sizeof(kdl_rule_t));
-    result.active = false; // Formality
     bool gotNewContext = false;
 
-    if (!tokenEqChar(t->tokens[*i], '(', KDL_TK_CTRL)) {
-        ERROR(KDL_ERR_EXP, "Expected '(' at start of rule", t->tokens[*i])
+    if (!tokenEqChar(tokenAt(t, *i), '(', KDL_TK_CTRL)) {
+        ERROR(KDL_ERR_EXP, "Expected '(' at start of rule", tokenAt(t, *i))
     }
     (*i)++;
 
     contextTracker_t nc;
     size_t ti = *i;
-    TEST(getMark(s, context, context.depth, t, &ti, &nc, &gotNewContext))
+    TEST(getMark(p, context, context.depth, t, &ti, &nc, &gotNewContext))
     if (gotNewContext) {
         *i = ti;
         context = nc;
     }
 
 
-    TEST(getCompute(s, context, t, i, &result.compute, '?'))
-    TEST(getExecute(s, context, t, i, &result.execute))
+    TEST(getCompute(p, context, t, i, &result.compute, '?'))
+    TEST(getExecute(p, context, t, i, &result.execute))
 
     // Already checked for ')' by getExecute and children functions
     // We are one past the last character of the rule, and ready to pass control
@@ -984,94 +1305,366 @@ kdl_error_t getRule(kdl_state_t s, contextTracker_t context, kdl_tokenization_t
 
     ERROR_IS
 
-    freeRule(s, &result);
-
     ERROR_NONE
 
-    if (gotNewContext) {
-        freeContext(s, &context);
-    }
+    kdl_arena_rewind(&p->scratch, mark);
 
     ERROR_END
 }
 
 
 
-kdl_error_t getProgram(kdl_state_t s, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out, char terminate) {
+kdl_error_t getProgram(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out, char terminate) {
     ERROR_START
 
-    assert(t->nTokens > 0);
-
     kdl_program_t result;
     memset(&result, 0, sizeof(kdl_program_t));
 
+    // Rules are collected in scratch space, and copied once we know how
+    // many there are
+    kdl_arenaMark_t mark = kdl_arena_mark(&p->scratch);
     size_t programSize = PROGRAM_BUFFER_SIZE;
-    result.rules = (kdl_rule_t *) s.malloc(sizeof(kdl_rule_t) * programSize);
+    kdl_rule_t *rules = (kdl_rule_t *) kdl_arena_alloc(&p->scratch, sizeof(kdl_rule_t) * programSize);
     result.length = 0; // Formality, already done by memset
 
-    kdl_token_t token = t->tokens[*i];
-    while (!tokenEqChar(token, terminate, KDL_TK_CTRL)) {
+    while (true) {
+        if (!hasToken(t, *i)) {
+            if (terminate == '\0') {
+                break;
+            } else {
+                ERROR(KDL_ERR_EOF, "Reached EOF while reading nested rule list", tokenAt(t, *i-1))
+            }
+        }
+        if (tokenEqChar(tokenAt(t, *i), terminate, KDL_TK_CTRL)) {
+            (*i)++;
+            break;
+        }
         if (result.length >= programSize) {
-            programSize += PROGRAM_BUFFER_SIZE;
-            result.rules = (kdl_rule_t *) s.malloc(sizeof(kdl_rule_t) * programSize);
+            rules = (kdl_rule_t *) kdl_arena_grow(&p->scratch, rules, sizeof(kdl_rule_t) * programSize, sizeof(kdl_rule_t) * programSize * 2);
+            programSize *= 2;
         }
 
         kdl_rule_t rule;
-        TEST(getRule(s, context, t, i, &rule))
-        result.rules[result.length++] = rule;
+        TEST(getRule(p, context, t, i, &rule))
+        rules[result.length++] = rule;
 
-        if (*i >= t->nTokens) {
-            if (terminate == '\0') {
-                break;
-            } else {
-                ERROR(KDL_ERR_EOF, "Reached EOF while reading nested rule list", t->tokens[*i-1])
-            }
+        // Nothing looks back past a top level rule
+        if (terminate == '\0') {
+            dropTokens(t, *i);
         }
-        token = t->tokens[*i];
     }
 
-    (*i)++;
-
-    result.rules = (kdl_rule_t *) s.realloc(result.rules, sizeof(kdl_rule_t) * result.length);
+    if (result.length > 0) {
+        result.rules = (kdl_rule_t *) kdl_arena_alloc(p->program, sizeof(kdl_rule_t) * result.length);
+        memcpy(result.rules, rules, sizeof(kdl_rule_t) * result.length);
+    }
 
     *out = result;
 
     ERROR_IS
 
-    freeProgram(s, &result);
-
     ERROR_NONE
 
+    kdl_arena_rewind(&p->scratch, mark);
+
     ERROR_END
 }
 
-kdl_error_t kdl_parse(kdl_state_t s, const char *input, kdl_program_t *out) {
+// Finds the ')' that ends the child program, and keeps the text up to it
+// for kdl_parseLazyChild()
+kdl_error_t skipProgram(parser_t *p, contextTracker_t context, kdl_tokenization_t *t, size_t *i, kdl_program_t *out) {
     ERROR_START
 
+    kdl_token_t start = tokenAt(t, *i);
+    size_t depth = 0;
+    while (true) {
+        if (!hasToken(t, *i)) {
+            ERROR(KDL_ERR_EOF, "Reached EOF while reading nested rule list", tokenAt(t, *i-1))
+        }
+        kdl_token_t token = tokenAt(t, *i);
+        (*i)++;
+        if (tokenEqChar(token, '(', KDL_TK_CTRL)) {
+            depth++;
+        } else if (tokenEqChar(token, ')', KDL_TK_CTRL)) {
+            if (depth == 0) {
+                kdl_lazyProgram_t *lazy = (kdl_lazyProgram_t *) kdl_arena_alloc(p->program, sizeof(kdl_lazyProgram_t));
+                memset(lazy, 0, sizeof(kdl_lazyProgram_t));
+                lazy->length = (size_t) (token.value - start.value);
+                lazy->source = kdl_arena_strndup(p->program, start.value, lazy->length);
+                getContextString(p, context, (char **) &lazy->context);
+                lazy->arena = p->root;
+                memset(out, 0, sizeof(kdl_program_t));
+                out->lazy = lazy;
+                break;
+            }
+            depth--;
+        }
+    }
 
+    ERROR_IS
+
+    ERROR_NONE
+
+    ERROR_END
+}
+
+// The rules of `input`, in `context`
+kdl_error_t parseTokens(parser_t *p, contextTracker_t context, const char *input, size_t length, kdl_program_t *out) {
     kdl_tokenization_t tokens;
+    tokenize(p->s, input, length, &tokens);
+    size_t i = 0;
+    kdl_error_t e = getProgram(p, context, &tokens, &i, out, '\0');
+    // Bad input stops the tokens early, which the parser only sees as
+    // EOF; the real reason comes first
+    if (isError(tokens.error)) {
+        e = tokens.error;
+    }
+    freeTokenization(&tokens);
+    return e;
+}
+
+kdl_error_t parse(kdl_state_t s, const char *input, size_t length, bool lazy, kdl_program_t *out) {
+    ERROR_START
+
+    parser_t p;
     kdl_program_t program;
     contextTracker_t context;
 
-    memset(&tokens, 0, sizeof(kdl_tokenization_t));
+    kdl_arena_t *arena = (kdl_arena_t *) s.malloc(sizeof(kdl_arena_t));
+    kdl_arena_init(s, arena, PROGRAM_CHUNK_SIZE);
+    mkParser(&p, s, lazy, arena, arena);
+
     memset(&program, 0, sizeof(kdl_program_t));
-    mkContext(s, 0, &context);
+    mkContext(&p, 0, &context);
 
-    TEST(tokenize(s, input, &tokens))
-    size_t i = 0;
-    TEST(getProgram(s, context, &tokens, &i, &program, '\0'))
+    TEST(parseTokens(&p, context, input, length, &program))
 
+    program.arena = p.program;
     *out = program;
+    reportFolded(p.folded);
 
     ERROR_IS
 
+    kdl_arena_free(p.program);
+    s.free(p.program);
+
     ERROR_NONE
 
-    freeTokenization(s, &tokens);
+    freeParser(&p);
 
     ERROR_END
 }
 
+// Cuts the input after the top level rule that ends at or past every
+// `chunkSize` bytes. Whatever the tokenizer can't make sense of (bad
+// characters, a ')' too many, a missing one) goes in the last chunk, so
+// that it gets the same error as it would parsing everything at once.
+size_t splitRules(kdl_state_t s, const char *input, size_t length, size_t chunkSize, chunk_t **out) {
+    size_t size = CHUNKS_PER_THREAD;
+    size_t n = 0;
+    chunk_t *chunks = (chunk_t *) s.malloc(sizeof(chunk_t) * size);
+
+    const char *end = input + length;
+    const char *offset = input;
+    const char *start = input;
+    size_t depth = 0;
+    bool eof = false;
+    while (true) {
+        kdl_token_t token;
+        size_t skip = 0;
+        if (isError(getToken(offset, end, &token, &skip, &eof)) || eof) {
+            break;
+        }
+        offset = token.value + token.valueLen + skip;
+        if (tokenEqChar(token, '(', KDL_TK_CTRL)) {
+            depth++;
+        } else if (tokenEqChar(token, ')', KDL_TK_CTRL)) {
+            if (depth == 0) {
+                break;
+            }
+            depth--;
+            if (depth == 0 && (size_t) (offset - start) >= chunkSize) {
+                if (n == size) {
+                    size *= 2;
+                    chunks = (chunk_t *) s.realloc(chunks, sizeof(chunk_t) * size);
+                }
+                chunks[n].input = start;
+                chunks[n].length = (size_t) (offset - start);
+                n++;
+                start = offset;
+            }
+        }
+    }
+    if (n == size) {
+        size++;
+        chunks = (chunk_t *) s.realloc(chunks, sizeof(chunk_t) * size);
+    }
+    chunks[n].input = start;
+    chunks[n].length = (size_t) (end - start);
+    n++;
+
+    *out = chunks;
+    return n;
+}
+
+// Run by every thread until there are no chunks left
+void *parseChunks(void *arg) {
+    parseJob_t *job = (parseJob_t *) arg;
+    while (true) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->nChunks) {
+            break;
+        }
+        chunk_t *c = &job->chunks[i];
+        parser_t p;
+        contextTracker_t context;
+        kdl_arena_init(job->s, &c->program, PROGRAM_CHUNK_SIZE);
+        mkParser(&p, job->s, job->lazy, &c->program, job->root);
+        memset(&c->result, 0, sizeof(kdl_program_t));
+        mkContext(&p, 0, &context);
+        c->error = parseTokens(&p, context, c->input, c->length, &c->result);
+        c->folded = p.folded;
+        freeParser(&p);
+    }
+    return NULL;
+}
+
+kdl_error_t kdl_parse(kdl_state_t s, const char *input, kdl_program_t *out) {
+    return kdl_parseN(s, input, strlen(input), out);
+}
+
+kdl_error_t kdl_parseN(kdl_state_t s, const char *input, size_t length, kdl_program_t *out) {
+    return parse(s, input, length, false, out);
+}
+
+kdl_error_t kdl_parseParallel(kdl_state_t s, const char *input, size_t length, size_t threads, bool lazy, kdl_program_t *out) {
+    ERROR_START
+
+    if (threads <= 1 || length / (threads * CHUNKS_PER_THREAD) < MIN_CHUNK_SIZE) {
+        return parse(s, input, length, lazy, out);
+    }
+    size_t chunkSize = length / (threads * CHUNKS_PER_THREAD);
+
+    parseJob_t job;
+    job.s = s;
+    job.lazy = lazy;
+    job.root = (kdl_arena_t *) s.malloc(sizeof(kdl_arena_t));
+    kdl_arena_init(s, job.root, PROGRAM_CHUNK_SIZE);
+    job.nChunks = splitRules(s, input, length, chunkSize, &job.chunks);
+    atomic_init(&job.next, 0);
+
+    // This thread is one of them
+    pthread_t *workers = (pthread_t *) s.malloc(sizeof(pthread_t) * threads);
+    size_t nWorkers = 0;
+    for (; nWorkers + 1 < threads && nWorkers + 1 < job.nChunks; nWorkers++) {
+        if (pthread_create(&workers[nWorkers], NULL, parseChunks, &job) != 0) {
+            break;
+        }
+    }
+    parseChunks(&job);
+    for (size_t i = 0; i < nWorkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    s.free(workers);
+
+    // The rules go back together in order, and so do the errors: the
+    // first chunk to fail has the error parsing it all at once would give
+    kdl_program_t program;
+    memset(&program, 0, sizeof(kdl_program_t));
+    for (size_t i = 0; i < job.nChunks; i++) {
+        TEST(job.chunks[i].error)
+        program.length += job.chunks[i].result.length;
+    }
+    if (program.length > 0) {
+        program.rules = (kdl_rule_t *) kdl_arena_alloc(job.root, sizeof(kdl_rule_t) * program.length);
+        size_t at = 0;
+        for (size_t i = 0; i < job.nChunks; i++) {
+            kdl_program_t *r = &job.chunks[i].result;
+            if (r->length > 0) {
+                memcpy(program.rules + at, r->rules, sizeof(kdl_rule_t) * r->length);
+            }
+            at += r->length;
+        }
+    }
+    for (size_t i = 0; i < job.nChunks; i++) {
+        kdl_arena_absorb(job.root, &job.chunks[i].program);
+    }
+    program.arena = job.root;
+    *out = program;
+    size_t folded = 0;
+    for (size_t i = 0; i < job.nChunks; i++) {
+        folded += job.chunks[i].folded;
+    }
+    reportFolded(folded);
+
+    ERROR_IS
+
+    for (size_t i = 0; i < job.nChunks; i++) {
+        kdl_arena_free(&job.chunks[i].program);
+    }
+    kdl_arena_free(job.root);
+    s.free(job.root);
+
+    ERROR_NONE
+
+    s.free(job.chunks);
+
+    ERROR_END
+}
+
+kdl_error_t kdl_parseLazy(kdl_state_t s, const char *input, size_t length, kdl_program_t *out) {
+    return kdl_parseParallel(s, input, length, 1, true, out);
+}
+
+kdl_error_t kdl_parseLazyChild(kdl_state_t s, kdl_lazyProgram_t *lazy) {
+    ERROR_START
+
+    if (lazy->parsed) {
+        NO_ERROR
+    }
+    lazy->parsed = true;
+
+    parser_t p;
+    contextTracker_t context;
+    mkParser(&p, s, true, lazy->arena, lazy->arena);
+
+    // The context comes back word by word
+    mkContext(&p, 0, &context);
+    const char *word = lazy->context;
+    while (*word) {
+        size_t wordLen = strcspn(word, " ");
+        kdl_token_t token;
+        token.type = KDL_TK_WORD;
+        token.value = word;
+        token.valueLen = wordLen;
+        TEST(addToContext(token, &context, word, wordLen))
+        word += wordLen;
+        word += *word == ' ';
+    }
+
+    TEST(parseTokens(&p, context, lazy->source, lazy->length, &lazy->program))
+    reportFolded(p.folded);
+
+    ERROR_IS
+
+    // Whatever made it to the arena stays there until the program goes
+    memset(&lazy->program, 0, sizeof(kdl_program_t));
+
+    ERROR_NONE
+
+    freeParser(&p);
+
+    ERROR_END
+}
+
+kdl_error_t kdl_nextToken(const char *input, const char *end, kdl_token_t *token, size_t *skip, bool *eof) {
+    return getToken(input, end, token, skip, eof);
+}
+
 void kdl_freeProgram(kdl_state_t s, kdl_program_t *p) {
-    freeProgram(s, p);
+    if (p->arena) {
+        kdl_arena_free(p->arena);
+        s.free(p->arena);
+    }
+    memset(p, 0, sizeof(kdl_program_t));
 }
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 
 #include "def.h"
+#include "arena.h"
 
 // TODO:
 // In getCompute()
@@ -61,9 +62,22 @@ typedef struct {
     size_t valueLen;
 } kdl_token_t;
 
+// Tokens are read from the input as the parser asks for them, and the
+// ones before the current top level rule are dropped, so only one rule's
+// worth is ever held.
 typedef struct {
+    kdl_state_t s;
+    // Token number `base` is tokens[0]
     kdl_token_t *tokens;
     size_t nTokens;
+    size_t size;
+    size_t base;
+    // What is left of the input
+    const char *offset;
+    const char *end;
+    // No more tokens. Either the input ran out or `error` is set.
+    bool eof;
+    kdl_error_t error;
 } kdl_tokenization_t;
 
 typedef struct {
@@ -75,6 +89,11 @@ typedef struct {
     int op;
     // Is NULL if no value
     void *value;
+
+    // For execution phase use: where the machine keeps the variable a
+    // KDL_OP_PVAR reads. Given when the program is loaded, or compiled (see
+    // kdl_compile()). 0 for other ops.
+    size_t slot;
 } kdl_op_t;
 
 typedef struct {
@@ -83,12 +102,33 @@ typedef struct {
 } kdl_compute_t;
 
 struct kdl_rule_p;
+struct kdl_lazyProgram_p;
 
 typedef struct {
     struct kdl_rule_p *rules;
     size_t length;
+    // Holds everything the program (children included) is made of, so that
+    // it can be freed at once. Only set on the root program.
+    kdl_arena_t *arena;
+    // Only set on child programs of kdl_parseLazy(), which have no rules
+    // until kdl_parseLazyChild() is called
+    struct kdl_lazyProgram_p *lazy;
 } kdl_program_t;
 
+// A child program as it was in the input. Shared by every copy of the
+// rule it belongs to, so that it is only parsed once.
+typedef struct kdl_lazyProgram_p {
+    // Copied from the input, so not null terminated
+    const char *source;
+    size_t length;
+    // Of the parent rule
+    const char *context;
+    // The root program's, which the rules go in
+    kdl_arena_t *arena;
+    bool parsed;
+    kdl_program_t program;
+} kdl_lazyProgram_t;
+
 typedef struct {
     // Empty string if root
     // Should be NULL if the verb is NULL
@@ -110,12 +150,40 @@ typedef struct kdl_rule_p {
     kdl_compute_t compute;
     kdl_execute_t execute;
 
-    // For execution phase use
-    bool active;
+    // For execution phase use: where the machine keeps the rule's state.
+    // Given like kdl_op_t.slot.
+    size_t slot;
 } kdl_rule_t;
 
+// `input` must be null terminated.
+// Computes come out simplified: operators on number literals are worked
+// out, and "+ 0", "* 1" and the like are dropped. Building with
+// KDL_DEBUG_FOLD prints how many ops that took out of each parse.
 kdl_error_t kdl_parse(kdl_state_t s, const char *input, kdl_program_t *program);
+// Same, for `length` chars that need not be null terminated (eg. a
+// mapped file, see source.h). The program does not point into `input`,
+// which can go as soon as this returns.
+kdl_error_t kdl_parseN(kdl_state_t s, const char *input, size_t length, kdl_program_t *program);
+// Same, but child programs ("? :: (...)") are only checked to be balanced
+// and copied. They are parsed when needed by kdl_parseLazyChild(), so
+// rules that never run cost little time or memory.
+kdl_error_t kdl_parseLazy(kdl_state_t s, const char *input, size_t length, kdl_program_t *program);
+// Either of the above, on `threads` threads for inputs big enough to be
+// worth it. Top level rules are split between the threads, and put back
+// in order; an error is the first one in the input, same as with one
+// thread. `s` has to be thread safe.
+kdl_error_t kdl_parseParallel(kdl_state_t s, const char *input, size_t length, size_t threads, bool lazy, kdl_program_t *program);
+// Parses `lazy` into `lazy->program` unless that was done already. Errors
+// are only returned the first time, after which the program stays empty.
+// Its own children are lazy too.
+kdl_error_t kdl_parseLazyChild(kdl_state_t s, kdl_lazyProgram_t *lazy);
+// Only for programs returned by kdl_parse(), not their children
 void kdl_freeProgram(kdl_state_t s, kdl_program_t *p);
+// Reads the token at the start of `input`, stopping at `end`. `skip` is
+// the number of chars after the token that belong to it (eg. the closing
+// ']'), and `eof` is set once there are no tokens left. Only the parser
+// needs this, it is exported for bench/tokenizer.c.
+kdl_error_t kdl_nextToken(const char *input, const char *end, kdl_token_t *token, size_t *skip, bool *eof);
 
 #endif
 
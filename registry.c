@@ -0,0 +1,250 @@
+#include "registry.h"
+
+#include <string.h>
+#include <assert.h>
+
+#define SNAPSHOT_PRECISION 4
+
+// Every value is stored as one allocation: the `valueSize` bytes of the
+// value, followed by its null terminated name, so that a snapshot can be
+// copied without access to the map's keys.
+
+// --- Static helper methods ---
+
+static void freeValue_fwd(kdl_state_t s, void *data);
+static void *mkValue(const kdl_registry_t *r, const char *name, size_t nameLen, const void *value);
+static const char *valueName(const kdl_registry_t *r, const void *value);
+static kdl_registrySnapshot_t *copySnapshot(kdl_registry_t *r, size_t extra);
+static void putValue(kdl_registry_t *r, kdl_registrySnapshot_t *snap, const char *name, const void *value);
+static void freeSnapshot(kdl_registry_t *r, kdl_registrySnapshot_t *snap);
+static void publish(kdl_registry_t *r, kdl_registrySnapshot_t *snap);
+static bool inUse(const kdl_registry_t *r, const kdl_registrySnapshot_t *snap);
+static void reclaim(kdl_registry_t *r);
+
+void freeValue_fwd(kdl_state_t s, void *data) {
+    s.free(data);
+}
+
+void *mkValue(const kdl_registry_t *r, const char *name, size_t nameLen, const void *value) {
+    char *result = (char *) r->s.malloc(r->valueSize + sizeof(char) * (nameLen + 1));
+    memcpy(result, value, r->valueSize);
+    memcpy(result + r->valueSize, name, sizeof(char) * nameLen);
+    result[r->valueSize + nameLen] = '\0';
+    return result;
+}
+
+const char *valueName(const kdl_registry_t *r, const void *value) {
+    return (const char *) value + r->valueSize;
+}
+
+// Not published yet, so it can still be modified. Room is made for
+// `extra` more values, so that inserting them does not start a rehash.
+// Caller must hold the lock.
+kdl_registrySnapshot_t *copySnapshot(kdl_registry_t *r, size_t extra) {
+    kdl_registrySnapshot_t *from = atomic_load(&r->current);
+    kdl_registrySnapshot_t *snap = (kdl_registrySnapshot_t *) r->s.malloc(sizeof(kdl_registrySnapshot_t));
+    kdl_hashmap_init(r->s, &snap->values, SNAPSHOT_PRECISION, freeValue_fwd, NULL);
+    snap->retiredAt = 0;
+    snap->nextRetired = NULL;
+    kdl_hashmap_reserve(&snap->values, kdl_hashmap_size(&from->values) + extra);
+
+    kdl_hashmap_result_t i = kdl_hashmap_first(&from->values);
+    for (; i.code == KDL_HASHMAP_EOK; kdl_hashmap_next(&from->values, &i)) {
+        void *value;
+        kdl_hashmap_get(&from->values, i, &value);
+        const char *name = valueName(r, value);
+        kdl_hashmap_insertHashed(&snap->values, name, i.keyLength,
+                                 kdl_hashmap_hashKey(&snap->values, name, i.keyLength),
+                                 mkValue(r, name, i.keyLength, value));
+    }
+    return snap;
+}
+
+void putValue(kdl_registry_t *r, kdl_registrySnapshot_t *snap, const char *name, const void *value) {
+    size_t nameLen = strlen(name);
+    kdl_hashmap_hash_t hash = kdl_hashmap_hashKey(&snap->values, name, nameLen);
+    kdl_hashmap_result_t res;
+    kdl_hashmap_searchHashed(&snap->values, name, nameLen, hash, &res);
+    if (res.code == KDL_HASHMAP_EOK) {
+        void *old;
+        kdl_hashmap_get(&snap->values, res, &old);
+        memcpy(old, value, r->valueSize);
+    } else {
+        kdl_hashmap_insertHashed(&snap->values, name, nameLen, hash, mkValue(r, name, nameLen, value));
+    }
+}
+
+void freeSnapshot(kdl_registry_t *r, kdl_registrySnapshot_t *snap) {
+    kdl_hashmap_free(&snap->values);
+    r->s.free(snap);
+}
+
+// Caller must hold the lock
+void publish(kdl_registry_t *r, kdl_registrySnapshot_t *snap) {
+    // Removals leave tombstones; and a published map must not be rehashing
+    kdl_hashmap_reclaim(&snap->values);
+    kdl_registrySnapshot_t *old = atomic_exchange(&r->current, snap);
+    // Any reader that got `old` entered at this epoch or before
+    old->retiredAt = atomic_fetch_add(&r->epoch, 1);
+    old->nextRetired = r->retired;
+    r->retired = old;
+    reclaim(r);
+}
+
+bool inUse(const kdl_registry_t *r, const kdl_registrySnapshot_t *snap) {
+    for (kdl_registryReader_t *i = r->readers; i; i = i->next) {
+        uint64_t e = atomic_load(&i->epoch);
+        if (e != 0 && e <= snap->retiredAt) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Caller must hold the lock
+void reclaim(kdl_registry_t *r) {
+    kdl_registrySnapshot_t **i = &r->retired;
+    while (*i) {
+        kdl_registrySnapshot_t *snap = *i;
+        if (inUse(r, snap)) {
+            i = &snap->nextRetired;
+        } else {
+            *i = snap->nextRetired;
+            freeSnapshot(r, snap);
+        }
+    }
+}
+
+// --- Exported methods ---
+
+// --- Readers ---
+
+kdl_registryReader_t *kdl_registry_addReader(kdl_registry_t *r) {
+    kdl_registryReader_t *reader = (kdl_registryReader_t *) r->s.malloc(sizeof(kdl_registryReader_t));
+    atomic_init(&reader->epoch, 0);
+    pthread_mutex_lock(&r->lock);
+    reader->next = r->readers;
+    r->readers = reader;
+    pthread_mutex_unlock(&r->lock);
+    return reader;
+}
+
+void kdl_registry_removeReader(kdl_registry_t *r, kdl_registryReader_t *reader) {
+    assert(atomic_load(&reader->epoch) == 0); // Error: still reading
+    pthread_mutex_lock(&r->lock);
+    kdl_registryReader_t **i = &r->readers;
+    for (; *i != reader; i = &(*i)->next) {
+        assert(*i != NULL); // Error: not a reader of this registry
+    }
+    *i = reader->next;
+    reclaim(r);
+    pthread_mutex_unlock(&r->lock);
+    r->s.free(reader);
+}
+
+const kdl_registrySnapshot_t *kdl_registry_enter(kdl_registry_t *r, kdl_registryReader_t *reader) {
+    assert(atomic_load(&reader->epoch) == 0); // Error: sections do not nest
+    // The epoch has to be visible before the snapshot is read: a writer
+    // that replaces it afterwards will then see this reader.
+    atomic_store(&reader->epoch, atomic_load(&r->epoch));
+    return atomic_load(&r->current);
+}
+
+void kdl_registry_exit(kdl_registryReader_t *reader) {
+    atomic_store(&reader->epoch, 0);
+}
+
+const void *kdl_registry_lookup(const kdl_registrySnapshot_t *snapshot, const char *name) {
+    // Searching a map that is not rehashing does not modify it
+    kdl_hashmap_t *values = (kdl_hashmap_t *) &snapshot->values;
+    kdl_hashmap_result_t res;
+    kdl_hashmap_search(values, name, &res);
+    if (res.code != KDL_HASHMAP_EOK) {
+        return NULL;
+    }
+    void *value;
+    kdl_hashmap_get(values, res, &value);
+    return value;
+}
+
+bool kdl_registry_get(kdl_registry_t *r, kdl_registryReader_t *reader, const char *name, void *out) {
+    const void *value = kdl_registry_lookup(kdl_registry_enter(r, reader), name);
+    if (value) {
+        memcpy(out, value, r->valueSize);
+    }
+    kdl_registry_exit(reader);
+    return value != NULL;
+}
+
+// --- Writers ---
+
+void kdl_registry_set(kdl_registry_t *r, const char *name, const void *value) {
+    kdl_registry_setMany(r, &name, value, 1);
+}
+
+void kdl_registry_setMany(kdl_registry_t *r, const char *const *names, const void *values, size_t n) {
+    pthread_mutex_lock(&r->lock);
+    kdl_registrySnapshot_t *snap = copySnapshot(r, n);
+    for (size_t i = 0; i < n; i++) {
+        putValue(r, snap, names[i], (const char *) values + i * r->valueSize);
+    }
+    publish(r, snap);
+    pthread_mutex_unlock(&r->lock);
+}
+
+bool kdl_registry_remove(kdl_registry_t *r, const char *name) {
+    pthread_mutex_lock(&r->lock);
+    if (!kdl_registry_lookup(atomic_load(&r->current), name)) {
+        pthread_mutex_unlock(&r->lock);
+        return false;
+    }
+    kdl_registrySnapshot_t *snap = copySnapshot(r, 0);
+    kdl_hashmap_result_t res;
+    kdl_hashmap_search(&snap->values, name, &res);
+    assert(res.code == KDL_HASHMAP_EOK);
+    kdl_hashmap_remove(&snap->values, res);
+    publish(r, snap);
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+size_t kdl_registry_size(kdl_registry_t *r) {
+    pthread_mutex_lock(&r->lock);
+    size_t size = kdl_hashmap_size(&atomic_load(&r->current)->values);
+    pthread_mutex_unlock(&r->lock);
+    return size;
+}
+
+uint64_t kdl_registry_version(kdl_registry_t *r) {
+    return atomic_load(&r->epoch);
+}
+
+// --- Memory and initailization ---
+
+void kdl_registry_free(kdl_registry_t *r) {
+    assert(r->readers == NULL); // Error: readers left
+    while (r->retired) {
+        kdl_registrySnapshot_t *next = r->retired->nextRetired;
+        freeSnapshot(r, r->retired);
+        r->retired = next;
+    }
+    freeSnapshot(r, atomic_load(&r->current));
+    pthread_mutex_destroy(&r->lock);
+    memset(r, 0, sizeof(kdl_registry_t));
+}
+
+void kdl_registry_init(kdl_state_t s, kdl_registry_t *r, size_t valueSize) {
+    memset(r, 0, sizeof(kdl_registry_t));
+    r->s = s;
+    r->valueSize = valueSize;
+    pthread_mutex_init(&r->lock, NULL);
+
+    kdl_registrySnapshot_t *empty = (kdl_registrySnapshot_t *) s.malloc(sizeof(kdl_registrySnapshot_t));
+    kdl_hashmap_init(s, &empty->values, SNAPSHOT_PRECISION, freeValue_fwd, NULL);
+    empty->retiredAt = 0;
+    empty->nextRetired = NULL;
+    atomic_init(&r->current, empty);
+    atomic_init(&r->epoch, 1);
+    r->readers = NULL;
+    r->retired = NULL;
+}
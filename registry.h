@@ -0,0 +1,92 @@
+#ifndef KDL_REGISTRY_H_INCLUDED
+#define KDL_REGISTRY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "def.h"
+#include "hashmap.h"
+
+// Read-mostly map of names to fixed size values, built once and shared
+// between threads (eg. the verbs of many machines).
+//
+// Readers never take a lock: they look at an immutable snapshot. Writers
+// copy the current snapshot, change the copy and publish it with a single
+// atomic store. A replaced snapshot is only freed once every reader that
+// could still be looking at it has left, which readers announce through
+// their kdl_registryReader_t (epoch based reclamation).
+
+// --- Structures ---
+
+typedef struct kdl_registrySnapshot_p {
+    // Never modified once published. Always fully migrated, so that
+    // searching it does not write anything either.
+    kdl_hashmap_t values;
+    // Epoch at which it was replaced
+    uint64_t retiredAt;
+    struct kdl_registrySnapshot_p *nextRetired;
+} kdl_registrySnapshot_t;
+
+// One per reading thread (or per machine, if a machine is only ever run
+// by one thread at a time)
+typedef struct kdl_registryReader_p {
+    // Epoch seen when entering, 0 when outside
+    _Atomic uint64_t epoch;
+    struct kdl_registryReader_p *next;
+} kdl_registryReader_t;
+
+typedef struct {
+    kdl_state_t s;
+    size_t valueSize;
+    _Atomic(kdl_registrySnapshot_t *) current;
+    // Starts at 1, bumped every time a snapshot is replaced
+    _Atomic uint64_t epoch;
+
+    // Taken by writers and by readers joining or leaving, never by lookups
+    pthread_mutex_t lock;
+    kdl_registryReader_t *readers;
+    // Replaced snapshots that may still be in use
+    kdl_registrySnapshot_t *retired;
+} kdl_registry_t;
+
+// --- Readers ---
+
+kdl_registryReader_t *kdl_registry_addReader(kdl_registry_t *r);
+// The reader must be outside of any read section
+void kdl_registry_removeReader(kdl_registry_t *r, kdl_registryReader_t *reader);
+
+// Starts a read section. The snapshot, and every value in it, stays valid
+// until kdl_registry_exit(). Sections do not nest.
+const kdl_registrySnapshot_t *kdl_registry_enter(kdl_registry_t *r, kdl_registryReader_t *reader);
+void kdl_registry_exit(kdl_registryReader_t *reader);
+// NULL if not found
+const void *kdl_registry_lookup(const kdl_registrySnapshot_t *snapshot, const char *name);
+// enter(), lookup() and exit() in one go: copies the value to `out`.
+// Returns false if not found.
+bool kdl_registry_get(kdl_registry_t *r, kdl_registryReader_t *reader, const char *name, void *out);
+
+// --- Writers ---
+
+// Each of these publishes a new snapshot, so they cost O(size). Use
+// setMany() to add many values at once. `values` holds `n` values of
+// `valueSize` bytes back to back.
+void kdl_registry_set(kdl_registry_t *r, const char *name, const void *value);
+void kdl_registry_setMany(kdl_registry_t *r, const char *const *names, const void *values, size_t n);
+// Returns false if there was nothing to remove
+bool kdl_registry_remove(kdl_registry_t *r, const char *name);
+size_t kdl_registry_size(kdl_registry_t *r);
+// Changes every time a snapshot is published, so that readers keeping
+// copies of values know when to look them up again. Read it before the
+// lookup: a change in between only costs one extra lookup.
+uint64_t kdl_registry_version(kdl_registry_t *r);
+
+// --- Memory and initailization ---
+
+// Nothing may be reading anymore
+void kdl_registry_free(kdl_registry_t *r);
+void kdl_registry_init(kdl_state_t s, kdl_registry_t *r, size_t valueSize);
+
+#endif
@@ -0,0 +1,127 @@
+#include "scan.h"
+
+#include <stdbool.h>
+
+#if !defined(KDL_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_AVX2
+#elif !defined(KDL_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+// --- Static helper methods ---
+
+static bool isSpace(char c);
+static bool isDigit(char c);
+static bool isWord(char c);
+
+bool isSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool isWord(char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           isDigit(c) ||
+           c == '_';
+}
+
+// Vector versions of the above. Chars are signed here, so anything past
+// ASCII is negative and falls outside every range.
+// VEC_*(v) gives a mask with the bytes of `v` in the class set.
+#if defined(SCAN_AVX2)
+
+#define VEC_SIZE 32
+typedef __m256i vec_t;
+#define VEC_LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define VEC_SET(c) _mm256_set1_epi8(c)
+#define VEC_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define VEC_GT(a, b) _mm256_cmpgt_epi8(a, b)
+#define VEC_AND(a, b) _mm256_and_si256(a, b)
+#define VEC_OR(a, b) _mm256_or_si256(a, b)
+#define VEC_BITS(v) ((unsigned) _mm256_movemask_epi8(v))
+#define VEC_ALL 0xffffffffu
+
+#elif defined(SCAN_SSE2)
+
+#define VEC_SIZE 16
+typedef __m128i vec_t;
+#define VEC_LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define VEC_SET(c) _mm_set1_epi8(c)
+#define VEC_EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define VEC_GT(a, b) _mm_cmpgt_epi8(a, b)
+#define VEC_AND(a, b) _mm_and_si128(a, b)
+#define VEC_OR(a, b) _mm_or_si128(a, b)
+#define VEC_BITS(v) ((unsigned) _mm_movemask_epi8(v))
+#define VEC_ALL 0xffffu
+
+#endif
+
+#ifdef VEC_SIZE
+
+// lo <= v <= hi
+#define VEC_RANGE(v, lo, hi) VEC_AND(VEC_GT(v, VEC_SET((lo) - 1)), VEC_GT(VEC_SET((hi) + 1), v))
+#define VEC_SPACE(v) VEC_OR(VEC_EQ(v, VEC_SET(' ')), VEC_RANGE(v, '\t', '\r'))
+#define VEC_DIGIT(v) VEC_RANGE(v, '0', '9')
+// Setting 0x20 lower cases letters, and moves nothing else into a-z
+#define VEC_WORD(v) VEC_OR(VEC_OR(VEC_RANGE(VEC_OR(v, VEC_SET(0x20)), 'a', 'z'), VEC_DIGIT(v)), VEC_EQ(v, VEC_SET('_')))
+
+// Returns the offset of the first char that ends the scan, if any whole
+// vector has one. `STOP` is the bit mask of those chars in `v`. Leaves
+// `i` at the first char not checked yet, for the scalar loop.
+#define VEC_SCAN(i, p, n, STOP) \
+    for (; i + VEC_SIZE <= n; i += VEC_SIZE) { \
+        vec_t v = VEC_LOAD(p + i); \
+        unsigned stop = (STOP); \
+        if (stop) { \
+            return i + (size_t) __builtin_ctz(stop); \
+        } \
+    }
+
+#else
+
+#define VEC_SCAN(i, p, n, STOP)
+
+#endif
+
+// --- Exported methods ---
+
+size_t kdl_scan_space(const char *p, size_t n) {
+    size_t i = 0;
+    VEC_SCAN(i, p, n, ~VEC_BITS(VEC_SPACE(v)) & VEC_ALL)
+    for (; i < n && isSpace(p[i]); i++);
+    return i;
+}
+
+size_t kdl_scan_digits(const char *p, size_t n) {
+    size_t i = 0;
+    VEC_SCAN(i, p, n, ~VEC_BITS(VEC_DIGIT(v)) & VEC_ALL)
+    for (; i < n && isDigit(p[i]); i++);
+    return i;
+}
+
+size_t kdl_scan_word(const char *p, size_t n) {
+    size_t i = 0;
+    VEC_SCAN(i, p, n, ~VEC_BITS(VEC_WORD(v)) & VEC_ALL)
+    for (; i < n && isWord(p[i]); i++);
+    return i;
+}
+
+size_t kdl_scan_line(const char *p, size_t n) {
+    size_t i = 0;
+    VEC_SCAN(i, p, n, VEC_BITS(VEC_OR(VEC_OR(VEC_EQ(v, VEC_SET('\n')), VEC_EQ(v, VEC_SET('\r'))), VEC_EQ(v, VEC_SET('\0')))))
+    for (; i < n && p[i] && p[i] != '\n' && p[i] != '\r'; i++);
+    return i;
+}
+
+size_t kdl_scan_char(const char *p, size_t n, char c) {
+    size_t i = 0;
+    VEC_SCAN(i, p, n, VEC_BITS(VEC_OR(VEC_EQ(v, VEC_SET(c)), VEC_EQ(v, VEC_SET('\0')))))
+    for (; i < n && p[i] && p[i] != c; i++);
+    return i;
+}
@@ -0,0 +1,24 @@
+#ifndef KDL_SCAN_H_INCLUDED
+#define KDL_SCAN_H_INCLUDED
+
+#include <stddef.h>
+
+// Character class scans for the tokenizer. Each looks at no more than `n`
+// chars of `p`, and a null character always ends the scan.
+//
+// Checks 32 (AVX2) or 16 (SSE2) chars at a time when the compiler targets
+// those, and falls back to one at a time otherwise, or if KDL_NO_SIMD is
+// defined. Every version gives the same results.
+
+// Length of the run of whitespace (as isspace() in the "C" locale)
+size_t kdl_scan_space(const char *p, size_t n);
+// Length of the run of [0-9]
+size_t kdl_scan_digits(const char *p, size_t n);
+// Length of the run of [a-zA-Z0-9_]
+size_t kdl_scan_word(const char *p, size_t n);
+// Offset of the first '\n' or '\r', or `n` if there is none
+size_t kdl_scan_line(const char *p, size_t n);
+// Offset of the first `c`, or `n` if there is none
+size_t kdl_scan_char(const char *p, size_t n, char c);
+
+#endif
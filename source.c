@@ -0,0 +1,112 @@
+#include "source.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READ_BUFFER_SIZE 4096
+
+// --- Static helper methods ---
+
+static kdl_error_t mkSourceError(int code, const char *message, const char *data);
+static kdl_error_t readAll(kdl_state_t s, int fd, kdl_source_t *out);
+
+kdl_error_t mkSourceError(int code, const char *message, const char *data) {
+    kdl_error_t e;
+    e.code = code;
+    e.message = message;
+    e.data = data;
+    e.dataLen = 0;
+    e.hasDataLen = false;
+    return e;
+}
+
+// For whatever could not be mapped
+kdl_error_t readAll(kdl_state_t s, int fd, kdl_source_t *out) {
+    size_t size = READ_BUFFER_SIZE;
+    size_t length = 0;
+    char *buffer = (char *) s.malloc(sizeof(char) * size);
+    while (true) {
+        if (length == size) {
+            size *= 2;
+            buffer = (char *) s.realloc(buffer, sizeof(char) * size);
+        }
+        ssize_t got = read(fd, buffer + length, size - length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            s.free(buffer);
+            return mkSourceError(KDL_ERR_VAL, "Could not read program", "");
+        }
+        if (got == 0) {
+            break;
+        }
+        length += (size_t) got;
+    }
+    out->data = buffer;
+    out->length = length;
+    out->kind = KDL_SOURCE_HEAP;
+    return mkSourceError(KDL_ERR_OK, "No error", NULL);
+}
+
+// --- Exported methods ---
+
+// --- Memory and initailization ---
+
+kdl_error_t kdl_source_openFile(kdl_state_t s, const char *path, kdl_source_t *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return mkSourceError(KDL_ERR_NTF, "Could not open program file", path);
+    }
+    kdl_error_t e = kdl_source_openFd(s, fd, out);
+    close(fd);
+    return e;
+}
+
+kdl_error_t kdl_source_openFd(kdl_state_t s, int fd, kdl_source_t *out) {
+    memset(out, 0, sizeof(kdl_source_t));
+    out->s = s;
+    out->data = "";
+    out->kind = KDL_SOURCE_EMPTY;
+
+    struct stat st;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && start >= 0) {
+        if (st.st_size <= start) {
+            return mkSourceError(KDL_ERR_OK, "No error", NULL);
+        }
+        // The mapping has to start on a page boundary
+        off_t pageStart = start - start % sysconf(_SC_PAGESIZE);
+        size_t mapLen = (size_t) (st.st_size - pageStart);
+        void *map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, pageStart);
+        if (map != MAP_FAILED) {
+            madvise(map, mapLen, MADV_SEQUENTIAL);
+            out->data = (const char *) map + (start - pageStart);
+            out->length = (size_t) (st.st_size - start);
+            out->kind = KDL_SOURCE_MAPPED;
+            return mkSourceError(KDL_ERR_OK, "No error", NULL);
+        }
+    }
+    return readAll(s, fd, out);
+}
+
+void kdl_source_close(kdl_source_t *src) {
+    switch (src->kind) {
+    case KDL_SOURCE_MAPPED: {
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t) src->data;
+        uintptr_t pageStart = start - start % (uintptr_t) page;
+        munmap((void *) pageStart, src->length + (start - pageStart));
+        break;
+    }
+    case KDL_SOURCE_HEAP:
+        src->s.free((void *) src->data);
+        break;
+    }
+    memset(src, 0, sizeof(kdl_source_t));
+}
@@ -0,0 +1,35 @@
+#ifndef KDL_SOURCE_H_INCLUDED
+#define KDL_SOURCE_H_INCLUDED
+
+#include <stddef.h>
+
+#include "def.h"
+
+// Program text read from a file or file descriptor, for kdl_parseN().
+// Regular files are memory mapped rather than copied, so loading a large
+// rule set costs no more heap than the parsed program itself. Anything
+// that can't be mapped (pipes, sockets...) is read into memory instead.
+
+#define KDL_SOURCE_EMPTY  0
+#define KDL_SOURCE_MAPPED 1
+#define KDL_SOURCE_HEAP   2
+
+// --- Structures ---
+
+typedef struct {
+    kdl_state_t s;
+    // Not null terminated
+    const char *data;
+    size_t length;
+    // KDL_SOURCE_*, how `data` has to be released
+    int kind;
+} kdl_source_t;
+
+// --- Memory and initailization ---
+
+kdl_error_t kdl_source_openFile(kdl_state_t s, const char *path, kdl_source_t *out);
+// Reads from the current position to the end. Does not close `fd`.
+kdl_error_t kdl_source_openFd(kdl_state_t s, int fd, kdl_source_t *out);
+void kdl_source_close(kdl_source_t *src);
+
+#endif
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "compile.h"
+
+#define PATH "test_binary.kdlc"
+
+int failures = 0;
+
+// The verbs run by the last tick, in order, with their first parameter
+char ran[256];
+
+void record(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
+    (void) m;
+    (void) context;
+    size_t len = strlen(ran);
+    const char *sep = len > 0 ? " " : "";
+    if (length > 0 && params[0].datatype == KDL_DT_INT) {
+        snprintf(ran + len, sizeof(ran) - len, "%s%s %lld", sep, name, params[0].value.i);
+    } else {
+        snprintf(ran + len, sizeof(ran) - len, "%s%s", sep, name);
+    }
+}
+
+void expect(const char *name, const char *expect, const char *got) {
+    printf("Testing '%s': ", name);
+    if (strcmp(expect, got) != 0) {
+        printf("FAIL: Expect '%s', got '%s'\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: '%s'\n", got);
+    }
+}
+
+void tick(kdl_machine_t *m) {
+    ran[0] = '\0';
+    kdl_machine_run(m);
+}
+
+int main() {
+    kdl_state_t s = {malloc, realloc, free};
+    kdl_program_t p;
+    kdl_error_t e = kdl_parse(s, "(x > 1 ? parent {x} :: (? child {y}) (x > 2 ? other))\n(? top)", &p);
+    if (e.code == KDL_ERR_OK) {
+        e = kdl_compileFile(s, &p, PATH);
+        kdl_freeProgram(s, &p);
+    }
+    expect("compile", "No error", e.message);
+
+    // The mapping is read only, so running it shows that the machine keeps
+    // everything it needs elsewhere
+    kdl_machine_t m;
+    kdl_mkMachine(&m);
+    kdl_verb_t verb;
+    memset(&verb, 0, sizeof(kdl_verb_t));
+    verb.func = record;
+    kdl_machine_addDefVerb(&m, verb);
+    kdl_machine_setInt(&m, "x", 2);
+    kdl_machine_setInt(&m, "y", 5);
+    e = kdl_machine_loadBinary(&m, PATH);
+    expect("load", "No error", e.message);
+    tick(&m);
+    expect("tick 1", "parent 2 top", ran);
+    kdl_machine_setInt(&m, "x", 3);
+    tick(&m);
+    expect("tick 2", "parent 3 top child 5 other", ran);
+
+    // Twice, with the slots of the first load given back
+    e = kdl_machine_loadBinary(&m, PATH);
+    expect("load again", "No error", e.message);
+    kdl_machine_removeVars(&m, "y");
+    tick(&m);
+    tick(&m);
+    expect("load again, tick 2", "parent 3 top child 0 other", ran);
+
+    kdl_machine_free(&m);
+    unlink(PATH);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "machine.h"
+
+int failures = 0;
+
+void expect(const char *name, const char *expect, const char *got) {
+    printf("Testing '%s': ", name);
+    if (strcmp(expect, got) != 0) {
+        printf("FAIL: Expect '%s', got '%s'\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: '%s'\n", got);
+    }
+}
+
+// The context of the last verb named "q" to run
+char context[256];
+
+void record(kdl_machine_t *m, const char *ctx, const char *name, kdl_data_t *params, size_t length) {
+    (void) m;
+    (void) params;
+    (void) length;
+    if (strcmp(name, "q") == 0) {
+        snprintf(context, sizeof(context), "%s", ctx);
+    }
+}
+
+// Runs `program` three times, for grandchildren to run too
+void expectContext(const char *program, bool lazy, const char *expected) {
+    kdl_machine_t m;
+    kdl_mkMachine(&m);
+    m.lazy = lazy;
+    kdl_verb_t verb;
+    memset(&verb, 0, sizeof(kdl_verb_t));
+    verb.func = record;
+    kdl_machine_addDefVerb(&m, verb);
+
+    strcpy(context, "not run");
+    if (kdl_machine_load(&m, program).code == KDL_ERR_OK) {
+        for (int i = 0; i < 3; i++) {
+            kdl_machine_run(&m);
+        }
+    }
+    char name[256];
+    snprintf(name, sizeof(name), "%s%s", program, lazy ? ", lazy" : "");
+    expect(name, expected, context);
+    kdl_machine_free(&m);
+}
+
+int main() {
+    for (int lazy = 0; lazy < 2; lazy++) {
+        // Each '^' past the first drops one word of the parent's context
+        expectContext("(a b c: ? p :: (^^e: ? q))", lazy, "a b e");
+        expectContext("(a b c: ? p :: (^e: ? q))", lazy, "a b c e");
+        expectContext("(a b c: ? p :: (^^^e: ? q))", lazy, "a e");
+        // Without '^', a mark starts over
+        expectContext("(a b c: ? p :: (e: ? q))", lazy, "e");
+        expectContext("(a b c: ? p :: (? q))", lazy, "a b c");
+        // Jumps further down see the words kept by the ones above
+        expectContext("(a b c: ? p :: (^^e f: ? p :: (^^g: ? q)))", lazy, "a b e g");
+    }
+    return failures ? 1 : 0;
+}
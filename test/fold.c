@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "machine.h"
+
+int failures = 0;
+
+void expect(const char *name, const char *expect, const char *got) {
+    printf("Testing '%s': ", name);
+    if (strcmp(expect, got) != 0) {
+        printf("FAIL: Expect '%s', got '%s'\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: '%s'\n", got);
+    }
+}
+
+// Ops by name, and literals by value
+void describeOps(const kdl_compute_t *c, char *out, size_t size) {
+    static const char *NAMES[] = {"noop", "int", "float", "str", "var", "+", "-", "/", "*",
+                                  "=", "<=", ">=", "<", ">", ",", ";", "!", "perc"};
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < c->length && len < size; i++) {
+        const kdl_op_t *op = &c->opers[i];
+        const char *sep = i > 0 ? " " : "";
+        switch (op->op) {
+        case KDL_OP_PINT:
+            len += snprintf(out + len, size - len, "%s%lld", sep, *((const kdl_int_t *) op->value));
+            break;
+        case KDL_OP_PFLOAT:
+            len += snprintf(out + len, size - len, "%s%.2Lf", sep, *((const kdl_float_t *) op->value));
+            break;
+        case KDL_OP_PVAR:
+            len += snprintf(out + len, size - len, "%s{%s}", sep, (const char *) op->value);
+            break;
+        default:
+            len += snprintf(out + len, size - len, "%s%s", sep, NAMES[op->op + 1]);
+        }
+    }
+}
+
+// The condition of the first rule of `program`, once folded
+void expectCondition(const char *program, const char *ops) {
+    kdl_state_t s = {malloc, realloc, free};
+    kdl_program_t p;
+    char got[256] = "parse error";
+    if (kdl_parse(s, program, &p).code == KDL_ERR_OK) {
+        describeOps(&p.rules[0].compute, got, sizeof(got));
+        kdl_freeProgram(s, &p);
+    }
+    expect(program, ops, got);
+}
+
+// What verbs were given, one value per parameter
+char given[256];
+
+void record(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
+    (void) m;
+    (void) context;
+    (void) name;
+    size_t len = 0;
+    given[0] = '\0';
+    for (size_t i = 0; i < length; i++) {
+        const char *sep = i > 0 ? " " : "";
+        switch (params[i].datatype) {
+        case KDL_DT_INT:
+            len += snprintf(given + len, sizeof(given) - len, "%sint %lld", sep, params[i].value.i);
+            break;
+        case KDL_DT_FLT:
+            len += snprintf(given + len, sizeof(given) - len, "%sfloat %.2Lf", sep, params[i].value.f);
+            break;
+        case KDL_DT_STR:
+            len += snprintf(given + len, sizeof(given) - len, "%sstr %s", sep, params[i].value.s);
+            break;
+        default:
+            len += snprintf(given + len, sizeof(given) - len, "%s?", sep);
+        }
+    }
+}
+
+// What the verb of `program` gets, with x set to 3 and f to 2.5
+void expectParams(const char *program, const char *params) {
+    kdl_machine_t m;
+    kdl_mkMachine(&m);
+    kdl_verb_t verb;
+    memset(&verb, 0, sizeof(kdl_verb_t));
+    verb.func = record;
+    kdl_machine_addDefVerb(&m, verb);
+    kdl_machine_setInt(&m, "x", 3);
+    kdl_machine_setFloat(&m, "f", 2.5);
+
+    strcpy(given, "not run");
+    if (kdl_machine_load(&m, program).code == KDL_ERR_OK) {
+        kdl_machine_run(&m);
+    }
+    expect(program, params, given);
+    kdl_machine_free(&m);
+}
+
+int main() {
+    // Literals are folded into one constant
+    expectCondition("((2 * 60) + 5 ? a)", "125");
+    expectCondition("(2 * (60 + 5) ? a)", "130");
+    expectCondition("(2.5 * 2 ? a)", "5.00");
+    expectCondition("(7 ? a)", "7");
+
+    // Identities go next to what is sure to be a number
+    expectCondition("(({x} * 2) + 0 ? a)", "{x} 2 *");
+    expectCondition("(1 * ({x} - 3) ? a)", "{x} 3 -");
+    expectCondition("(({x} + 1) / 1 ? a)", "{x} 1 +");
+    // But not next to a variable, which may hold a string
+    expectCondition("({x} + 0 ? a)", "{x} 0 +");
+    expectCondition("(0 + {x} ? a)", "0 {x} +");
+    expectCondition("(1 * {x} ? a)", "1 {x} *");
+    expectCondition("({x} / 1 ? a)", "{x} 1 /");
+    // Nor when it would turn an int into a float
+    expectCondition("(({x} * 2) * 1.0 ? a)", "{x} 2 * 1.00 *");
+
+    // "!!" only goes where just the truth of the value matters
+    expectCondition("(!!{x} , {y} ? a)", "{x} {y} ,");
+    expectCondition("(!!!{x} ? a)", "{x} !");
+    expectCondition("(!!{x} ? a)", "{x} ! !");
+
+    // The machine gets the same values as without folding
+    expectParams("(? a (2 * 60 + 5) 7 2.5)", "int 125 int 7 float 2.50");
+    expectParams("(? a ({x} + 0) ({f} * 1) (({x} * 2) + 0))", "int 3 float 2.50 int 6");
+    expectParams("(? a (!!{x}) (!!{x} , 1))", "int 1 int 1");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+int failures = 0;
+
+void expect(const char *name, long long expect, long long got) {
+    printf("Testing '%s': ", name);
+    if (expect != got) {
+        printf("FAIL: Expect %lld, got %lld\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: %lld\n", got);
+    }
+}
+
+size_t freed = 0;
+
+// Values are numbers, not allocations
+void countFree(kdl_state_t s, void *data) {
+    (void) s;
+    (void) data;
+    freed++;
+}
+
+// Every seventh key is too long to be kept inline
+void mkKey(size_t i, char *out, size_t size) {
+    if (i % 7 == 0) {
+        snprintf(out, size, "a key long enough for the heap %zu", i);
+    } else {
+        snprintf(out, size, "key %zu", i);
+    }
+}
+
+void *valueOf(size_t i) {
+    return (void *) (uintptr_t) (i + 1);
+}
+
+kdl_hashmap_t mkMap(int precision) {
+    kdl_state_t s = {malloc, realloc, free};
+    kdl_hashmap_t m;
+    kdl_hashmap_init(s, &m, precision, countFree, NULL);
+    return m;
+}
+
+// Elements whose value is wrong, or that can't be found
+size_t countMissing(kdl_hashmap_t *m, size_t n, size_t *inOld) {
+    size_t missing = 0;
+    char key[64];
+    for (size_t i = 0; i < n; i++) {
+        mkKey(i, key, sizeof(key));
+        kdl_hashmap_result_t r;
+        void *data = NULL;
+        if (kdl_hashmap_search(m, key, &r) == KDL_HASHMAP_EOK) {
+            kdl_hashmap_get(m, r, &data);
+            if (inOld != NULL && r.data == 1) {
+                (*inOld)++;
+            }
+        }
+        missing += data != valueOf(i);
+    }
+    return missing;
+}
+
+// Elements that iteration visits other than exactly once
+size_t countMisvisited(kdl_hashmap_t *m, size_t n) {
+    size_t *visits = (size_t *) calloc(n, sizeof(size_t));
+    size_t wrong = 0;
+    for (kdl_hashmap_result_t r = kdl_hashmap_first(m); r.code == KDL_HASHMAP_EOK; kdl_hashmap_next(m, &r)) {
+        void *data;
+        kdl_hashmap_get(m, r, &data);
+        size_t i = (size_t) (uintptr_t) data - 1;
+        if (i < n) {
+            visits[i]++;
+        } else {
+            wrong++;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        wrong += visits[i] != 1;
+    }
+    free(visits);
+    return wrong;
+}
+
+void testTombstones() {
+    kdl_hashmap_t m = mkMap(4);
+    size_t buckets = m.table.nBuckets;
+
+    // Same hash, same probe: the slot it left is the first one found
+    kdl_hashmap_insert(&m, "key", valueOf(0));
+    kdl_hashmap_result_t r;
+    kdl_hashmap_search(&m, "key", &r);
+    kdl_hashmap_remove(&m, r);
+    expect("remove leaves a tombstone", 1, m.table.nDeleted);
+    kdl_hashmap_insert(&m, "key", valueOf(0));
+    expect("reinsert reuses the tombstone", 0, m.table.nDeleted);
+    kdl_hashmap_search(&m, "key", &r);
+    kdl_hashmap_remove(&m, r);
+
+    // A few elements at a time, but many overall
+    char key[64];
+    for (size_t i = 0; i < 10000; i++) {
+        mkKey(i, key, sizeof(key));
+        kdl_hashmap_insert(&m, key, valueOf(i));
+        if (i >= 4) {
+            mkKey(i - 4, key, sizeof(key));
+            kdl_hashmap_search(&m, key, &r);
+            kdl_hashmap_remove(&m, r);
+        }
+    }
+    expect("churn, size", 4, kdl_hashmap_size(&m));
+    expect("churn, table does not grow", buckets, m.table.nBuckets);
+    // "key" twice, then everything but the last four
+    expect("churn, values freed", 2 + 9996, freed);
+
+    kdl_hashmap_free(&m);
+}
+
+void testGrowth() {
+    kdl_hashmap_t m = mkMap(4);
+    size_t checks = 0;
+    size_t missing = 0;
+    size_t misvisited = 0;
+    size_t inOld = 0;
+    char key[64];
+    for (size_t i = 0; i < 5000; i++) {
+        mkKey(i, key, sizeof(key));
+        kdl_hashmap_insert(&m, key, valueOf(i));
+        if (m.rehashing && i % 5 == 0) {
+            checks++;
+            // Iterate first: searching migrates
+            misvisited += countMisvisited(&m, i + 1);
+            missing += countMissing(&m, i + 1, &inOld);
+        }
+    }
+    expect("growth, checked while rehashing", true, checks > 0);
+    expect("growth, found some in the old table", true, inOld > 0);
+    expect("growth, iteration visits each once", 0, misvisited);
+    expect("growth, search finds all", 0, missing);
+    expect("growth, size", 5000, kdl_hashmap_size(&m));
+    kdl_hashmap_free(&m);
+}
+
+void testReserve() {
+    kdl_hashmap_t m = mkMap(4);
+    kdl_hashmap_reserve(&m, 1000);
+    size_t buckets = m.table.nBuckets;
+    expect("reserve, done at once", false, m.rehashing);
+    expect("reserve, fits", true, buckets - buckets / 8 >= 1000);
+
+    char key[64];
+    for (size_t i = 0; i < 1000; i++) {
+        mkKey(i, key, sizeof(key));
+        kdl_hashmap_insert(&m, key, valueOf(i));
+    }
+    expect("reserve, no growth", buckets, m.table.nBuckets);
+    expect("reserve, no rehash", false, m.rehashing);
+
+    mkKey(999, key, sizeof(key));
+    kdl_hashmap_result_t r;
+    kdl_hashmap_search(&m, key, &r);
+    kdl_hashmap_handle_t kept = r.handle;
+    for (size_t i = 10; i < 999; i++) {
+        mkKey(i, key, sizeof(key));
+        kdl_hashmap_search(&m, key, &r);
+        kdl_hashmap_remove(&m, r);
+    }
+    kdl_hashmap_reclaim(&m);
+    expect("reclaim, shrinks", true, m.table.nBuckets < buckets && m.table.nBuckets <= 32);
+    expect("reclaim, no tombstones", 0, m.table.nDeleted);
+    expect("reclaim, size", 11, kdl_hashmap_size(&m));
+    expect("reclaim, search finds the rest", 0, countMissing(&m, 10, NULL));
+    void *data = NULL;
+    kdl_hashmap_getHandle(&m, kept, &data);
+    expect("reclaim, handle follows", 1000, (long long) (uintptr_t) data);
+    kdl_hashmap_free(&m);
+}
+
+void testHandles() {
+    kdl_hashmap_t m = mkMap(4);
+    kdl_hashmap_handle_t zero;
+    memset(&zero, 0, sizeof(zero));
+    expect("zeroed handle", false, kdl_hashmap_valid(&m, zero));
+
+    kdl_hashmap_handle_t first = kdl_hashmap_insert(&m, "key", valueOf(0));
+    expect("handle, valid", true, kdl_hashmap_valid(&m, first));
+    void *data = NULL;
+    expect("handle, get", KDL_HASHMAP_EOK, kdl_hashmap_getHandle(&m, first, &data));
+    expect("handle, value", 1, (long long) (uintptr_t) data);
+
+    kdl_hashmap_result_t r;
+    kdl_hashmap_search(&m, "key", &r);
+    kdl_hashmap_remove(&m, r);
+    expect("removed, invalid", false, kdl_hashmap_valid(&m, first));
+    expect("removed, get", KDL_HASHMAP_ENORESULT, kdl_hashmap_getHandle(&m, first, &data));
+
+    // Takes the freed id again, with a new generation
+    kdl_hashmap_handle_t second = kdl_hashmap_insert(&m, "key", valueOf(1));
+    expect("reinserted, same id", first.index, second.index);
+    expect("reinserted, old handle invalid", false, kdl_hashmap_valid(&m, first));
+    expect("reinserted, new handle valid", true, kdl_hashmap_valid(&m, second));
+    kdl_hashmap_getHandle(&m, second, &data);
+    expect("reinserted, value", 2, (long long) (uintptr_t) data);
+
+    // Through growth, the element moves but the handle follows
+    char key[64];
+    for (size_t i = 0; i < 1000; i++) {
+        mkKey(i + 10, key, sizeof(key));
+        kdl_hashmap_insert(&m, key, valueOf(i + 10));
+    }
+    data = NULL;
+    kdl_hashmap_getHandle(&m, second, &data);
+    expect("grown, value", 2, (long long) (uintptr_t) data);
+
+    kdl_hashmap_clear(&m);
+    expect("cleared, invalid", false, kdl_hashmap_valid(&m, second));
+    kdl_hashmap_free(&m);
+}
+
+int main() {
+    testTombstones();
+    testGrowth();
+    testReserve();
+    testHandles();
+    return failures ? 1 : 0;
+}
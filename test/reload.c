@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "machine.h"
+
+int failures = 0;
+
+// The verbs run by the last tick, in order
+char ran[256];
+
+void record(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
+    (void) m;
+    (void) context;
+    (void) params;
+    (void) length;
+    if (ran[0] != '\0') {
+        strncat(ran, " ", sizeof(ran) - strlen(ran) - 1);
+    }
+    strncat(ran, name, sizeof(ran) - strlen(ran) - 1);
+}
+
+void expect(const char *name, const char *expect, const char *got) {
+    printf("Testing '%s': ", name);
+    if (strcmp(expect, got) != 0) {
+        printf("FAIL: Expect '%s', got '%s'\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: '%s'\n", got);
+    }
+}
+
+void expectCode(const char *name, int expect, int got) {
+    printf("Testing '%s': ", name);
+    if (expect != got) {
+        printf("FAIL: Expect %d, got %d\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: %d\n", got);
+    }
+}
+
+void tick(kdl_machine_t *m) {
+    ran[0] = '\0';
+    kdl_machine_run(m);
+}
+
+int main() {
+    kdl_machine_t m;
+    kdl_mkMachine(&m);
+    kdl_verb_t verb;
+    memset(&verb, 0, sizeof(kdl_verb_t));
+    verb.func = record;
+    kdl_machine_addDefVerb(&m, verb);
+
+    // The parent only runs once, so only the activated child keeps running
+    kdl_machine_setInt(&m, "x", 0);
+    kdl_machine_load(&m, "(x = 0 ? parent :: (? child))\n");
+    tick(&m);
+    expect("load, tick 1", "parent", ran);
+    kdl_machine_setInt(&m, "x", 1);
+    tick(&m);
+    expect("load, tick 2", "child", ran);
+
+    kdl_error_t e = kdl_machine_reload(&m, "(? other)\n(x = 0 ? parent :: (? child))\n");
+    expectCode("reload, rule added", KDL_ERR_OK, e.code);
+    tick(&m);
+    expect("reload, rule added, child survives", "other child", ran);
+
+    e = kdl_machine_reload(&m, "(? other)\n(x = 0 ? parent (");
+    expectCode("failed reload", KDL_ERR_EXP, e.code);
+    tick(&m);
+    expect("failed reload, old program runs", "other child", ran);
+
+    e = kdl_machine_reload(&m, "(? other)\n(x = 0 ? parent 2 :: (? child))\n");
+    expectCode("reload, parent changed", KDL_ERR_OK, e.code);
+    tick(&m);
+    expect("reload, parent changed, child dropped", "other", ran);
+
+    // Identical siblings are told apart by how many come before them
+    kdl_machine_setInt(&m, "x", 0);
+    e = kdl_machine_reload(&m, "(x = 0 ? parent :: (? child) (? child) (? other))\n");
+    tick(&m);
+    kdl_machine_setInt(&m, "x", 1);
+    tick(&m);
+    expect("identical siblings, all run", "child child other", ran);
+    e = kdl_machine_reload(&m, "(x = 0 ? parent :: (? child) (? other))\n");
+    expectCode("reload, sibling removed", KDL_ERR_OK, e.code);
+    tick(&m);
+    expect("reload, sibling removed, one kept", "child other", ran);
+
+    kdl_machine_free(&m);
+    return failures ? 1 : 0;
+}
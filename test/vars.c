@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "machine.h"
+
+int failures = 0;
+
+void expect(const char *name, long long expect, long long got) {
+    printf("Testing '%s': ", name);
+    if (expect != got) {
+        printf("FAIL: Expect %lld, got %lld\n", expect, got);
+        failures++;
+    } else {
+        printf("PASS: %lld\n", got);
+    }
+}
+
+long long getInt(kdl_machine_t *m, const char *name) {
+    kdl_int_t value = -1;
+    kdl_machine_getInt(m, name, &value);
+    return value;
+}
+
+// Sets "a" then "b" to its parameters, freeing their old strings
+void set(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
+    (void) context;
+    (void) name;
+    (void) length;
+    kdl_machine_setString(m, "a", params[0].value.s);
+    kdl_machine_setString(m, "b", params[1].value.s);
+}
+
+// Copies its parameter to "got"
+void get(kdl_machine_t *m, const char *context, const char *name, kdl_data_t *params, size_t length) {
+    (void) context;
+    (void) name;
+    (void) length;
+    kdl_machine_setInt(m, "got", params[0].value.i);
+}
+
+bool isString(kdl_machine_t *m, const char *name, const char *expect) {
+    const char *value = NULL;
+    kdl_machine_getString(m, name, &value);
+    return value != NULL && strcmp(value, expect) == 0;
+}
+
+int main() {
+    // Names that only differ in their spaces are different variables, for
+    // the context index too
+    const char *names[] = {"a b", "a  b", "a", " a", "a ", ""};
+    const size_t nNames = sizeof(names) / sizeof(names[0]);
+
+    kdl_machine_t m;
+    kdl_mkMachine(&m);
+    for (size_t i = 0; i < nNames; i++) {
+        kdl_machine_setInt(&m, names[i], (kdl_int_t) i + 1);
+    }
+    for (size_t i = 0; i < nNames; i++) {
+        char test[32];
+        snprintf(test, sizeof(test), "get \"%s\"", names[i]);
+        expect(test, (long long) i + 1, getInt(&m, names[i]));
+    }
+
+    expect("count \"\"", nNames, kdl_machine_countVars(&m, ""));
+    // "a", "a b", "a  b" and "a "
+    expect("count \"a\"", 4, kdl_machine_countVars(&m, "a"));
+    // "a  b" and "a "
+    expect("count \"a \"", 2, kdl_machine_countVars(&m, "a "));
+    expect("count \" a\"", 1, kdl_machine_countVars(&m, " a"));
+    expect("count \"a b\"", 1, kdl_machine_countVars(&m, "a b"));
+
+    kdl_machine_removeVars(&m, "a ");
+    expect("remove \"a \", count \"\"", nNames - 2, kdl_machine_countVars(&m, ""));
+    expect("remove \"a \", get \"a b\"", 1, getInt(&m, "a b"));
+    expect("remove \"a \", get \" a\"", 4, getInt(&m, " a"));
+
+    kdl_machine_removeVars(&m, "a");
+    expect("remove \"a\", count \"\"", 2, kdl_machine_countVars(&m, ""));
+    kdl_machine_removeVars(&m, "");
+    expect("remove \"\", count \"\"", 0, kdl_machine_countVars(&m, ""));
+
+    kdl_machine_free(&m);
+
+    // A verb's parameters outlive the variables they came from
+    kdl_mkMachine(&m);
+    kdl_verb_t verb;
+    memset(&verb, 0, sizeof(kdl_verb_t));
+    verb.func = set;
+    kdl_machine_addDefVerb(&m, verb);
+    kdl_machine_setString(&m, "a", "one");
+    kdl_machine_setString(&m, "b", "two");
+    kdl_machine_load(&m, "(? swap {b} {a})");
+    kdl_machine_run(&m);
+    expect("swap, a", true, isString(&m, "a", "two"));
+    expect("swap, b", true, isString(&m, "b", "one"));
+
+    // A program finds the variables it reads again once they are removed
+    verb.func = get;
+    kdl_machine_addVerb(&m, "get", verb);
+    kdl_machine_setInt(&m, "x", 5);
+    kdl_machine_load(&m, "(? get {x})");
+    kdl_machine_run(&m);
+    expect("program, get", 5, getInt(&m, "got"));
+    kdl_machine_removeVars(&m, "x");
+    kdl_machine_run(&m);
+    expect("program, removed", 0, getInt(&m, "got"));
+    kdl_machine_setInt(&m, "x", 7);
+    kdl_machine_run(&m);
+    expect("program, set again", 7, getInt(&m, "got"));
+
+    kdl_machine_free(&m);
+    return failures ? 1 : 0;
+}
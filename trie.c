@@ -0,0 +1,215 @@
+#include "trie.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define CHILDREN_START_SIZE 4
+
+// --- Static helper methods ---
+
+static bool nextSegment(const char **input, const char *end, const char **segment, size_t *segmentLen);
+static int compareSegment(const kdl_trie_node_t *node, const char *segment, size_t segmentLen);
+static bool findChild(const kdl_trie_node_t *node, const char *segment, size_t segmentLen, size_t *index);
+static kdl_trie_node_t *mkNode(kdl_state_t s, kdl_trie_node_t *parent, const char *segment, size_t segmentLen);
+static void insertChild(kdl_state_t s, kdl_trie_node_t *node, size_t index, kdl_trie_node_t *child);
+static void removeChild(kdl_trie_node_t *node, kdl_trie_node_t *child);
+static kdl_trie_node_t *findNode(const kdl_trie_t *t, const char *prefix);
+static void visitNode(const kdl_trie_node_t *node, kdl_trie_visit_t visit, void *user);
+static void freeNode(kdl_state_t s, kdl_trie_node_t *node, kdl_trie_visit_t visit, void *user);
+
+// Reads the next word of `[*input, end)`, where every single space ends a
+// word: the trie has to tell "a b", "a  b" and " a b" apart, like the maps
+// keyed on the same names do. `*input` is NULL once there are none left,
+// which is how the empty name starts (it is the root).
+bool nextSegment(const char **input, const char *end, const char **segment, size_t *segmentLen) {
+    const char *p = *input;
+    if (p == NULL) {
+        return false;
+    }
+    *segment = p;
+    for (; p < end && *p != ' '; p++);
+    *segmentLen = p - *segment;
+    *input = p < end ? p + 1 : NULL;
+    return true;
+}
+
+int compareSegment(const kdl_trie_node_t *node, const char *segment, size_t segmentLen) {
+    size_t len = node->segmentLen < segmentLen ? node->segmentLen : segmentLen;
+    int result = memcmp(node->segment, segment, len);
+    if (result != 0) {
+        return result;
+    }
+    return node->segmentLen < segmentLen ? -1 : node->segmentLen > segmentLen ? 1 : 0;
+}
+
+// Binary search. If not found, `index` is where the child would go.
+bool findChild(const kdl_trie_node_t *node, const char *segment, size_t segmentLen, size_t *index) {
+    size_t low = 0;
+    size_t high = node->nChildren;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = compareSegment(node->children[mid], segment, segmentLen);
+        if (cmp == 0) {
+            *index = mid;
+            return true;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *index = low;
+    return false;
+}
+
+kdl_trie_node_t *mkNode(kdl_state_t s, kdl_trie_node_t *parent, const char *segment, size_t segmentLen) {
+    kdl_trie_node_t *node = (kdl_trie_node_t *) s.malloc(sizeof(kdl_trie_node_t) + sizeof(char) * segmentLen);
+    node->parent = parent;
+    node->children = NULL;
+    node->nChildren = 0;
+    node->childrenSize = 0;
+    node->value = NULL;
+    node->count = 0;
+    node->segmentLen = segmentLen;
+    memcpy(node->segment, segment, sizeof(char) * segmentLen);
+    return node;
+}
+
+void insertChild(kdl_state_t s, kdl_trie_node_t *node, size_t index, kdl_trie_node_t *child) {
+    if (node->nChildren + 1 > node->childrenSize) {
+        node->childrenSize = node->childrenSize ? node->childrenSize * 2 : CHILDREN_START_SIZE;
+        node->children = (kdl_trie_node_t **) s.realloc(node->children, sizeof(kdl_trie_node_t *) * node->childrenSize);
+    }
+    memmove(node->children + index + 1, node->children + index, sizeof(kdl_trie_node_t *) * (node->nChildren - index));
+    node->children[index] = child;
+    node->nChildren++;
+}
+
+void removeChild(kdl_trie_node_t *node, kdl_trie_node_t *child) {
+    size_t index = 0;
+    bool found = findChild(node, child->segment, child->segmentLen, &index);
+    assert(found && node->children[index] == child);
+    (void) found;
+    memmove(node->children + index, node->children + index + 1, sizeof(kdl_trie_node_t *) * (node->nChildren - index - 1));
+    node->nChildren--;
+}
+
+// NULL if nothing has that prefix
+kdl_trie_node_t *findNode(const kdl_trie_t *t, const char *prefix) {
+    kdl_trie_node_t *node = t->root;
+    const char *end = prefix + strlen(prefix);
+    const char *p = prefix < end ? prefix : NULL;
+    const char *segment = NULL;
+    size_t segmentLen = 0;
+    while (nextSegment(&p, end, &segment, &segmentLen)) {
+        size_t index = 0;
+        if (!findChild(node, segment, segmentLen, &index)) {
+            return NULL;
+        }
+        node = node->children[index];
+    }
+    return node;
+}
+
+// Depth first, a node before its children, children in order
+void visitNode(const kdl_trie_node_t *node, kdl_trie_visit_t visit, void *user) {
+    if (node->value) {
+        visit(user, node->value);
+    }
+    for (size_t i = 0; i < node->nChildren; i++) {
+        visitNode(node->children[i], visit, user);
+    }
+}
+
+// `visit` may be NULL
+void freeNode(kdl_state_t s, kdl_trie_node_t *node, kdl_trie_visit_t visit, void *user) {
+    if (node->value && visit) {
+        visit(user, node->value);
+    }
+    for (size_t i = 0; i < node->nChildren; i++) {
+        freeNode(s, node->children[i], visit, user);
+    }
+    s.free(node->children);
+    s.free(node);
+}
+
+// --- Exported methods ---
+
+// --- Access & modification ---
+
+void kdl_trie_insert(kdl_trie_t *t, const char *name, size_t nameLen, void *value) {
+    assert(value != NULL);
+    kdl_trie_node_t *node = t->root;
+    const char *end = name + nameLen;
+    const char *p = nameLen > 0 ? name : NULL;
+    const char *segment = NULL;
+    size_t segmentLen = 0;
+    while (nextSegment(&p, end, &segment, &segmentLen)) {
+        size_t index = 0;
+        if (!findChild(node, segment, segmentLen, &index)) {
+            insertChild(t->s, node, index, mkNode(t->s, node, segment, segmentLen));
+        }
+        node = node->children[index];
+    }
+    assert(node->value == NULL);
+    node->value = value;
+    for (; node; node = node->parent) {
+        node->count++;
+    }
+}
+
+size_t kdl_trie_count(const kdl_trie_t *t, const char *prefix) {
+    kdl_trie_node_t *node = findNode(t, prefix);
+    return node ? node->count : 0;
+}
+
+void kdl_trie_forEach(const kdl_trie_t *t, const char *prefix, kdl_trie_visit_t visit, void *user) {
+    kdl_trie_node_t *node = findNode(t, prefix);
+    if (node) {
+        visitNode(node, visit, user);
+    }
+}
+
+void kdl_trie_removePrefix(kdl_trie_t *t, const char *prefix, kdl_trie_visit_t visit, void *user) {
+    kdl_trie_node_t *node = findNode(t, prefix);
+    if (!node) {
+        return;
+    }
+
+    // Detach it first so that `visit` sees a consistent trie
+    if (node == t->root) {
+        kdl_trie_init(t->s, t);
+        freeNode(t->s, node, visit, user);
+        return;
+    }
+
+    size_t removed = node->count;
+    kdl_trie_node_t *parent = node->parent;
+    removeChild(parent, node);
+    for (kdl_trie_node_t *p = parent; p; p = p->parent) {
+        p->count -= removed;
+    }
+
+    // Drop the ancestors that only existed for this subtree
+    while (parent != t->root && parent->count == 0 && parent->nChildren == 0) {
+        kdl_trie_node_t *next = parent->parent;
+        removeChild(next, parent);
+        freeNode(t->s, parent, NULL, NULL);
+        parent = next;
+    }
+
+    freeNode(t->s, node, visit, user);
+}
+
+// --- Memory and initailization ---
+
+void kdl_trie_free(kdl_trie_t *t) {
+    freeNode(t->s, t->root, NULL, NULL);
+    t->root = NULL;
+}
+
+void kdl_trie_init(kdl_state_t s, kdl_trie_t *t) {
+    t->s = s;
+    t->root = mkNode(s, NULL, "", 0);
+}
@@ -0,0 +1,59 @@
+#ifndef KDL_TRIE_H_INCLUDED
+#define KDL_TRIE_H_INCLUDED
+
+#include <stddef.h>
+
+#include "def.h"
+
+// Ordered index of names that are paths of space separated words
+// ("akatsuki armor health"). Every edge is one whole word, so everything
+// under a given context is a single subtree: it can be counted, walked or
+// dropped without looking at anything else.
+//
+// Every single space separates two words, so "a  b" has an empty word in
+// the middle and is not "a b". The empty name is the root.
+
+// --- Structures ---
+
+typedef struct kdl_trie_node_p {
+    struct kdl_trie_node_p *parent;
+    // Sorted by segment
+    struct kdl_trie_node_p **children;
+    size_t nChildren;
+    size_t childrenSize;
+    // NULL if no name ends here
+    void *value;
+    // Number of values in this subtree, this node's included
+    size_t count;
+    size_t segmentLen;
+    // Not null terminated
+    char segment[];
+} kdl_trie_node_t;
+
+typedef struct {
+    kdl_state_t s;
+    kdl_trie_node_t *root;
+} kdl_trie_t;
+
+// Called for every value, in order of their names
+typedef void(*kdl_trie_visit_t)(void *user, void *value);
+
+// --- Access & modification ---
+
+// The name must not already be in the trie
+void kdl_trie_insert(kdl_trie_t *t, const char *name, size_t nameLen, void *value);
+// Number of names equal to `prefix` or starting with `prefix` and a space.
+// The empty prefix matches everything.
+size_t kdl_trie_count(const kdl_trie_t *t, const char *prefix);
+void kdl_trie_forEach(const kdl_trie_t *t, const char *prefix, kdl_trie_visit_t visit, void *user);
+// Takes everything that count() would have counted out of the trie.
+// `visit` gets every removed value, so that the caller can free it.
+void kdl_trie_removePrefix(kdl_trie_t *t, const char *prefix, kdl_trie_visit_t visit, void *user);
+
+// --- Memory and initailization ---
+
+// Does not free the values
+void kdl_trie_free(kdl_trie_t *t);
+void kdl_trie_init(kdl_state_t s, kdl_trie_t *t);
+
+#endif